@@ -20,8 +20,11 @@
 #ifndef NEMU_SERIALIZER_H
 #define NEMU_SERIALIZER_H
 
+#include <chrono>
 #include <string>
 #include <map>
+#include <vector>
+#include <sys/types.h>
 
 
 class Serializer
@@ -44,7 +47,42 @@ class Serializer
     void notify_taken(uint64_t i);
 
     uint64_t next_index();
+
+    /** Wait for all checkpoint workers and report the time spent waiting */
+    void finish();
   private:
+    /**
+     * With cptJobs > 1, every checkpoint is serialized by a forked worker
+     * from its private copy of the guest, while the driver goes on to the
+     * next checkpoint.
+     */
+    int cptJobs{1};
+    std::vector<pid_t> workerPids;
+    uint64_t cptTaken{0};
+    std::chrono::steady_clock::time_point startTime;
+    // time the driver was blocked waiting for workers to exit
+    std::chrono::steady_clock::duration waitTime{0};
+
+    void serializeInWorker(uint64_t inst_count);
+    void reapWorker();
+
+    /**
+     * With deltaChain > 0, up to deltaChain uniform checkpoints after a full
+     * one only hold the pages changed since the previous checkpoint. Changed
+     * pages are found by comparing the hash of each page with the one taken
+     * at the previous checkpoint. Deltas are written as _<inst>_.delta.zstd.
+     */
+    int deltaChain{0};
+    int deltaTaken{0};
+    bool writeDelta{false};
+    std::vector<uint64_t> pageHashes;
+    std::vector<uint64_t> deltaPages;
+    std::string lastCptFile;
+    std::string deltaParent;
+
+    void findDeltaPages(const std::string &base_path);
+    void serializeDelta(const std::string &filepath);
+    std::string cptBasePath(uint64_t inst_count);
 
     uint64_t intervalSize{10 * 1000 * 1000};
 
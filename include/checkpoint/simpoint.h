@@ -41,7 +41,10 @@
 #ifndef __CPU_SIMPLE_PROBES_SIMPOINT_HH__
 #define __CPU_SIMPLE_PROBES_SIMPOINT_HH__
 
-#include <unordered_map>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <sys/types.h>
 #include <base/output.h>
 
 namespace SimPointNS {
@@ -57,23 +60,35 @@ using Addr = uint64_t;
  *  - second: PC of last inst in basic block
  */
 typedef std::pair<Addr, Addr> BasicBlockRange;
-}
 
-/** Overload hash function for BasicBlockRange type */
-namespace std {
-using SimPointNS::BasicBlockRange;
-using SimPointNS::Addr;
-template<>
-struct hash<BasicBlockRange>
+/**
+ * Flat open-addressing hash table of basic blocks. Blocks are numbered
+ * from 1 in the order they are inserted, and a slot only holds the id,
+ * so that a lookup touches one slot and one entry of the range vector.
+ */
+class BBTable
 {
   public:
-    size_t operator()(const BasicBlockRange &bb) const {
-      return hash<Addr>()(bb.first + bb.second);
-    }
-};
-}
+    BBTable();
 
-namespace SimPointNS {
+    /** Look up bb and return its id, inserting it if it is new */
+    uint64_t findOrInsert(const BasicBlockRange &bb, bool &inserted);
+
+    /** Range of the block with the given id */
+    const BasicBlockRange &range(uint64_t id) const { return ranges[id - 1]; }
+
+    /** Number of blocks, which is also the largest id */
+    uint64_t size() const { return ranges.size(); }
+
+  private:
+    /** Ids of the blocks, 0 for an empty slot */
+    std::vector<uint32_t> slots;
+    /** Ranges of the blocks, indexed by id - 1 */
+    std::vector<BasicBlockRange> ranges;
+
+    static uint64_t hash(const BasicBlockRange &bb);
+    void grow();
+};
 
 class SimPoint
 {
@@ -93,8 +108,53 @@ class SimPoint
 
     void profile_with_abs_icount(Addr pc, bool is_control, bool is_last_uop, uint64_t abs_icount);
 
+    /**
+     * Add count insts of a basic block counted outside, which must not
+     * reach the end of the interval. See CONFIG_TCACHE_BB_COUNTER.
+     */
+    void profileBlock(Addr start, Addr end, uint64_t count);
+
+    /** Start the current basic block at pc after counting outside */
+    void resume(Addr pc, uint64_t abs_icount);
+
+    /** Number of insts which can be counted outside before the interval may end */
+    uint64_t intervalBudget() const;
+
+    /** Write the id table of this shard and leave, called at exit in a worker */
+    void finishShard();
+    /** Wait for all workers and merge their shards into simpointStream */
+    void mergeShards();
+
   private:
-    uint64_t lastICount{0};
+    /**
+     * Parallel profiling: the driver process only follows the interval
+     * boundaries and forks a worker at the start of every shard of
+     * shardIntervals intervals. Workers number basic blocks locally, and
+     * the driver renumbers them in shard order when merging, which gives
+     * the same ids as a serial run.
+     */
+    enum ShardRole { NoShard, ShardDriver, ShardWorker };
+    ShardRole shardRole{NoShard};
+    uint64_t shardIntervals{0};
+    int profilingJobs{1};
+    /** Intervals ended in the driver, or in the shard of a worker */
+    uint64_t intervalNum{0};
+    /** Index of the shard profiled by a worker */
+    int shardIdx{0};
+    /** pids of the workers, indexed by shard */
+    std::vector<pid_t> workers;
+    /** Workers before this index have exited */
+    size_t reapedWorkers{0};
+    /** BBV output of a worker, with local basic block ids */
+    std::ofstream shardStream;
+
+    void recordBlock(const BasicBlockRange &bb, uint64_t count);
+    std::ostream &bbvStream();
+    std::string shardPath(int shard, const char *suffix) const;
+    void forkWorker();
+    void reapWorker();
+    void printInterval(std::ostream &os, const std::vector<std::pair<uint64_t, uint64_t> > &counts);
+
     /** SimPoint profiling interval size in instructions */
     uint64_t intervalSize;
 
@@ -108,8 +168,6 @@ class SimPoint
     /** Basic Block information */
     struct BBInfo
     {
-        /** Unique ID */
-        uint64_t id;
         /** Num of static insts in BB */
         uint64_t insts;
         /** Accumulated dynamic inst count executed by BB */
@@ -117,11 +175,27 @@ class SimPoint
     };
 
     /** Hash table containing all previously seen basic blocks */
-    ::std::unordered_map<BasicBlockRange, BBInfo> bbMap;
-    /** Currently executing basic block */
-    BasicBlockRange currentBBV;
-    /** inst count in current basic block */
-    uint64_t currentBBVInstCount;
+    BBTable bbTable;
+    /** Information of the basic blocks, indexed by id - 1 */
+    ::std::vector<BBInfo> bbInfo;
+    /** Ids of the basic blocks executed in the current interval */
+    ::std::vector<uint64_t> dirtyBBs;
+    /**
+     * Instruction stream of a hart. With CONFIG_SMP_DETERMINISTIC, the
+     * interleaved streams of all harts are profiled into the same intervals,
+     * while each hart keeps its own current basic block.
+     */
+    struct Stream
+    {
+        uint64_t lastICount{0};
+        /** Currently executing basic block */
+        BasicBlockRange currentBBV{0, 0};
+        /** inst count in current basic block */
+        uint64_t currentBBVInstCount{0};
+    };
+    /** Indexed by hart id */
+    ::std::vector<Stream> streams;
+    Stream &stream();
 };
 
 }
@@ -29,6 +29,13 @@
 #define PMEM64 1
 #endif
 
+// State owned by each hart, which runs on its own host thread with CONFIG_SMP
+#ifdef CONFIG_SMP
+#define HART_LOCAL __thread
+#else
+#define HART_LOCAL
+#endif
+
 typedef MUXDEF(CONFIG_ISA64, uint64_t, uint32_t) word_t;
 typedef MUXDEF(CONFIG_ISA64, int64_t, int32_t)  sword_t;
 #define FMT_WORD MUXDEF(CONFIG_ISA64, "0x%016lx", "0x%08x")
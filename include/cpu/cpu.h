@@ -34,9 +34,13 @@ __attribute__((noreturn)) void longjmp_exception(int ex_cause);
 enum {
   SYS_STATE_UPDATE = 1,
   SYS_STATE_FLUSH_TCACHE = 2,
+  SYS_STATE_LOOKUP_TCACHE = 4, // look up the next basic block again
 };
 void set_sys_state_flag(int flag);
 void mmu_tlb_flush(vaddr_t vaddr);
+void mmu_tlb_flush_ctx(vaddr_t vaddr, uint32_t ctx, uint32_t ctx_mask);
+void mmu_ctx_switch();
+void mmu_icache_flush();
 
 struct Decode;
 void save_globals(struct Decode *s);
@@ -46,28 +50,25 @@ void clint_take_snapshot();
 void lightqs_take_spec_reg_snapshot();
 void clint_take_spec_snapshot();
 uint64_t lightqs_restore_reg_snapshot(uint64_t n);
-#ifdef CONFIG_LIGHTQS
-void pmem_record_restore(uint64_t restore_inst_cnt);
-#endif
 void clint_restore_snapshot(uint64_t restore_inst_cnt);
 
+#ifdef CONFIG_LIGHTQS
+#include <isa.h>
+
+// Snapshots of RAM are taken with the register snapshots, by saving each
+// page before its first store after the snapshot.
+void lightqs_take_pmem_snapshot();
+void lightqs_take_spec_pmem_snapshot();
+// called by lightqs_restore_reg_snapshot(), which picks the snapshot
+void pmem_record_restore(bool spec);
+
 struct lightqs_reg_ss {
   uint64_t inst_cnt;
   uint64_t br_cnt;
-  // snapshot stores GPR CSR
-  uint64_t mstatus, mcause, mepc, sstatus, scause, sepc,
-  satp, mip, mie, mscratch, sscratch, mideleg, medeleg,
-  mtval, stval, mtvec, stvec;
-#ifdef CONFIG_RVV
-  uint64_t vtype, vstart, vxsat, vxrm, vl;
-#endif // CONFIG_RVV
-  uint64_t gpr[32], fpr[32];
-  uint64_t mode;
-  uint64_t pc;
-  uint64_t lr_addr, lr_valid;
-  // RAM is store-logged at another position
-
+  CPU_state cpu;
+  rtlreg_t csr[4096];
   int ifetch_mmu_state;
   int data_mmu_state;
 };
 #endif
+#endif
@@ -44,6 +44,11 @@ enum {
   INSTR_TYPE_I, // indirect
 };
 
+#ifdef CONFIG_TCACHE_SUPERBLOCK
+// superblock states of a basic block end, other values count its exits
+enum { SB_OFF = 0xfe, SB_INNER = 0xff };
+#endif
+
 typedef struct Decode {
   union {
     struct {
@@ -54,6 +59,12 @@ typedef struct Decode {
       struct Decode *list_next; // next pointer for list
       struct Decode *bb_src;    // pointer recording the source of basic block direction
     };
+#ifdef CONFIG_ENGINE_JIT
+    struct {  // only used by the first instruction of a run translated by the JIT
+      const void *jcode;   // host code of the run
+      const void *jhelper; // original EHelper of this instruction
+    };
+#endif
   };
   vaddr_t pc;
   vaddr_t snpc; // sequential next pc
@@ -63,6 +74,13 @@ typedef struct Decode {
   vaddr_t jnpc;
   uint16_t idx_in_bb; // the number of instruction in the basic block, start from 1
   uint8_t type;
+  IFDEF(CONFIG_TCACHE_SUPERBLOCK, uint8_t sb);
+#ifdef CONFIG_TCACHE_BB_COUNTER
+  // SimPoint counter of the basic block ending with this instruction
+  vaddr_t bbc_start;       // pc where the counted basic block starts
+  uint64_t bbc_count;      // instructions counted but not drained
+  struct Decode *bbc_next; // next block end with a count to drain
+#endif
   ISADecodeInfo isa;
   IFDEF(CONFIG_DEBUG, char logbuf[80]);
   #ifdef CONFIG_RVV
@@ -0,0 +1,80 @@
+/***************************************************************************************
+* Copyright (c) 2014-2021 Zihao Yu, Nanjing University
+* Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_SMP_H__
+#define __CPU_SMP_H__
+
+#include <common.h>
+
+#ifdef CONFIG_SMP
+int smp_hart_id();
+
+// Hart 0 runs on the thread calling cpu_exec(). The other harts are
+// started to run the same number of instructions, and waited for.
+void smp_round_begin(uint64_t n);
+void smp_round_end();
+
+// Called by each hart around its batches, see CONFIG_SMP_DETERMINISTIC.
+// smp_hart_enter() returns false if the harts should stop.
+bool smp_hart_enter();
+void smp_hart_yield();
+void smp_hart_exit();
+
+// serialize accesses to devices when harts run in parallel
+void smp_io_lock();
+void smp_io_unlock();
+
+void smp_statistic();
+
+// Reservation sets of LR/SC, indexed by the host address of the guest
+// memory. Stores to a set reserved by some hart bump its version, and SC
+// fails if the version has changed since LR, even if the memory holds the
+// loaded value again.
+#define SMP_RESV_SHIFT 6
+#define SMP_RESV_NR 4096
+typedef struct SmpResv {
+  uint32_t holders;
+  uint32_t version;
+} SmpResv;
+extern SmpResv smp_resv_table[SMP_RESV_NR];
+
+static inline SmpResv* smp_resv(void *host) {
+  return &smp_resv_table[((uintptr_t)host >> SMP_RESV_SHIFT) % SMP_RESV_NR];
+}
+
+static inline void smp_resv_bump(SmpResv *r) {
+  if (unlikely(__atomic_load_n(&r->holders, __ATOMIC_SEQ_CST) != 0)) {
+    __atomic_fetch_add(&r->version, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+// called after every store to the guest memory
+static inline void smp_resv_store(void *host, int len) {
+  SmpResv *r = smp_resv(host);
+  smp_resv_bump(r);
+  SmpResv *r_end = smp_resv((uint8_t *)host + len - 1);
+  if (unlikely(r_end != r)) smp_resv_bump(r_end);
+}
+
+// defined in cpu-exec.c, the execution loop of a hart
+void cpu_exec_hart(uint64_t n);
+#else
+#define smp_io_lock()
+#define smp_io_unlock()
+#define smp_resv_store(host, len)
+#endif
+
+#endif
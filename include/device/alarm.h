@@ -16,7 +16,32 @@
 #ifndef __DEVICE_ALARM_H__
 #define __DEVICE_ALARM_H__
 
+#include <common.h>
+
 typedef void (*alarm_handler_t) ();
 void add_alarm_handle(alarm_handler_t h);
 
+#ifdef CONFIG_VIRTUAL_TIME
+// Virtual time is counted in instructions executed. An event is called by
+// cpu_exec() between batches, once the virtual time reaches its deadline.
+typedef void (*event_handler_t) ();
+int add_event(event_handler_t h);
+// Set the deadline of an event, UINT64_MAX to cancel it. A handler is called
+// once for each deadline.
+void schedule_event(int id, uint64_t deadline);
+
+uint64_t vtime_now();
+uint64_t vtime_us();
+// keep the virtual time going when the instruction counter is reset
+void vtime_instr_cnt_reset(uint64_t old_cnt, uint64_t new_cnt);
+
+void vtime_run_events();
+// limit a batch of n instructions to the next deadline
+int vtime_batch_size(int n);
+// Jump the virtual time to the next deadline when the hart has nothing
+// to do until then. Return the number of instructions skipped.
+uint64_t vtime_idle();
+void vtime_statistic();
+#endif
+
 #endif
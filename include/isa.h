@@ -29,10 +29,13 @@ typedef concat(__ISA__, _ISADecodeInfo) ISADecodeInfo;
 // monitor
 extern char isa_logo[];
 void init_isa();
+#ifdef CONFIG_SMP
+void isa_init_hart(int hartid);
+#endif
 
 // reg
-extern CPU_state cpu;
-extern rtlreg_t csr_array[4096];
+extern HART_LOCAL CPU_state cpu;
+extern HART_LOCAL rtlreg_t csr_array[4096];
 void isa_reg_display();
 word_t isa_reg_str2val(const char *name, bool *success);
 
@@ -53,7 +56,15 @@ int isa_mmu_state();
 int isa_mmu_check(vaddr_t vaddr, int len, int type);
 #endif
 paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type);
+// tag of the address space which instructions are currently fetched from
+#ifndef isa_ifetch_ctx
+uint32_t isa_ifetch_ctx();
+#endif
 bool isa_pmp_check_permission(paddr_t addr, int len, int type, int mode);
+// whether the host TLB may keep the translations to the page
+#ifndef isa_pmp_check_page
+bool isa_pmp_check_page(paddr_t paddr, int type);
+#endif
 
 // interrupt
 vaddr_t raise_intr(word_t NO, vaddr_t epc);
@@ -80,6 +91,9 @@ void isa_difftest_guided_exec(void *guide);
 #endif
 
 void isa_difftest_query_ref(void *result_buffer, uint64_t type);
+#ifdef CONFIG_DIFFTEST_COMMIT_LOG
+uint64_t isa_difftest_exec_commits(uint64_t n, void *log);
+#endif
 #ifdef CONFIG_BR_LOG
 void *isa_difftest_query_br_log(void);
 #endif // CONFIG_BR_LOG
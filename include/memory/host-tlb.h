@@ -23,5 +23,10 @@ word_t hosttlb_read(struct Decode *s, vaddr_t vaddr, int len, int type);
 void hosttlb_write(struct Decode *s, vaddr_t vaddr, int len, word_t data);
 void hosttlb_init();
 void hosttlb_flush(vaddr_t vaddr);
+void hosttlb_flush_ctx(vaddr_t vaddr, uint32_t ctx, uint32_t ctx_mask);
+void hosttlb_set_ctx(uint32_t data_ctx, uint32_t ifetch_ctx);
+void hosttlb_flush_write();
+paddr_t hosttlb_ifetch_paddr(vaddr_t vaddr);
+void hosttlb_statistic();
 
 #endif
@@ -17,12 +17,44 @@
 #define __IMAGE_LOADER_H__
 
 #include <stddef.h>
+#include <common.h>
 
+// Zstd checkpoints are written as independent frames of CPT_ZSTD_FRAME_SIZE
+// bytes, followed by a seek table in the zstd seekable format: a skippable
+// frame holding the compressed and decompressed size of each frame, and a
+// footer with the number of frames, a descriptor byte and a magic number.
+#define CPT_ZSTD_FRAME_SIZE (1 << 20)
+#define CPT_SKIPPABLE_MAGIC 0x184D2A5E
+#define CPT_SEEKABLE_MAGIC 0x8F92EAB1
+#define CPT_SEEK_TABLE_FOOTER_SIZE 9
+
+// A skippable frame before the seek table marks the non-zero pages of the
+// checkpoint. It holds the page size (4 bytes), the number of pages (8
+// bytes) and one bit per page. Its decompressed size in the seek table is 0.
+#define CPT_PAGE_BITMAP_MAGIC 0x184D2A5D
+
+// A delta checkpoint starts with a skippable frame holding the page size
+// (4 bytes), the number of pages (8 bytes), the length of the path of the
+// checkpoint it is based on (4 bytes), the path relative to the directory
+// of the delta, and one bit per changed page. The following frames hold
+// the changed pages in order.
+#define CPT_DELTA_MAGIC 0x184D2A5C
 
 long load_gz_img(const char *filename);
 
 long load_zstd_img(const char *filename);
 
+#ifdef CONFIG_MEM_COMPRESS_LAZY
+long load_zstd_img_lazy(const char *filename);
+
+// System calls reading into lazily restored memory fail instead of
+// faulting, so the memory must be filled before being passed to them.
+void lazy_restore_fill(void *haddr, size_t len);
+void lazy_restore_statistic();
+#else
+#define lazy_restore_fill(haddr, len)
+#endif
+
 long load_img(char *img_name, char *which_img, uint64_t load_start, size_t img_size);
 
 #endif //  __IMAGE_LOADER_H__
\ No newline at end of file
@@ -58,6 +58,17 @@ word_t paddr_read(paddr_t addr, int len, int type, int mode, vaddr_t vaddr);
 void paddr_write(paddr_t addr, int len, word_t data, int mode, vaddr_t vaddr);
 uint8_t *get_pmem();
 
+#ifdef CONFIG_PERF_OPT
+/* track the physical pages holding instructions decoded by the tcache */
+bool pmem_code_page_mark(paddr_t addr);
+void pmem_code_page_write(paddr_t addr, size_t len);
+bool pmem_code_page_is_code(paddr_t addr);
+bool pmem_code_page_is_dirty(paddr_t addr);
+int pmem_code_page_nr_dirty();
+void pmem_code_page_clean();
+void pmem_code_page_reset();
+#endif
+
 #if CONFIG_ENABLE_MEM_DEDUP || CONFIG_USE_MMAP
 /** Currently, when enable mmap, memory allocation is done by NEMU itself.
   * If one wants to control when is memory allocated,
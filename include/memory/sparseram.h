@@ -10,7 +10,6 @@
 #include <string>
 #include <map>
 #include <functional>
-#include <tuple>
 #endif
 
 // comm functions
@@ -80,14 +79,10 @@ class SparseRam
     
 public:
     unsigned block_size;
-    std::map<paddr_t, u_int8_t *> mem;
     std::map<std::string, sp_mm_blk *> big_block;
 
     ~SparseRam();
-    SparseRam(u_int block_count = 4, u_int chunk_size=1024){
-        this->block_size = block_count * chunk_size;
-        DEBUG("init SparseRam with block_size= %.2f kB (chunk_size=%d)", float(this->block_size)/1024.0, chunk_size);
-    }
+    SparseRam(u_int block_count = 4, u_int chunk_size=1024);
  
     bool load_bin(const char *file, paddr_t addr);
     bool load_elf(const char *file);
@@ -96,6 +91,7 @@ public:
     void write(paddr_t addr, size_t len, const void* bytes);
     bool add_blk(char *name, paddr_t start, paddr_t end);
     void *blk_host_addr(char *name);
+    u_int8_t *host_page(paddr_t addr, size_t size);
 
     word_t read(paddr_t addr, int len);
     void write(paddr_t addr, int len, word_t data);
@@ -109,11 +105,30 @@ public:
     void print_info();
 
 private:
-    u_int max_cache_size = 5;
-    std::map<paddr_t, std::tuple<u_int8_t*, u_long>> cache;
-    bool _fast_count(paddr_t index);
-    u_int8_t *_fast_mem(paddr_t index);
-    void __update_cache(paddr_t index, u_int8_t*m);
+    // Blocks are indexed by a radix tree over (paddr >> block_shift),
+    // fronted by a direct-mapped cache of recently used blocks.
+    static const int level_bits = 12;
+    static const u_int cache_size = 64;
+    typedef struct
+    {
+        paddr_t index;
+        u_int8_t *blk;
+    } sp_mm_cache;
+
+    u_int block_shift;
+    paddr_t block_mask;
+    int nr_levels;
+    void **root;
+    u_long nr_blocks = 0;
+    sp_mm_cache cache[cache_size] = {};
+
+    u_int8_t **_blk_slot(paddr_t index, bool alloc);
+    u_int8_t *_blk_lookup(paddr_t index);
+    u_int8_t *_blk_alloc(paddr_t index);
+    void _free_node(void **node, int level);
+    void _foreach_node(void **node, int level, paddr_t index,
+                       std::function<void (paddr_t index, u_int8_t *blk)> &fn);
+    void _foreach(std::function<void (paddr_t index, u_int8_t *blk)> fn);
     sp_mm_blk *_blk_find(paddr_t addr);
     bool _blk_read(paddr_t addr, size_t len, void* bytes);
     bool _blk_write(paddr_t addr, size_t len, const void* bytes);
@@ -139,6 +154,7 @@ extern "C"
     void   sparse_mem_copy(void *dst, void *src);
     void*  sparse_mem_blk_get(void *self, char *name);
     int    sparse_mem_blk_add(void *self, char *name, paddr_t start, paddr_t end);
+    void*  sparse_mem_host_page(void *self, paddr_t addr, size_t size);
     int    file_is_elf(const char *fn);
 
 #ifdef __cplusplus
@@ -20,6 +20,11 @@ extern int profiling_state;
 extern int checkpoint_state;
 extern bool checkpoint_restoring;
 extern uint64_t checkpoint_interval;
+extern int checkpoint_jobs;
+extern int checkpoint_delta_chain;
+
+extern int simpoint_profiling_jobs;
+extern uint64_t simpoint_shard_intervals;
 
 extern bool recvd_manual_oneshot_cpt;
 extern bool recvd_manual_uniform_cpt;
@@ -60,6 +60,26 @@ enum { DIFFTEST_TO_DUT, DIFFTEST_TO_REF };
 # error Unsupported ISA
 #endif
 
+#ifdef CONFIG_DIFFTEST_COMMIT_LOG
+enum { DIFFTEST_RD_NONE, DIFFTEST_RD_GPR, DIFFTEST_RD_FPR };
+
+// A record of an instruction stepped by difftest_exec_commits(). The
+// destination register is taken from the encoding, and rd_data is its value
+// after the instruction, so a write of an unchanged value is reported too.
+struct DifftestCommit {
+  uint64_t pc;
+  uint32_t instr;     // 0 if the fetch raised the exception
+  uint8_t  rd_type;   // DIFFTEST_RD_*
+  uint8_t  rd;
+  uint8_t  store_mask; // 0 if there is no store
+  uint8_t  trap;       // the instruction raised an exception of `cause`
+  uint64_t rd_data;
+  uint64_t store_addr; // 8-byte aligned, like difftest_store_commit()
+  uint64_t store_data;
+  uint64_t cause;
+};
+#endif
+
 #ifdef RV64_UARCH_SYNC
 struct SyncState {
   uint64_t lrscValid;
@@ -27,10 +27,19 @@
 #include <common.h>
 #include <isa.h>
 
+#include <atomic>
+#include <chrono>
 #include <cinttypes>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #include <zlib.h>
 
 #include <fcntl.h>
@@ -60,12 +69,257 @@ uint8_t *get_pmem();
 word_t paddr_read(paddr_t addr, int len, int type, int mode, vaddr_t vaddr);
 uint8_t *guest_to_host(paddr_t paddr);
 #include <debug.h>
+#include <memory/image_loader.h>
 extern bool log_enable();
 extern void log_flush();
 extern unsigned long MEMORY_SIZE;
 }
 
 #ifdef CONFIG_MEM_COMPRESS
+namespace {
+
+const size_t CptPageSize = 4096;
+
+/** Compress one frame at a time into an independent gz member or zstd frame */
+class FrameCompressor
+{
+  public:
+    virtual ~FrameCompressor() {}
+    virtual void compress(const uint8_t *src, uint64_t offset, size_t len, std::vector<uint8_t> &out) = 0;
+};
+
+class GzFrameCompressor : public FrameCompressor
+{
+  public:
+    GzFrameCompressor()
+    {
+      memset(&strm, 0, sizeof(strm));
+      // with a gzip header, so that the members can be concatenated
+      int ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+      assert(ret == Z_OK);
+    }
+
+    ~GzFrameCompressor() { deflateEnd(&strm); }
+
+    void compress(const uint8_t *src, uint64_t offset, size_t len, std::vector<uint8_t> &out) override
+    {
+      deflateReset(&strm);
+      out.resize(deflateBound(&strm, len));
+      strm.next_in = (Bytef *)src;
+      strm.avail_in = len;
+      strm.next_out = out.data();
+      strm.avail_out = out.size();
+      int ret = deflate(&strm, Z_FINISH);
+      assert(ret == Z_STREAM_END);
+      out.resize(strm.total_out);
+    }
+
+  private:
+    z_stream strm;
+};
+
+class ZstdFrameCompressor : public FrameCompressor
+{
+  public:
+    /** Set the bits of the non-zero pages in pageBitmap, if it is given */
+    explicit ZstdFrameCompressor(uint8_t *pageBitmap) : cctx(ZSTD_createCCtx()), pageBitmap(pageBitmap)
+    {
+      assert(cctx);
+    }
+
+    ~ZstdFrameCompressor() { ZSTD_freeCCtx(cctx); }
+
+    void compress(const uint8_t *src, uint64_t offset, size_t len, std::vector<uint8_t> &out) override
+    {
+      bool zero = true;
+      for (size_t p = 0; p < len; p += CptPageSize) {
+        if (!isZeroPage(src + p, std::min(CptPageSize, len - p))) {
+          uint64_t page = (offset + p) / CptPageSize;
+          if (pageBitmap) pageBitmap[page / 8] |= 1 << (page % 8);
+          zero = false;
+        }
+      }
+      // all-zero frames of the same size compress to the same data
+      if (zero && len == zeroFrameSize) {
+        out = zeroFrame;
+        return;
+      }
+      out.resize(ZSTD_compressBound(len));
+      size_t size = ZSTD_compressCCtx(cctx, out.data(), out.size(), src, len, 1);
+      assert(!ZSTD_isError(size));
+      out.resize(size);
+      if (zero) {
+        zeroFrame = out;
+        zeroFrameSize = len;
+      }
+    }
+
+  private:
+    static bool isZeroPage(const uint8_t *p, size_t len)
+    {
+      for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+        if (*(const uint64_t *)(p + i) != 0) return false;
+      }
+      return true;
+    }
+
+    ZSTD_CCtx *cctx;
+    uint8_t *pageBitmap;
+    std::vector<uint8_t> zeroFrame;
+    size_t zeroFrameSize{0};
+};
+
+/**
+ * Compress [src, src + size) frame by frame on CONFIG_MEM_COMPRESS_THREADS
+ * threads. The frames are passed to write() in order, and each thread keeps
+ * at most one compressed frame, so memory use does not grow with size.
+ * If pages is given, the data to compress is these pages of src in order.
+ */
+void compressFrames(const uint8_t *src, uint64_t size, std::function<FrameCompressor *()> newCompressor,
+                    std::function<void(const std::vector<uint8_t> &frame, size_t len)> write,
+                    const std::vector<uint64_t> *pages = nullptr)
+{
+  const uint64_t nrFrames = (size + CPT_ZSTD_FRAME_SIZE - 1) / CPT_ZSTD_FRAME_SIZE;
+  std::atomic<uint64_t> nextFrame{0};
+  uint64_t nextWrite = 0;
+  std::mutex writeLock;
+  std::condition_variable written;
+
+  auto worker = [&]() {
+    std::unique_ptr<FrameCompressor> compressor(newCompressor());
+    std::vector<uint8_t> frame, gathered;
+    for (uint64_t i; (i = nextFrame++) < nrFrames;) {
+      uint64_t offset = i * CPT_ZSTD_FRAME_SIZE;
+      size_t len = std::min<uint64_t>(CPT_ZSTD_FRAME_SIZE, size - offset);
+      const uint8_t *frameSrc = src + offset;
+      if (pages) {
+        gathered.resize(len);
+        for (size_t p = 0; p < len; p += CptPageSize) {
+          memcpy(gathered.data() + p, src + (*pages)[(offset + p) / CptPageSize] * CptPageSize, CptPageSize);
+        }
+        frameSrc = gathered.data();
+      }
+      compressor->compress(frameSrc, offset, len, frame);
+
+      std::unique_lock<std::mutex> lock(writeLock);
+      written.wait(lock, [&]() { return nextWrite == i; });
+      write(frame, len);
+      nextWrite++;
+      written.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < CONFIG_MEM_COMPRESS_THREADS; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+/** Hash a page on four independent lanes, in the way of XXH64 */
+uint64_t hashPage(const uint8_t *p)
+{
+  const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL;
+  auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+  uint64_t acc[4] = {P1 + P2, P2, 0, -P1};
+  const uint64_t *w = (const uint64_t *)p;
+  for (size_t i = 0; i < CptPageSize / sizeof(uint64_t); i += 4) {
+    for (int j = 0; j < 4; j++) {
+      acc[j] = rotl(acc[j] + w[i + j] * P2, 31) * P1;
+    }
+  }
+  return rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+}
+
+} // anonymous namespace
+
+std::string Serializer::cptBasePath(uint64_t inst_count) {
+  if (checkpoint_state == SimpointCheckpointing) {
+    return pathManager.getOutputPath() + "_" + to_string(simpoint2Weights.begin()->first) + "_" +
+           to_string(simpoint2Weights.begin()->second);
+  }
+  return pathManager.getOutputPath() + "_" + to_string(inst_count);
+}
+
+void Serializer::findDeltaPages(const std::string &base_path) {
+  const uint8_t *pmem = get_pmem();
+  const uint64_t nr_pages = MEMORY_SIZE / CptPageSize;
+  std::vector<uint64_t> hashes(nr_pages);
+  std::vector<std::thread> threads;
+  const uint64_t chunk = (nr_pages + CONFIG_MEM_COMPRESS_THREADS - 1) / CONFIG_MEM_COMPRESS_THREADS;
+  for (uint64_t start = 0; start < nr_pages; start += chunk) {
+    threads.emplace_back([&, start]() {
+      for (uint64_t i = start; i < std::min(start + chunk, nr_pages); i++) {
+        hashes[i] = hashPage(pmem + i * CptPageSize);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  writeDelta = !pageHashes.empty() && deltaTaken < deltaChain;
+  // deltas are named apart from full checkpoints, so that tools restoring
+  // _<inst>_.zstd directly never pick up a delta
+  const std::string cpt_file = base_path + (writeDelta ? "_.delta.zstd" : "_.zstd");
+  deltaPages.clear();
+  if (writeDelta) {
+    // the gcpt restorer is put to the start of pmem after hashing
+    const uint64_t restorer_pages = (MAX_RESTORER_SIZE + CptPageSize - 1) / CptPageSize;
+    for (uint64_t i = 0; i < nr_pages; i++) {
+      if (i < restorer_pages || hashes[i] != pageHashes[i]) {
+        deltaPages.push_back(i);
+      }
+    }
+    deltaParent = std::filesystem::relative(lastCptFile, std::filesystem::path(cpt_file).parent_path()).string();
+    deltaTaken++;
+  } else {
+    deltaTaken = 0;
+  }
+  pageHashes.swap(hashes);
+  lastCptFile = cpt_file;
+}
+
+void Serializer::serializeDelta(const std::string &filepath) {
+  const uint8_t *pmem = get_pmem();
+  FILE *compress_file = fopen(filepath.c_str(), "wb");
+  if (compress_file == nullptr) {
+    xpanic("Can't open physical memory checkpoint file %s\n", filepath.c_str());
+  }
+  auto writeFrame = [&](const std::vector<uint8_t> &frame, size_t len) {
+    if (fwrite(frame.data(), 1, frame.size(), compress_file) != frame.size()) {
+      xpanic("file write error: %s : %s \n", filepath.c_str(), strerror(errno));
+    }
+  };
+
+  const uint64_t nr_pages = MEMORY_SIZE / CptPageSize;
+  std::vector<uint8_t> page_bitmap((nr_pages + 7) / 8);
+  for (uint64_t page : deltaPages) {
+    page_bitmap[page / 8] |= 1 << (page % 8);
+  }
+  uint32_t parent_len = deltaParent.size();
+  uint32_t header[3] = {CPT_DELTA_MAGIC, (uint32_t)(16 + parent_len + page_bitmap.size()), CptPageSize};
+  std::vector<uint8_t> delta_frame(8 + header[1]);
+  memcpy(delta_frame.data(), header, sizeof(header));
+  memcpy(delta_frame.data() + 12, &nr_pages, sizeof(nr_pages));
+  memcpy(delta_frame.data() + 20, &parent_len, sizeof(parent_len));
+  memcpy(delta_frame.data() + 24, deltaParent.data(), parent_len);
+  memcpy(delta_frame.data() + 24 + parent_len, page_bitmap.data(), page_bitmap.size());
+  writeFrame(delta_frame, 0);
+
+  compressFrames(pmem, deltaPages.size() * CptPageSize, []() { return new ZstdFrameCompressor(nullptr); },
+                 writeFrame, &deltaPages);
+
+  if (fclose(compress_file)) {
+    xpanic("file close error: %s : %s \n", filepath.c_str(), strerror(errno));
+  }
+  Log("Written %lu of %lu pages to delta checkpoint %s, based on %s", deltaPages.size(), nr_pages,
+      filepath.c_str(), deltaParent.c_str());
+}
+
 void Serializer::serializePMem(uint64_t inst_count) {
   // We must dump registers before memory to store them in the Generic Arch CPT
   assert(regDumped);
@@ -79,69 +333,86 @@ void Serializer::serializePMem(uint64_t inst_count) {
   }
   uint32_t restorer_size = 0x400;
   fseek(restore_fp, 0, SEEK_SET);
+  lazy_restore_fill(pmem, restorer_size);
   assert(restorer_size == fread(pmem, 1, restorer_size, restore_fp));
   fclose(restore_fp);
   Log("Put gcpt restorer %s to start of pmem", restorer);
 
-  string filepath;
+  string filepath = cptBasePath(inst_count);
 
-  if (checkpoint_state == SimpointCheckpointing) {
-    filepath = pathManager.getOutputPath() + "_" + to_string(simpoint2Weights.begin()->first) + "_" +
-               to_string(simpoint2Weights.begin()->second);
-  } else {
-    filepath = pathManager.getOutputPath() + "_" + to_string(inst_count);
-  }
+  FILE *compress_file = nullptr;
+  auto writeFrame = [&](const std::vector<uint8_t> &frame, size_t len) {
+    if (fwrite(frame.data(), 1, frame.size(), compress_file) != frame.size()) {
+      xpanic("file write error: %s : %s \n", filepath.c_str(), strerror(errno));
+    }
+  };
 
   if (compress_file_format == GZ_FORMAT) {
     filepath += "_.gz";
-    gzFile compressed_mem = gzopen(filepath.c_str(), "wb");
-    if (compressed_mem == nullptr) {
+    // gzip members can be concatenated, so the frames are compressed in parallel
+    compress_file = fopen(filepath.c_str(), "wb");
+    if (compress_file == nullptr) {
       cerr << "Failed to open " << filepath << endl;
       xpanic("Can't open physical memory checkpoint file!\n");
     } else {
       cout << "Opening " << filepath << " as checkpoint output file" << endl;
     }
 
-    uint64_t pass_size = 0;
-
-    for (uint64_t written = 0; written < PMEM_SIZE; written += pass_size) {
-      pass_size = numeric_limits<int>::max() < ((int64_t)PMEM_SIZE - (int64_t)written)
-                    ? numeric_limits<int>::max()
-                    : ((int64_t)PMEM_SIZE - (int64_t)written);
-
-      if (gzwrite(compressed_mem, pmem + written, (uint32_t)pass_size) != (int)pass_size) {
-        xpanic("Write failed on physical memory checkpoint file\n");
-      }
-      Log("Written 0x%lx bytes\n", pass_size);
-    }
+    compressFrames(pmem, PMEM_SIZE, []() { return new GzFrameCompressor(); }, writeFrame);
 
-    if (gzclose(compressed_mem)) {
+    if (fclose(compress_file)) {
       xpanic("Close failed on physical memory checkpoint file\n");
     }
+  } else if (compress_file_format == ZSTD_FORMAT && writeDelta) {
+    serializeDelta(filepath + "_.delta.zstd");
   } else if (compress_file_format == ZSTD_FORMAT) {
     filepath += "_.zstd";
-    // zstd compress
-    size_t const compress_buffer_size = ZSTD_compressBound(PMEM_SIZE);
-    void *const compress_buffer = malloc(compress_buffer_size);
-    assert(compress_buffer);
-
-    size_t const compress_size = ZSTD_compress(compress_buffer, compress_buffer_size, pmem, PMEM_SIZE, 1);
-    assert(compress_size <= compress_buffer_size && compress_size != 0);
-
-    FILE *compress_file = fopen(filepath.c_str(), "wb");
-    size_t fw_size = fwrite(compress_buffer, 1, compress_size, compress_file);
+    // Compress pmem into independent frames, and append a seek table,
+    // so that the checkpoint can be restored frame by frame.
+    compress_file = fopen(filepath.c_str(), "wb");
+    if (compress_file == nullptr) {
+      xpanic("Can't open physical memory checkpoint file %s\n", filepath.c_str());
+    }
 
-    if (fw_size != (size_t)compress_size) {
-      free(compress_buffer);
+    const uint64_t nr_pages = (PMEM_SIZE + CptPageSize - 1) / CptPageSize;
+    std::vector<uint8_t> page_bitmap((nr_pages + 7) / 8);
+    // the compressed size and the decompressed size of each frame
+    std::vector<uint32_t> seek_table;
+    compressFrames(
+      pmem, PMEM_SIZE, [&]() { return new ZstdFrameCompressor(page_bitmap.data()); },
+      [&](const std::vector<uint8_t> &frame, size_t len) {
+        writeFrame(frame, len);
+        seek_table.push_back(frame.size());
+        seek_table.push_back(len);
+      });
+
+    uint32_t bitmap_header[2] = {CPT_PAGE_BITMAP_MAGIC, (uint32_t)(12 + page_bitmap.size())};
+    uint32_t page_size = CptPageSize;
+    std::vector<uint8_t> bitmap_frame(sizeof(bitmap_header) + bitmap_header[1]);
+    memcpy(bitmap_frame.data(), bitmap_header, sizeof(bitmap_header));
+    memcpy(bitmap_frame.data() + 8, &page_size, sizeof(page_size));
+    memcpy(bitmap_frame.data() + 12, &nr_pages, sizeof(nr_pages));
+    memcpy(bitmap_frame.data() + 20, page_bitmap.data(), page_bitmap.size());
+    writeFrame(bitmap_frame, 0);
+    seek_table.push_back(bitmap_frame.size());
+    seek_table.push_back(0);
+
+    uint32_t nr_frames = seek_table.size() / 2;
+    uint32_t skippable_header[2] = {
+      CPT_SKIPPABLE_MAGIC, (uint32_t)(seek_table.size() * sizeof(uint32_t) + CPT_SEEK_TABLE_FOOTER_SIZE)};
+    uint8_t footer[CPT_SEEK_TABLE_FOOTER_SIZE] = {};
+    uint32_t seekable_magic = CPT_SEEKABLE_MAGIC;
+    memcpy(footer, &nr_frames, sizeof(nr_frames));
+    memcpy(footer + 5, &seekable_magic, sizeof(seekable_magic));
+    if (fwrite(skippable_header, sizeof(skippable_header), 1, compress_file) != 1 ||
+        fwrite(seek_table.data(), sizeof(uint32_t), seek_table.size(), compress_file) != seek_table.size() ||
+        fwrite(footer, sizeof(footer), 1, compress_file) != 1) {
       xpanic("file write error: %s : %s \n", filepath.c_str(), strerror(errno));
     }
 
     if (fclose(compress_file)) {
-      free(compress_buffer);
       xpanic("file close error: %s : %s \n", filepath.c_str(), strerror(errno));
     }
-
-    free(compress_buffer);
   } else {
     xpanic("You need to specify the compress file format using: --checkpoint-format\n");
   }
@@ -231,7 +502,15 @@ void Serializer::serializeRegs() {}
 void Serializer::serialize(uint64_t inst_count) {
 
 #ifdef CONFIG_MEM_COMPRESS
+  cptTaken++;
   serializeRegs();
+  if (deltaChain > 0) {
+    findDeltaPages(cptBasePath(inst_count));
+  }
+  if (cptJobs > 1) {
+    serializeInWorker(inst_count);
+    return;
+  }
   serializePMem(inst_count);
 #else
   xpanic("You should enable CONFIG_MEM_COMPRESS in menuconfig");
@@ -239,6 +518,11 @@ void Serializer::serialize(uint64_t inst_count) {
 }
 
 void Serializer::init() {
+#ifdef CONFIG_SMP
+  if (checkpoint_state != NoCheckpoint) {
+    xpanic("Taking checkpoints is not supported with CONFIG_SMP yet\n");
+  }
+#endif
   if  (checkpoint_state == SimpointCheckpointing) {
     assert(checkpoint_interval);
     intervalSize = checkpoint_interval;
@@ -265,6 +549,25 @@ void Serializer::init() {
     intervalSize = checkpoint_interval;
     Log("Taking uniform checkpionts with interval %lu", checkpoint_interval);
     nextUniformPoint = intervalSize;
+
+    if (checkpoint_delta_chain > 0) {
+      if (compress_file_format == ZSTD_FORMAT) {
+        deltaChain = checkpoint_delta_chain;
+        Log("Writing up to %d delta checkpoints after each full checkpoint", deltaChain);
+      } else {
+        Log("Delta checkpoints are only written in the zstd format, ignoring --cpt-delta-chain");
+      }
+    }
+  }
+
+  if (checkpoint_state != NoCheckpoint) {
+    if (checkpoint_jobs > 1) {
+      cptJobs = checkpoint_jobs;
+      Log("Writing checkpoints with %d worker processes", cptJobs);
+    }
+    // reported with --cpt-jobs=1 too, as the serial time to compare with
+    startTime = std::chrono::steady_clock::now();
+    atexit([] { serializer.finish(); });
   }
   pathManager.setCheckpointingOutputDir();
 }
@@ -0,0 +1,87 @@
+/***************************************************************************************
+* Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+// Checkpoint workers of the serializer. Kept apart from serializer.cpp, since
+// <sys/wait.h> pulls in glibc's mcontext_t, which clashes with the mcontext
+// CSR declared by csr.h with CONFIG_RVSDTRIG.
+
+#include <checkpoint/serializer.h>
+
+#include <common.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern "C" {
+extern bool log_enable();
+extern void log_flush();
+}
+
+void Serializer::serializeInWorker(uint64_t inst_count) {
+  while (workerPids.size() >= (size_t)cptJobs) {
+    reapWorker();
+  }
+
+  fflush(nullptr);
+  pid_t pid = fork();
+  if (pid < 0) {
+    xpanic("Cannot fork checkpoint worker: %s\n", strerror(errno));
+  }
+
+  if (pid == 0) {
+    // registers are already dumped by the driver, since reading mtime
+    // advances the deterministic clint, the same as on the serial path
+    serializePMem(inst_count);
+    fflush(nullptr);
+    _exit(0);
+  }
+
+  Log("Forked checkpoint worker %d @ instruction count %lu", pid, inst_count);
+  regDumped = false;
+  workerPids.push_back(pid);
+}
+
+void Serializer::reapWorker() {
+  // only wait for our own workers, other children of NEMU are not ours to reap
+  pid_t pid = workerPids.front();
+  int status;
+  auto start = std::chrono::steady_clock::now();
+  if (waitpid(pid, &status, 0) < 0) {
+    xpanic("Cannot wait for checkpoint worker %d: %s\n", pid, strerror(errno));
+  }
+  waitTime += std::chrono::steady_clock::now() - start;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    xpanic("Checkpoint worker %d failed\n", pid);
+  }
+  workerPids.erase(workerPids.begin());
+}
+
+void Serializer::finish() {
+  while (!workerPids.empty()) {
+    reapWorker();
+  }
+
+  // The time not spent waiting is what the driver spent on simulation and
+  // forking. The serial time to compare with is that of --cpt-jobs=1.
+  double wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+  double wait_time = std::chrono::duration<double>(waitTime).count();
+  Log("Took %lu checkpoints with %d jobs in %.2f s wall-clock, %.2f s of which waiting for workers",
+      cptTaken, cptJobs, wall_time, wait_time);
+}
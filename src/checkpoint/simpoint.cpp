@@ -42,12 +42,21 @@
 #include <cassert>
 // #include <debug.h>
 #include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <vector>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <checkpoint/simpoint.h>
 #include <profiling/profiling_control.h>
 
+extern SimPointNS::SimPoint simpoit_obj;
+
 namespace SimPointNS
 {
 
@@ -59,14 +68,64 @@ extern char *log_filebuf;
 extern uint64_t record_row_number;
 extern FILE *log_fp;
 extern bool enable_small_log;
+#ifdef CONFIG_SMP
+int smp_hart_id();
+#endif
+}
+
+BBTable::BBTable() : slots(4096, 0) {
+}
+
+uint64_t
+BBTable::hash(const BasicBlockRange &bb) {
+  // mix both ends, the sum of them collides between blocks sharing a pc
+  uint64_t h = (bb.first ^ (bb.second * 0x9e3779b97f4a7c15ul)) * 0xbf58476d1ce4e5b9ul;
+  return h ^ (h >> 31);
+}
+
+uint64_t
+BBTable::findOrInsert(const BasicBlockRange &bb, bool &inserted) {
+  uint64_t mask = slots.size() - 1;
+  for (uint64_t i = hash(bb) & mask; ; i = (i + 1) & mask) {
+    uint32_t id = slots[i];
+    if (id == 0) {
+      ranges.push_back(bb);
+      slots[i] = ranges.size();
+      inserted = true;
+      // keep the load factor below 1/2
+      if (ranges.size() * 2 > slots.size())
+        grow();
+      return ranges.size();
+    }
+    if (ranges[id - 1] == bb) {
+      inserted = false;
+      return id;
+    }
+  }
+}
+
+void
+BBTable::grow() {
+  slots.assign(slots.size() * 2, 0);
+  uint64_t mask = slots.size() - 1;
+  for (uint64_t id = 1; id <= ranges.size(); id++) {
+    uint64_t i = hash(ranges[id - 1]) & mask;
+    while (slots[i] != 0)
+      i = (i + 1) & mask;
+    slots[i] = id;
+  }
 }
 
 SimPoint::SimPoint()
     : intervalCount(0),
       intervalDrift(0),
       simpointStream(nullptr),
-      currentBBV(0, 0),
-      currentBBVInstCount(0) {
+      streams(MUXDEF(CONFIG_SMP, CONFIG_NR_HARTS, 1)) {
+}
+
+SimPoint::Stream &
+SimPoint::stream() {
+  return streams[MUXDEF(CONFIG_SMP, smp_hart_id(), 0)];
 }
 
 SimPoint::~SimPoint() {
@@ -88,11 +147,192 @@ SimPoint::init() {
 
     if (!simpointStream)
       xpanic("unable to open SimPoint profile_file %s\n", path.c_str());
+
+    if (simpoint_profiling_jobs > 1) {
+#ifdef CONFIG_SMP
+      // a forked worker would only keep the thread of the current hart
+      xpanic("Parallel SimPoint profiling is not supported with CONFIG_SMP\n");
+#endif
+      assert(simpoint_shard_intervals);
+      shardRole = ShardDriver;
+      profilingJobs = simpoint_profiling_jobs;
+      shardIntervals = simpoint_shard_intervals;
+      Log("Profiling shards of %lu intervals with %d worker processes", shardIntervals, profilingJobs);
+      atexit([] { simpoit_obj.mergeShards(); });
+    }
+  }
+}
+
+std::ostream &
+SimPoint::bbvStream() {
+  return shardRole == ShardWorker ? shardStream : *simpointStream->stream();
+}
+
+std::string
+SimPoint::shardPath(int shard, const char *suffix) const {
+  return pathManager.getOutputPath() + "/simpoint_bbv.shard" + std::to_string(shard) + "." + suffix;
+}
+
+void
+SimPoint::forkWorker() {
+  while (workers.size() - reapedWorkers >= (size_t)profilingJobs)
+    reapWorker();
+
+  // the virtual timer of the alarm is not inherited by the child
+  struct itimerval timer;
+  getitimer(ITIMER_VIRTUAL, &timer);
+  fflush(nullptr);
+
+  pid_t pid = fork();
+  if (pid < 0)
+    xpanic("unable to fork SimPoint profiling worker: %s\n", strerror(errno));
+
+  if (pid == 0) {
+    setitimer(ITIMER_VIRTUAL, &timer, nullptr);
+    shardRole = ShardWorker;
+    shardIdx = workers.size();
+    intervalNum = 0;
+    auto path = shardPath(shardIdx, "bbv");
+    shardStream.open(path);
+    if (!shardStream)
+      xpanic("unable to open SimPoint shard file %s\n", path.c_str());
+
+    // the guest output is already shown by the driver
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+      dup2(null_fd, STDOUT_FILENO);
+      close(null_fd);
+    }
+    atexit([] { simpoit_obj.finishShard(); });
+    return;
   }
+
+  workers.push_back(pid);
+}
+
+void
+SimPoint::reapWorker() {
+  // workers are reaped in shard order, and other children are left alone
+  pid_t pid = workers[reapedWorkers];
+  int status;
+  if (waitpid(pid, &status, 0) < 0)
+    xpanic("unable to wait for SimPoint profiling worker %d: %s\n", pid, strerror(errno));
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    xpanic("SimPoint profiling shard %zu failed\n", reapedWorkers);
+  reapedWorkers++;
+}
+
+void
+SimPoint::finishShard() {
+  assert(shardRole == ShardWorker);
+  shardStream.close();
+
+  std::ofstream table(shardPath(shardIdx, "bb"));
+  for (uint64_t id = 1; id <= bbTable.size(); id++)
+    table << id << " " << bbTable.range(id).first << " " << bbTable.range(id).second << "\n";
+  table.close();
+
+  // skip the destructors, the driver still owns simpointStream
+  _exit(shardStream.fail() || table.fail());
+}
+
+void
+SimPoint::mergeShards() {
+  assert(shardRole == ShardDriver);
+  while (reapedWorkers < workers.size())
+    reapWorker();
+
+  BBTable globalIds;
+  for (size_t shard = 0; shard < workers.size(); shard++) {
+    // ids are first assigned in the order of block completion, and a
+    // shard completes its blocks after all earlier shards
+    std::vector<uint64_t> idMap(1);
+    auto table_path = shardPath(shard, "bb");
+    std::ifstream table(table_path);
+    uint64_t id;
+    BasicBlockRange bb;
+    bool inserted;
+    while (table >> id >> bb.first >> bb.second) {
+      assert(id == idMap.size());
+      idMap.push_back(globalIds.findOrInsert(bb, inserted));
+    }
+
+    auto bbv_path = shardPath(shard, "bbv");
+    std::ifstream bbv(bbv_path);
+    std::string line;
+    while (std::getline(bbv, line)) {
+      std::vector<std::pair<uint64_t, uint64_t> > counts;
+      const char *p = line.c_str() + 1;
+      uint64_t count;
+      int len;
+      while (sscanf(p, ":%lu:%lu %n", &id, &count, &len) == 2) {
+        counts.push_back(std::make_pair(idMap.at(id), count));
+        p += len;
+      }
+      std::sort(counts.begin(), counts.end());
+      printInterval(*simpointStream->stream(), counts);
+    }
+
+    remove(table_path.c_str());
+    remove(bbv_path.c_str());
+  }
+  Log("Merged %lu SimPoint profiling shards", workers.size());
+}
+
+void
+SimPoint::printInterval(std::ostream &os, const std::vector<std::pair<uint64_t, uint64_t> > &counts) {
+  // Print output BBV info
+  os << "T";
+  for (auto cnt_itr = counts.begin(); cnt_itr != counts.end(); ++cnt_itr) {
+    os << ":" << cnt_itr->first << ":" << cnt_itr->second << " ";
+  }
+  os << "\n";
+}
+
+void
+SimPoint::recordBlock(const BasicBlockRange &bb, uint64_t count) {
+  bool inserted;
+  uint64_t id = bbTable.findOrInsert(bb, inserted);
+  Logsp("Finding BB 0x%lx -> 0x%lx", bb.first, bb.second);
+  if (inserted) {
+    // If a new (previously unseen) basic block is found,
+    // it gets a new unique id, record num of insts.
+    bbInfo.push_back(BBInfo{count, 0});
+  }
+  // Increment the count by the number of insts in basic block,
+  // and remember the blocks executed in this interval.
+  BBInfo &info = bbInfo[id - 1];
+  if (info.count == 0 && count != 0)
+    dirtyBBs.push_back(id);
+  info.count += count;
+}
+
+void
+SimPoint::profileBlock(Addr start, Addr end, uint64_t count) {
+  intervalCount += count;
+  assert(intervalCount + intervalDrift < intervalSize);
+  if (shardRole != ShardDriver)
+    recordBlock(BasicBlockRange(start, end), count);
+}
+
+void
+SimPoint::resume(Addr pc, uint64_t abs_icount) {
+  Stream &s = stream();
+  assert(s.currentBBVInstCount == 0);
+  s.currentBBV.first = pc;
+  s.lastICount = abs_icount;
+}
+
+uint64_t
+SimPoint::intervalBudget() const {
+  uint64_t used = intervalCount + intervalDrift;
+  return used >= intervalSize ? 0 : intervalSize - used;
 }
 
 void
 SimPoint::profile_with_abs_icount(Addr pc, bool is_control, bool is_last_uop, uint64_t abs_icount) {
+  // abs_icount counts the instructions of the current hart only
+  uint64_t &lastICount = stream().lastICount;
   unsigned exec_count = abs_icount - lastICount;
   Logsp("PC: 0x%lx , icount: %lu, control: %i", pc, abs_icount, is_control);
   Logsp("is_control: %i, is_last_uop: %i, exec_count: %u", is_control, is_last_uop, exec_count);
@@ -106,63 +346,65 @@ SimPoint::profile(Addr pc, bool is_control, bool is_last_uop, unsigned instr_cou
   if (!is_last_uop)
     return;
 
+  if (shardRole == ShardDriver) {
+    // the first shard starts right here
+    if (workers.empty())
+      forkWorker();
+    if (shardRole == ShardDriver) {
+      intervalCount += instr_count;
+      if (is_control && intervalCount + intervalDrift >= intervalSize) {
+        intervalDrift = (intervalCount + intervalDrift) - intervalSize;
+        intervalCount = 0;
+        if (++intervalNum % shardIntervals == 0)
+          forkWorker();
+      }
+      return;
+    }
+  }
+
+  Stream &s = stream();
   intervalCount += instr_count;
-  currentBBVInstCount += instr_count;
+  s.currentBBVInstCount += instr_count;
 
-  if (!currentBBVInstCount) {
+  if (!s.currentBBVInstCount) {
     Logsp("Set BB start: 0x%lx", pc);
-    currentBBV.first = pc;
+    s.currentBBV.first = pc;
   }
 
-  Logsp("intervalCount: %lu, currentBBVInstCount: %lu", intervalCount, currentBBVInstCount);
+  Logsp("intervalCount: %lu, currentBBVInstCount: %lu", intervalCount, s.currentBBVInstCount);
 
   // If inst is control inst, assume end of basic block.
   if (is_control) {
-    currentBBV.second = pc;
-
-    auto map_itr = bbMap.find(currentBBV);
-    Logsp("Finding BB 0x%lx -> 0x%lx", currentBBV.first, currentBBV.second);
-    if (map_itr == bbMap.end()) {
-      // If a new (previously unseen) basic block is found,
-      // add a new unique id, record num of insts and insert into bbMap.
-      BBInfo info;
-      info.id = bbMap.size() + 1;
-      info.insts = currentBBVInstCount;
-      info.count = currentBBVInstCount;
-      bbMap.insert(::std::make_pair(currentBBV, info));
-    } else {
-      // If basic block is seen before, just increment the count by the
-      // number of insts in basic block.
-      BBInfo &info = map_itr->second;
-      info.count += currentBBVInstCount;
-    }
-    currentBBVInstCount = 0;
+    s.currentBBV.second = pc;
+
+    recordBlock(s.currentBBV, s.currentBBVInstCount);
+    s.currentBBVInstCount = 0;
 
     // Reached end of interval if the sum of the current inst count
     // (intervalCount) and the excessive inst count from the previous
     // interval (intervalDrift) is greater than/equal to the interval size.
     if (intervalCount + intervalDrift >= intervalSize) {
-      // summarize interval and display BBV info
+      // summarize interval and display BBV info, only the blocks
+      // executed in this interval are visited
+      std::sort(dirtyBBs.begin(), dirtyBBs.end());
       std::vector<std::pair<uint64_t, uint64_t> > counts;
-      for (auto map_itr = bbMap.begin(); map_itr != bbMap.end(); ++map_itr) {
-        BBInfo &info = map_itr->second;
+      counts.reserve(dirtyBBs.size());
+      for (uint64_t id : dirtyBBs) {
+        BBInfo &info = bbInfo[id - 1];
         if (info.count != 0) {
-          counts.push_back(std::make_pair(info.id, info.count));
+          counts.push_back(std::make_pair(id, info.count));
           info.count = 0;
         }
       }
-      std::sort(counts.begin(), counts.end());
-
-      // Print output BBV info
-      *simpointStream->stream() << "T";
-      for (auto cnt_itr = counts.begin(); cnt_itr != counts.end(); ++cnt_itr) {
-        *simpointStream->stream() << ":" << cnt_itr->first << ":" << cnt_itr->second << " ";
-      }
-      *simpointStream->stream() << "\n";
+      dirtyBBs.clear();
+      printInterval(bbvStream(), counts);
       Logsp("Simpoint profilied %lu instrs", intervalCount);
 
       intervalDrift = (intervalCount + intervalDrift) - intervalSize;
       intervalCount = 0;
+
+      if (shardRole == ShardWorker && ++intervalNum == shardIntervals)
+        finishShard();
     }
   }
 }
@@ -185,5 +427,17 @@ void simpoint_profiling(uint64_t pc, bool is_control, uint64_t abs_instr_count)
   xpanic("You should enable CONFIG_MEM_COMPRESS in menuconfig");
 #endif
 }
+
+void simpoint_profiling_block(uint64_t start, uint64_t end, uint64_t count) {
+  simpoit_obj.profileBlock(start, end, count);
+}
+
+void simpoint_profiling_resume(uint64_t start, uint64_t abs_instr_count) {
+  simpoit_obj.resume(start, abs_instr_count);
+}
+
+uint64_t simpoint_profiling_budget() {
+  return simpoit_obj.intervalBudget();
+}
 #endif
 }
@@ -19,6 +19,8 @@
 #include <cpu/exec.h>
 #include <cpu/difftest.h>
 #include <cpu/decode.h>
+#include <cpu/smp.h>
+#include <device/alarm.h>
 #include <memory/host-tlb.h>
 #include <isa-all-instr.h>
 #include <locale.h>
@@ -26,6 +28,10 @@
 #include <unistd.h>
 #include <generated/autoconf.h>
 #include <profiling/profiling_control.h>
+#ifdef CONFIG_ENGINE_JIT
+#include <isa-jit.h>
+#include <jit.h>
+#endif
 
 /* The assembly code of instructions executed is only output to the screen
  * when the number of instructions executed is less than this value.
@@ -33,18 +39,21 @@
  * You can modify this value as you want.
  */
 #define MAX_INSTR_TO_PRINT 10
-#ifndef CONFIG_SHARE
-#define BATCH_SIZE 65536
-#else
+#ifdef CONFIG_SHARE
 #define BATCH_SIZE 1
+#elif defined(CONFIG_SMP_DETERMINISTIC)
+// a hart runs one batch in its turn
+#define BATCH_SIZE CONFIG_SMP_QUANTUM
+#else
+#define BATCH_SIZE 65536
 #endif
 
-CPU_state cpu = {};
-uint64_t g_nr_guest_instr = 0;
+HART_LOCAL CPU_state cpu = {};
+HART_LOCAL uint64_t g_nr_guest_instr = 0;
 static uint64_t g_timer = 0; // unit: us
 static bool g_print_step = false;
 const rtlreg_t rzero = 0;
-rtlreg_t tmp_reg[4];
+HART_LOCAL rtlreg_t tmp_reg[4];
 
 #ifdef CONFIG_DEBUG
 static inline void debug_hook(vaddr_t pc, const char *asmbuf) {
@@ -58,16 +67,25 @@ static inline void debug_hook(vaddr_t pc, const char *asmbuf) {
 }
 #endif
 
-static jmp_buf jbuf_exec = {};
-static uint64_t n_remain_total;
-static int n_remain;
-static Decode *prev_s;
+static HART_LOCAL jmp_buf jbuf_exec = {};
+static HART_LOCAL uint64_t n_remain_total;
+static HART_LOCAL int n_remain;
+static HART_LOCAL Decode *prev_s;
+#ifdef CONFIG_VIRTUAL_TIME
+// batches end at the next event, instead of having BATCH_SIZE instructions
+static HART_LOCAL int n_batch_vtime;
+#endif
 
 void save_globals(Decode *s) { IFDEF(CONFIG_PERF_OPT, prev_s = s); }
 
+static inline int batch_size() {
+  return MUXDEF(CONFIG_VIRTUAL_TIME, n_batch_vtime,
+      n_remain_total >= BATCH_SIZE ? BATCH_SIZE : n_remain_total);
+}
+
 uint64_t get_abs_instr_count() {
 #if defined(CONFIG_ENABLE_INSTR_CNT)
-  int n_batch = n_remain_total >= BATCH_SIZE ? BATCH_SIZE : n_remain_total;
+  int n_batch = batch_size();
   uint32_t n_executed = n_batch - n_remain;
   return n_executed + g_nr_guest_instr;
 #endif
@@ -76,13 +94,14 @@ uint64_t get_abs_instr_count() {
 
 static void update_instr_cnt() {
 #if defined(CONFIG_ENABLE_INSTR_CNT)
-  int n_batch = n_remain_total >= BATCH_SIZE ? BATCH_SIZE : n_remain_total;
+  int n_batch = batch_size();
   uint32_t n_executed = n_batch - n_remain;
   n_remain_total -= (n_remain_total > n_executed) ? n_executed : n_remain_total;
   IFNDEF(CONFIG_DEBUG, g_nr_guest_instr += n_executed);
 
   n_remain =
       n_batch > n_remain_total ? n_remain_total : n_batch; // clean n_remain
+  IFDEF(CONFIG_VIRTUAL_TIME, n_batch_vtime = n_remain);
   // Loge("n_remain = %i, n_remain_total = %lu\n", n_remain, n_remain_total);
 #endif
 }
@@ -101,11 +120,27 @@ void monitor_statistic() {
         "frequency");
 #else
   Log("CONFIG_ENABLE_INSTR_CNT is not defined");
+#endif
+  IFDEF(CONFIG_SMP, smp_statistic());
+  IFDEF(CONFIG_VIRTUAL_TIME, vtime_statistic());
+#ifdef CONFIG_RV_GUEST_TLB
+  extern void gtlb_statistic();
+  gtlb_statistic();
+#endif
+#ifdef CONFIG_MEM_COMPRESS_LAZY
+  extern void lazy_restore_statistic();
+  lazy_restore_statistic();
+#endif
+#ifdef CONFIG_PERF_OPT
+  extern void tcache_statistic();
+  tcache_statistic();
+  IFDEF(CONFIG_MODE_SYSTEM, hosttlb_statistic());
+  IFDEF(CONFIG_ENGINE_JIT, jit_statistic());
 #endif
 }
 
-static word_t g_ex_cause = 0;
-static int g_sys_state_flag = 0;
+static HART_LOCAL word_t g_ex_cause = 0;
+static HART_LOCAL int g_sys_state_flag = 0;
 
 void set_sys_state_flag(int flag) { g_sys_state_flag |= flag; }
 
@@ -115,6 +150,30 @@ void mmu_tlb_flush(vaddr_t vaddr) {
     set_sys_state_flag(SYS_STATE_FLUSH_TCACHE);
 }
 
+#ifdef CONFIG_PERF_OPT
+void tcache_invalidate_vaddr(vaddr_t vaddr, uint32_t ctx, uint32_t ctx_mask);
+void tcache_invalidate_code();
+#endif
+
+// Only drop the basic blocks fetched from the contexts selected by
+// `ctx_mask`, see isa_ifetch_ctx(). `vaddr == 0` selects all pages.
+void mmu_tlb_flush_ctx(vaddr_t vaddr, uint32_t ctx, uint32_t ctx_mask) {
+  hosttlb_flush_ctx(vaddr, ctx, ctx_mask);
+  IFDEF(CONFIG_PERF_OPT, tcache_invalidate_vaddr(vaddr, ctx, ctx_mask));
+  set_sys_state_flag(SYS_STATE_LOOKUP_TCACHE);
+}
+
+// Basic blocks and host TLB entries are tagged with their context,
+// so they survive a switch of the address space.
+void mmu_ctx_switch() {
+  set_sys_state_flag(SYS_STATE_LOOKUP_TCACHE);
+}
+
+void mmu_icache_flush() {
+  IFDEF(CONFIG_PERF_OPT, tcache_invalidate_code());
+  set_sys_state_flag(SYS_STATE_LOOKUP_TCACHE);
+}
+
 _Noreturn void longjmp_exec(int cause) {
   Loge("Longjmp to jbuf_exec with cause: %i", cause);
   longjmp(jbuf_exec, cause);
@@ -133,13 +192,45 @@ _Noreturn void longjmp_exception(int ex_cause) {
 static bool manual_cpt_quit = false;
 #define FILL_EXEC_TABLE(name) [concat(EXEC_ID_, name)] = &&concat(exec_, name),
 
+#ifdef CONFIG_TCACHE_SUPERBLOCK
+Decode *tcache_sb_form(Decode *end, Decode *next);
+// Leave the basic block ending with `s` for `next`. Stay in the superblock
+// if `next` is the hot successor placed right behind `s`, otherwise count
+// the exit to find hot paths.
+#define rtl_bb_exit(s, next)                                                   \
+  do {                                                                         \
+    Decode *__next = (next);                                                   \
+    if (s->sb == SB_INNER) {                                                   \
+      if (likely(__next == s + 1 && n > 0)) {                                  \
+        IFDEF(CONFIG_ENABLE_INSTR_CNT, n_remain = n);                          \
+        IFNDEF(CONFIG_ENABLE_INSTR_CNT, n--);                                  \
+        is_ctrl = false;                                                       \
+        s = __next;                                                            \
+        save_globals(s);                                                       \
+        goto *(s->EHelper);                                                    \
+      }                                                                        \
+    } else if (s->sb < CONFIG_TCACHE_SB_THRESHOLD) {                           \
+      s->sb++;                                                                 \
+    } else if (unlikely(s->sb == CONFIG_TCACHE_SB_THRESHOLD)) {                \
+      __next = tcache_sb_form(s, __next);                                      \
+    }                                                                          \
+    s = __next;                                                                \
+    goto end_of_bb;                                                            \
+  } while (0)
+#else
+#define rtl_bb_exit(s, next)                                                   \
+  do {                                                                         \
+    s = (next);                                                                \
+    goto end_of_bb;                                                            \
+  } while (0)
+#endif
+
 #define rtl_j(s, target)                                                       \
   do {                                                                         \
     IFDEF(CONFIG_ENABLE_INSTR_CNT, n -= s->idx_in_bb);                         \
-    s = s->tnext;                                                              \
     is_ctrl = true;                                                            \
     br_taken = true;                                                           \
-    goto end_of_bb;                                                            \
+    rtl_bb_exit(s, s->tnext);                                                  \
   } while (0)
 #define rtl_jr(s, target)                                                      \
   do {                                                                         \
@@ -154,11 +245,10 @@ static bool manual_cpt_quit = false;
     IFDEF(CONFIG_ENABLE_INSTR_CNT, n -= s->idx_in_bb);                         \
     is_ctrl = true;                                                            \
     if (interpret_relop(relop, *src1, *src2)) {                                \
-      s = s->tnext;                                                            \
       br_taken = true;                                                         \
-    } else                                                                     \
-      s = s->ntnext;                                                           \
-    goto end_of_bb;                                                            \
+      rtl_bb_exit(s, s->tnext);                                                \
+    }                                                                          \
+    rtl_bb_exit(s, s->ntnext);                                                 \
   } while (0)
 
 #define rtl_priv_next(s)                                                       \
@@ -166,6 +256,8 @@ static bool manual_cpt_quit = false;
     if (g_sys_state_flag) {                                                    \
       s = (g_sys_state_flag & SYS_STATE_FLUSH_TCACHE)                          \
               ? tcache_handle_flush(s->snpc)                                   \
+              : (g_sys_state_flag & SYS_STATE_LOOKUP_TCACHE)                   \
+              ? tcache_handle_lookup(s->snpc)                                  \
               : s + 1;                                                         \
       g_sys_state_flag = 0;                                                    \
       goto end_of_loop;                                                        \
@@ -175,10 +267,13 @@ static bool manual_cpt_quit = false;
 #define rtl_priv_jr(s, target)                                                 \
   do {                                                                         \
     IFDEF(CONFIG_ENABLE_INSTR_CNT, n -= s->idx_in_bb);                         \
-    s = jr_fetch(s, *(target));                                                \
     if (g_sys_state_flag & SYS_STATE_FLUSH_TCACHE) {                           \
-      s = tcache_handle_flush(s->pc);                                          \
+      s = tcache_handle_flush(*(target));                                      \
       g_sys_state_flag = 0;                                                    \
+    } else {                                                                   \
+      /* the privilege level may change, look up with the new context */       \
+      s = tcache_handle_lookup(*(target));                                     \
+      g_sys_state_flag &= ~SYS_STATE_LOOKUP_TCACHE;                            \
     }                                                                          \
     goto end_of_loop;                                                          \
   } while (0)
@@ -189,6 +284,7 @@ Decode *tcache_jr_fetch(Decode *s, vaddr_t jpc);
 Decode *tcache_decode(Decode *s);
 void tcache_handle_exception(vaddr_t jpc);
 Decode *tcache_handle_flush(vaddr_t snpc);
+Decode *tcache_handle_lookup(vaddr_t pc);
 
 static inline Decode *jr_fetch(Decode *s, vaddr_t target) {
   if (likely(s->tnext->pc == target))
@@ -207,13 +303,78 @@ static inline void debug_difftest(Decode *_this, Decode *next) {
   IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, next->pc));
 }
 
+#ifdef CONFIG_TCACHE_BB_COUNTER
+void simpoint_profiling_block(uint64_t start, uint64_t end, uint64_t count);
+void simpoint_profiling_resume(uint64_t start, uint64_t abs_instr_count);
+uint64_t simpoint_profiling_budget();
+
+// Block ends with a count to drain, in the order they are first counted,
+// which is the order SimPoint assigns ids to new basic blocks. With
+// CONFIG_SMP, each hart drains its counters at the end of its turn.
+static HART_LOCAL Decode *bbc_dirty = NULL, **bbc_dirty_tail = NULL;
+static HART_LOCAL vaddr_t bbc_start = 0;
+static HART_LOCAL uint64_t bbc_last = 0, bbc_pending = 0, bbc_budget = 0;
+
+void bb_counter_drain() {
+  if (bbc_dirty == NULL) return;
+  Decode *d;
+  for (d = bbc_dirty; d != NULL; d = d->bbc_next) {
+    simpoint_profiling_block(d->bbc_start, d->pc, d->bbc_count);
+    d->bbc_count = 0;
+  }
+  bbc_dirty = NULL;
+  bbc_pending = 0;
+  simpoint_profiling_resume(bbc_start, bbc_last);
+  bbc_budget = simpoint_profiling_budget();
+}
+
+static inline void bb_counter_resume(vaddr_t start, uint64_t abs_inst_count) {
+  bbc_start = start;
+  bbc_last = abs_inst_count;
+  bbc_budget = simpoint_profiling_budget();
+}
+
+// Count the basic block ending with `end`. Fall back to SimPoint itself
+// if the interval may end here, or the counter is taken by another start.
+static inline bool bb_counter_count(Decode *end, Decode *next, uint64_t abs_inst_count) {
+  uint64_t n = abs_inst_count - bbc_last;
+  if (n == 0 || bbc_pending + n >= bbc_budget) goto slow;
+  if (end->bbc_count == 0) {
+    end->bbc_start = bbc_start;
+    end->bbc_next = NULL;
+    if (bbc_dirty == NULL) bbc_dirty_tail = &bbc_dirty;
+    *bbc_dirty_tail = end;
+    bbc_dirty_tail = &end->bbc_next;
+  } else if (end->bbc_start != bbc_start) {
+    goto slow;
+  }
+  end->bbc_count += n;
+  bbc_pending += n;
+  bbc_start = next->pc;
+  bbc_last = abs_inst_count;
+  return true;
+
+slow:
+  bb_counter_drain();
+  return false;
+}
+#endif
+
 #ifndef CONFIG_SHARE
 uint64_t per_bb_profile(Decode *prev_s, Decode *s, bool control_taken) {
   uint64_t abs_inst_count = get_abs_instr_count();
   // workload_loaded set from nemu_trap
   if (profiling_state == SimpointProfiling && (workload_loaded||donot_skip_boot)) {
+#ifdef CONFIG_TCACHE_BB_COUNTER
+    if (!bb_counter_count(prev_s, s, abs_inst_count)) {
+      simpoint_profiling(prev_s->pc, true, abs_inst_count);
+      simpoint_profiling(s->pc, false, abs_inst_count);
+      bb_counter_resume(s->pc, abs_inst_count);
+    }
+#else
     simpoint_profiling(prev_s->pc, true, abs_inst_count);
     simpoint_profiling(s->pc, false, abs_inst_count);
+#endif
   }
 
     //  if (checkpoint_taking && able_to_take &&
@@ -274,14 +435,23 @@ static int execute(int n) {
   Logtb("Will execute %i instrs\n", n);
   static const void *local_exec_table[TOTAL_INSTR] = {
       MAP(INSTR_LIST, FILL_EXEC_TABLE)};
-  static int init_flag = 0;
+  static HART_LOCAL int init_flag = 0;
   Decode *s = prev_s;
 
   if (likely(init_flag == 0)) {
     g_exec_table = local_exec_table;
+#ifdef CONFIG_ENGINE_JIT
+#define FILL_JIT_TABLE(name, op, form) \
+    { &&concat(exec_, name), concat(JIT_, op), concat(JIT_, form) },
+    static const JitInstr jit_table[] = { JIT_INSTR_LIST(FILL_JIT_TABLE) };
+    jit_init(&&exec_nemu_jit, jit_table, ARRLEN(jit_table));
+#endif
     extern Decode *tcache_init(const void *exec_nemu_decode,
+                               const void *exec_nemu_redirect,
                                vaddr_t reset_vector);
-    s = tcache_init(&&exec_nemu_decode, cpu.pc);
+    s = tcache_init(&&exec_nemu_decode,
+                    MUXDEF(CONFIG_TCACHE_SUPERBLOCK, &&exec_nemu_redirect, NULL),
+                    cpu.pc);
     IFDEF(CONFIG_MODE_SYSTEM, hosttlb_init());
     init_flag = 1;
   }
@@ -312,6 +482,25 @@ static int execute(int n) {
       continue;
     }
 
+#ifdef CONFIG_TCACHE_SUPERBLOCK
+    // the old head of a basic block which is copied into a superblock
+    def_EHelper(nemu_redirect) {
+      s = s->tnext;
+      continue;
+    }
+#endif
+
+#ifdef CONFIG_ENGINE_JIT
+    // the first instruction of a run translated by the JIT
+    def_EHelper(nemu_jit) {
+      Decode *next = ((Decode *(*)(Decode *))s->jcode)(s);
+      // let the reference catch up with the whole run
+      IFDEF(CONFIG_DIFFTEST, difftest_skip_dut(next - s, 1));
+      s = next;
+      goto finish_label;
+    }
+#endif
+
   end_of_bb:
     IFDEF(CONFIG_ENABLE_INSTR_CNT, n_remain = n);
     IFNDEF(CONFIG_ENABLE_INSTR_CNT, n--);
@@ -368,7 +557,7 @@ end_of_loop:
 #include "isa-exec.h"
 static const void *g_exec_table[TOTAL_INSTR] = {
     MAP(INSTR_LIST, FILL_EXEC_TABLE)};
-uint64_t br_count = 0;
+HART_LOCAL uint64_t br_count = 0;
 
 #ifdef CONFIG_BR_LOG
 struct br_info br_log[CONFIG_BR_LOG_SIZE];
@@ -381,138 +570,67 @@ uint64_t stable_log_begin, spec_log_begin;
 extern int ifetch_mmu_state;
 extern int data_mmu_state;
 struct lightqs_reg_ss reg_ss, spec_reg_ss;
+// whether spec_reg_ss is at spec_log_begin, i.e. the run ahead completed
+static bool spec_reg_ss_valid = false;
 void csr_writeback();
 void csr_prepare();
 
-void lightqs_take_reg_snapshot() {
+static void take_reg_snapshot(struct lightqs_reg_ss *ss) {
   csr_prepare();
-  reg_ss.br_cnt = br_count;
-  reg_ss.inst_cnt = g_nr_guest_instr;
+  ss->br_cnt = br_count;
+  ss->inst_cnt = g_nr_guest_instr;
+  memcpy(&ss->cpu, &cpu, sizeof(cpu));
+  memcpy(ss->csr, csr_array, sizeof(ss->csr));
+  ss->ifetch_mmu_state = ifetch_mmu_state;
+  ss->data_mmu_state = data_mmu_state;
+}
+
+void lightqs_take_reg_snapshot() {
 #ifdef CONFIG_LIGHTQS_DEBUG
   printf("current g instr cnt = %lu\n", g_nr_guest_instr);
 #endif // CONFIG_LIGHTQS_DEBUG
-  reg_ss.pc = cpu.pc;
-  reg_ss.mstatus = cpu.mstatus;
-  reg_ss.mcause = cpu.mcause;
-  reg_ss.mepc = cpu.mepc;
-  reg_ss.sstatus = cpu.sstatus;
-  reg_ss.scause = cpu.scause;
-  reg_ss.sepc = cpu.sepc;
-  reg_ss.satp = cpu.satp;
-  reg_ss.mip = cpu.mip;
-  reg_ss.mie = cpu.mie;
-  reg_ss.mscratch = cpu.mscratch;
-  reg_ss.sscratch = cpu.sscratch;
-  reg_ss.medeleg = cpu.medeleg;
-  reg_ss.mideleg = cpu.mideleg;
-  reg_ss.mtval = cpu.mtval;
-  reg_ss.stval = cpu.stval;
-  reg_ss.mtvec = cpu.mtvec;
-  reg_ss.stvec = cpu.stvec;
-  reg_ss.mode = cpu.mode;
-  reg_ss.lr_addr = cpu.lr_addr;
-  reg_ss.lr_valid = cpu.lr_valid;
-  reg_ss.ifetch_mmu_state = ifetch_mmu_state;
-  reg_ss.data_mmu_state = data_mmu_state;
-#ifdef CONFIG_RVV
-  reg_ss.vtype = cpu.vtype;
-  reg_ss.vstart = cpu.vstart;
-  reg_ss.vxsat = cpu.vxsat;
-  reg_ss.vxrm = cpu.vxrm;
-  reg_ss.vl = cpu.vl;
-#endif // CONFIG_RVV
-  for (int i = 0; i < 32; i++) {
-    reg_ss.gpr[i] = cpu.gpr[i]._64;
-    reg_ss.fpr[i] = cpu.fpr[i]._64;
-  }
+  take_reg_snapshot(&reg_ss);
+  lightqs_take_pmem_snapshot();
 }
 
 void lightqs_take_spec_reg_snapshot() {
-  csr_prepare();
-  spec_reg_ss.br_cnt = br_count;
-  spec_reg_ss.inst_cnt = g_nr_guest_instr;
-  spec_reg_ss.pc = cpu.pc;
-  spec_reg_ss.mstatus = cpu.mstatus;
-  spec_reg_ss.mcause = cpu.mcause;
-  spec_reg_ss.mepc = cpu.mepc;
-  spec_reg_ss.sstatus = cpu.sstatus;
-  spec_reg_ss.scause = cpu.scause;
-  spec_reg_ss.sepc = cpu.sepc;
-  spec_reg_ss.satp = cpu.satp;
-  spec_reg_ss.mip = cpu.mip;
-  spec_reg_ss.mie = cpu.mie;
-  spec_reg_ss.mscratch = cpu.mscratch;
-  spec_reg_ss.sscratch = cpu.sscratch;
-  spec_reg_ss.medeleg = cpu.medeleg;
-  spec_reg_ss.mideleg = cpu.mideleg;
-  spec_reg_ss.mtval = cpu.mtval;
-  spec_reg_ss.stval = cpu.stval;
-  spec_reg_ss.mtvec = cpu.mtvec;
-  spec_reg_ss.stvec = cpu.stvec;
-  spec_reg_ss.mode = cpu.mode;
-  spec_reg_ss.lr_addr = cpu.lr_addr;
-  spec_reg_ss.lr_valid = cpu.lr_valid;
-  spec_reg_ss.ifetch_mmu_state = ifetch_mmu_state;
-  spec_reg_ss.data_mmu_state = data_mmu_state;
-#ifdef CONFIG_RVV
-  spec_reg_ss.vtype = cpu.vtype;
-  spec_reg_ss.vstart = cpu.vstart;
-  spec_reg_ss.vxsat = cpu.vxsat;
-  spec_reg_ss.vxrm = cpu.vxrm;
-  spec_reg_ss.vl = cpu.vl;
-#endif // CONFIG_RVV
-  for (int i = 0; i < 32; i++) {
-    spec_reg_ss.gpr[i] = cpu.gpr[i]._64;
-    spec_reg_ss.fpr[i] = cpu.fpr[i]._64;
-  }
+  take_reg_snapshot(&spec_reg_ss);
+  // the run ahead only stops early when the guest has ended
+  Assert(spec_reg_ss.inst_cnt == spec_log_begin ||
+      nemu_state.state == NEMU_END || nemu_state.state == NEMU_ABORT,
+      "speculative snapshot at %lu, expected at %lu", spec_reg_ss.inst_cnt, spec_log_begin);
+  spec_reg_ss_valid = (spec_reg_ss.inst_cnt == spec_log_begin);
+  if (spec_reg_ss_valid) lightqs_take_spec_pmem_snapshot();
 }
 
+// Restore the registers and RAM to the same snapshot, the speculative one
+// if n is past it. Return the number of instructions left to reach n.
 uint64_t lightqs_restore_reg_snapshot(uint64_t n) {
 #ifdef CONFIG_LIGHTQS_DEBUG
   printf("lightqs restore reg n = %lu\n", n);
   printf("lightqs origin reg_ss inst cnt %lu\n", reg_ss.br_cnt);
 #endif // CONFIG_LIGHTQS_DEBUG
-  if (spec_log_begin <= n) {
+  bool use_spec = spec_reg_ss_valid && spec_log_begin <= n;
+  if (use_spec) {
 #ifdef CONFIG_LIGHTQS_DEBUG
     printf("lightqs using spec snapshot\n");
 #endif // CONFIG_LIGHTQS_DEBUG
     memcpy(&reg_ss, &spec_reg_ss, sizeof(reg_ss));
   }
+  spec_reg_ss_valid = false;
+  pmem_record_restore(use_spec);
   br_count = reg_ss.br_cnt;
   g_nr_guest_instr = reg_ss.inst_cnt;
-  cpu.pc = reg_ss.pc;
-  cpu.mstatus = reg_ss.mstatus;
-  cpu.mcause = reg_ss.mcause;
-  cpu.mepc = reg_ss.mepc;
-  cpu.sstatus = reg_ss.sstatus;
-  cpu.scause = reg_ss.scause;
-  cpu.sepc = reg_ss.sepc;
-  cpu.satp = reg_ss.satp;
-  cpu.mip = reg_ss.mip;
-  cpu.mie = reg_ss.mie;
-  cpu.mscratch = reg_ss.mscratch;
-  cpu.sscratch = reg_ss.sscratch;
-  cpu.medeleg = reg_ss.medeleg;
-  cpu.mideleg = reg_ss.mideleg;
-  cpu.mtval = reg_ss.mtval;
-  cpu.stval = reg_ss.stval;
-  cpu.mode = reg_ss.mode;
-  cpu.lr_addr = reg_ss.lr_addr;
-  cpu.lr_valid = reg_ss.lr_valid;
+  memcpy(&cpu, &reg_ss.cpu, sizeof(cpu));
+  memcpy(csr_array, reg_ss.csr, sizeof(reg_ss.csr));
   ifetch_mmu_state = reg_ss.ifetch_mmu_state;
   data_mmu_state = reg_ss.data_mmu_state;
-#ifdef CONFIG_RVV
-  cpu.vtype = reg_ss.vtype;
-  cpu.vstart = reg_ss.vstart;
-  cpu.vxsat = reg_ss.vxsat;
-  cpu.vxrm = reg_ss.vxrm;
-  cpu.vl = reg_ss.vl;
-#endif // CONFIG_RVV
-  for (int i = 0; i < 32; i++) {
-    cpu.gpr[i]._64 = reg_ss.gpr[i];
-    cpu.fpr[i]._64 = reg_ss.fpr[i];
-  }
   csr_writeback();
+  extern void pmp_update_regions();
+  pmp_update_regions();
+  // pick up the context of the host TLB
+  extern int update_mmu_state();
+  update_mmu_state();
 #ifdef CONFIG_LIGHTQS_DEBUG
   printf("lightqs restore inst_cnt %lu\n", reg_ss.inst_cnt);
 #endif // CONFIG_LIGHTQS_DEBUG
@@ -522,7 +640,7 @@ uint64_t lightqs_restore_reg_snapshot(uint64_t n) {
 #endif // CONFIG_LIGHTQS
 
 static int execute(int n) {
-  static Decode s;
+  static HART_LOCAL Decode s;
   prev_s = &s;
   for (; n > 0; n--) {
 #ifdef CONFIG_LIGHTQS_DEBUG
@@ -531,6 +649,7 @@ static int execute(int n) {
     cpu.amo = false;
     fetch_decode(&s, cpu.pc);
     cpu.debug.current_pc = s.pc;
+    IFDEF(CONFIG_DIFFTEST_COMMIT_LOG, cpu.debug.current_instr = s.isa.instr.val);
     cpu.pc = s.snpc;
 #ifdef CONFIG_TVAL_EX_II
     cpu.instr = s.isa.instr.val;
@@ -561,6 +680,13 @@ static int execute(int n) {
     if (isa_query_intr() != INTR_EMPTY) {
       break;
     }
+#ifdef CONFIG_VIRTUAL_TIME
+    // end the batch like rtl_priv_next(), e.g. after vtime_idle()
+    if (g_sys_state_flag & SYS_STATE_UPDATE) {
+      g_sys_state_flag = 0;
+      break;
+    }
+#endif
     if (nemu_state.state == NEMU_STOP) {
       break;
     }
@@ -590,28 +716,8 @@ static void update_global() {
 }
 #endif
 
-/* Simulate how the CPU works. */
-void cpu_exec(uint64_t n) {
-#ifndef CONFIG_LIGHTQS
-  IFDEF(CONFIG_SHARE, assert(n <= 1));
-#endif
-  g_print_step = (n < MAX_INSTR_TO_PRINT);
-  switch (nemu_state.state) {
-  case NEMU_END:
-  case NEMU_ABORT:
-    printf("Program execution has ended. To restart the program, exit NEMU and "
-           "run again.\n");
-#ifdef CONFIG_BR_LOG
-    printf("debug: bridx = %ld\n", br_count);
-#endif // CONFIG_BR_LOG
-    return;
-  default:
-    nemu_state.state = NEMU_RUNNING;
-    Loge("Setting NEMU state to RUNNING");
-  }
-
-  uint64_t timer_start = get_time();
-
+// Run at most n instructions on the current hart.
+void cpu_exec_hart(uint64_t n) {
   n_remain_total = n; // + AHEAD_LENGTH; // deal with setjmp()
   Loge("cpu_exec will exec %lu instrunctions", n_remain_total);
   int cause;
@@ -627,9 +733,17 @@ void cpu_exec(uint64_t n) {
 
   while (nemu_state.state == NEMU_RUNNING &&
          MUXDEF(CONFIG_ENABLE_INSTR_CNT, n_remain_total > 0, true)) {
+#ifdef CONFIG_SMP
+    if (!smp_hart_enter()) break;
+    // the other harts may have profiled instructions since the last turn
+    IFDEF(CONFIG_TCACHE_BB_COUNTER, bbc_budget = simpoint_profiling_budget());
+    extern void clint_sync_hart();
+    clint_sync_hart();
+#endif
+    IFDEF(CONFIG_VIRTUAL_TIME, vtime_run_events());
 #ifdef CONFIG_DEVICE
     extern void device_update();
-    device_update();
+    if (MUXDEF(CONFIG_SMP, smp_hart_id() == 0, true)) device_update();
 #endif
 
 #ifndef CONFIG_SHARE
@@ -660,6 +774,10 @@ void cpu_exec(uint64_t n) {
     }
 
     int n_batch = n_remain_total >= BATCH_SIZE ? BATCH_SIZE : n_remain_total;
+#ifdef CONFIG_VIRTUAL_TIME
+    n_batch = vtime_batch_size(n_batch);
+    n_batch_vtime = n_remain = n_batch;
+#endif
     n_remain = execute(n_batch);
 #ifdef CONFIG_PERF_OPT
     // return from execute
@@ -668,14 +786,44 @@ void cpu_exec(uint64_t n) {
 #else
     n_remain_total -= n_batch;
 
+#endif
+#ifdef CONFIG_SMP
+    IFDEF(CONFIG_TCACHE_BB_COUNTER, bb_counter_drain());
+    smp_hart_yield();
 #endif
   }
+  IFDEF(CONFIG_SMP, smp_hart_exit());
+}
+
+/* Simulate how the CPU works. */
+void cpu_exec(uint64_t n) {
+#ifndef CONFIG_LIGHTQS
+  IFDEF(CONFIG_SHARE, assert(n <= 1));
+#endif
+  g_print_step = (n < MAX_INSTR_TO_PRINT);
+  switch (nemu_state.state) {
+  case NEMU_END:
+  case NEMU_ABORT:
+    printf("Program execution has ended. To restart the program, exit NEMU and "
+           "run again.\n");
+#ifdef CONFIG_BR_LOG
+    printf("debug: bridx = %ld\n", br_count);
+#endif // CONFIG_BR_LOG
+    return;
+  default:
+    nemu_state.state = NEMU_RUNNING;
+    Loge("Setting NEMU state to RUNNING");
+  }
+
+  uint64_t timer_start = get_time();
+
+  IFDEF(CONFIG_SMP, smp_round_begin(n));
+  cpu_exec_hart(n);
+  IFDEF(CONFIG_SMP, smp_round_end());
 
 #ifndef CONFIG_SHARE
 #ifdef CONFIG_LIGHTQS
   // restore to expected point
-  void pmem_record_restore(uint64_t restore_inst_cnt);
-  pmem_record_restore(reg_ss.inst_cnt);
   uint64_t remain_inst_cnt = lightqs_restore_reg_snapshot(n);
   extern void clint_restore_snapshot();
   clint_restore_snapshot();
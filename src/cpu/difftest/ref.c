@@ -83,6 +83,9 @@ void difftest_memcpy(paddr_t nemu_addr, void *dut_buf, size_t n, bool direction)
   if (direction == DIFFTEST_TO_REF) memcpy(guest_to_host(nemu_addr), dut_buf, n);
   else memcpy(dut_buf, guest_to_host(nemu_addr), n);
 #endif
+#ifdef CONFIG_PERF_OPT
+  if (direction == DIFFTEST_TO_REF) pmem_code_page_write(nemu_addr, n);
+#endif
 #endif
 }
 
@@ -109,10 +112,10 @@ void difftest_set_ramsize(size_t ram_size){
 }
 #ifdef CONFIG_LIGHTQS
 void difftest_regcpy(void *dut, bool direction, bool restore, uint64_t restore_count) {
+  #ifdef CONFIG_LIGHTQS_DEBUG
   if (restore)
-    #ifdef CONFIG_LIGHTQS_DEBUG
     printf("regcpy with restore called, dut = %lx restore = %d, restore_count = %lu\n", (uint64_t)dut, restore, restore_count);
-    #endif // CONFIG_LIGHTQS_DEBUG
+  #endif // CONFIG_LIGHTQS_DEBUG
   isa_difftest_regcpy(dut, direction, restore, restore_count);
 }
 #else
@@ -126,9 +129,15 @@ void difftest_csrcpy(void *dut, bool direction) {
   isa_difftest_csrcpy(dut, direction);
 }
 
+#ifdef CONFIG_LIGHTQS
+void difftest_uarchstatus_sync(void *dut, uint64_t restore_count) {
+  isa_difftest_uarchstatus_cpy(dut, DIFFTEST_TO_REF, restore_count);
+}
+#else
 void difftest_uarchstatus_sync(void *dut) {
   isa_difftest_uarchstatus_cpy(dut, DIFFTEST_TO_REF);
 }
+#endif // CONFIG_LIGHTQS
 
 #ifdef CONFIG_LIGHTQS
 void difftest_uarchstatus_cpy(void *dut, bool direction, uint64_t restore_count) {
@@ -153,6 +162,14 @@ void difftest_exec(uint64_t n) {
   cpu_exec(n);
 }
 
+#ifdef CONFIG_DIFFTEST_COMMIT_LOG
+// Step at most n instructions, and fill a struct DifftestCommit for each
+// of them into log. Return the number of records.
+uint64_t difftest_exec_commits(uint64_t n, void *log) {
+  return isa_difftest_exec_commits(n, log);
+}
+#endif
+
 #ifdef CONFIG_REF_STATUS
 int difftest_status() {
   switch (nemu_state.state) {
@@ -264,7 +281,7 @@ void difftest_put_gmaddr(uint8_t* ptr) {
 
 #endif
 
-#ifdef CONFIG_STORE_LOG
+#if defined(CONFIG_STORE_LOG) && !defined(CONFIG_LIGHTQS)
 void difftest_store_log_reset() {
   extern void pmem_record_reset();
   pmem_record_reset();
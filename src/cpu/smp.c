@@ -0,0 +1,192 @@
+/***************************************************************************************
+* Copyright (c) 2014-2021 Zihao Yu, Nanjing University
+* Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/smp.h>
+#include <utils.h>
+#include <pthread.h>
+
+#ifdef CONFIG_SMP
+
+#define NR_HARTS CONFIG_NR_HARTS
+
+extern HART_LOCAL uint64_t g_nr_guest_instr;
+
+static HART_LOCAL int hart_id = 0;
+static pthread_t hart_thread[NR_HARTS];
+static uint64_t hart_nr_instr[NR_HARTS] = {};
+
+SmpResv smp_resv_table[SMP_RESV_NR] = {};
+
+// Each call of cpu_exec() is a round. The other harts wait for the next
+// round on their own threads, so that their states are kept between rounds.
+static pthread_mutex_t round_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t round_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t round_finish = PTHREAD_COND_INITIALIZER;
+static uint64_t round_id = 0;
+static uint64_t round_n = 0;
+static int round_nr_done = 0;
+
+#ifdef CONFIG_SMP_DETERMINISTIC
+// The hart holding the turn is the only one running. The turn is passed
+// in the order of hart ids, skipping the harts which finished the round.
+static pthread_mutex_t turn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t turn_cond = PTHREAD_COND_INITIALIZER;
+static int turn = 0;
+static bool hart_exited[NR_HARTS] = {};
+static HART_LOCAL bool has_turn = false;
+#else
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+int smp_hart_id() {
+  return hart_id;
+}
+
+static void hart_done() {
+  pthread_mutex_lock(&round_lock);
+  round_nr_done ++;
+  pthread_cond_signal(&round_finish);
+  pthread_mutex_unlock(&round_lock);
+}
+
+static void wait_harts(int nr) {
+  pthread_mutex_lock(&round_lock);
+  while (round_nr_done < nr) {
+    pthread_cond_wait(&round_finish, &round_lock);
+  }
+  pthread_mutex_unlock(&round_lock);
+}
+
+static void* hart_main(void *arg) {
+  hart_id = (intptr_t)arg;
+  isa_init_hart(hart_id);
+  hart_done();
+
+  uint64_t seen = 0;
+  while (true) {
+    pthread_mutex_lock(&round_lock);
+    while (round_id == seen) {
+      pthread_cond_wait(&round_start, &round_lock);
+    }
+    seen = round_id;
+    uint64_t n = round_n;
+    pthread_mutex_unlock(&round_lock);
+
+    cpu_exec_hart(n);
+    hart_done();
+  }
+  return NULL;
+}
+
+static void start_harts() {
+  // the other harts are initialized one after another,
+  // before any of them runs
+  int i;
+  for (i = 1; i < NR_HARTS; i ++) {
+    int ret = pthread_create(&hart_thread[i], NULL, hart_main, (void *)(intptr_t)i);
+    Assert(ret == 0, "Can not create the thread of hart %d", i);
+    wait_harts(i);
+  }
+  Log("SMP: %d harts, %s", NR_HARTS, MUXDEF(CONFIG_SMP_DETERMINISTIC,
+      "interleaved every " str(CONFIG_SMP_QUANTUM) " instructions", "running in parallel"));
+}
+
+void smp_round_begin(uint64_t n) {
+  static bool started = false;
+  if (!started) {
+    start_harts();
+    started = true;
+  }
+#ifdef CONFIG_SMP_DETERMINISTIC
+  turn = 0;
+  memset(hart_exited, 0, sizeof(hart_exited));
+#endif
+  pthread_mutex_lock(&round_lock);
+  round_n = n;
+  round_nr_done = 0;
+  round_id ++;
+  pthread_cond_broadcast(&round_start);
+  pthread_mutex_unlock(&round_lock);
+}
+
+void smp_round_end() {
+  wait_harts(NR_HARTS - 1);
+}
+
+#ifdef CONFIG_SMP_DETERMINISTIC
+// called with turn_lock held
+static void pass_turn() {
+  int next = turn;
+  do {
+    next = (next + 1) % NR_HARTS;
+  } while (hart_exited[next] && next != turn);
+  turn = next;
+  has_turn = false;
+  pthread_cond_broadcast(&turn_cond);
+}
+#endif
+
+bool smp_hart_enter() {
+#ifdef CONFIG_SMP_DETERMINISTIC
+  if (!has_turn) {
+    pthread_mutex_lock(&turn_lock);
+    while (turn != hart_id) {
+      pthread_cond_wait(&turn_cond, &turn_lock);
+    }
+    pthread_mutex_unlock(&turn_lock);
+    has_turn = true;
+  }
+#endif
+  return nemu_state.state == NEMU_RUNNING;
+}
+
+void smp_hart_yield() {
+#ifdef CONFIG_SMP_DETERMINISTIC
+  pthread_mutex_lock(&turn_lock);
+  pass_turn();
+  pthread_mutex_unlock(&turn_lock);
+#endif
+}
+
+void smp_hart_exit() {
+#ifdef CONFIG_SMP_DETERMINISTIC
+  pthread_mutex_lock(&turn_lock);
+  hart_exited[hart_id] = true;
+  // the turn may be passed to this hart before it notices the end
+  if (turn == hart_id) pass_turn();
+  pthread_mutex_unlock(&turn_lock);
+#endif
+  hart_nr_instr[hart_id] = g_nr_guest_instr;
+}
+
+void smp_io_lock() {
+  // only one hart runs at a time when they are interleaved
+  IFNDEF(CONFIG_SMP_DETERMINISTIC, pthread_mutex_lock(&io_lock));
+}
+
+void smp_io_unlock() {
+  IFNDEF(CONFIG_SMP_DETERMINISTIC, pthread_mutex_unlock(&io_lock));
+}
+
+void smp_statistic() {
+  int i;
+  for (i = 0; i < NR_HARTS; i ++) {
+    Log("hart %d: guest instructions = %'ld", i, hart_nr_instr[i]);
+  }
+}
+#endif
@@ -15,48 +15,107 @@
 
 #include <cpu/decode.h>
 #include <cpu/cpu.h>
+#include <memory/vaddr.h>
+#include <memory/paddr.h>
+#include <memory/host-tlb.h>
+#include <profiling/profiling_control.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#ifdef CONFIG_ENGINE_JIT
+#include <jit.h>
+#endif
 
 #ifdef CONFIG_PERF_OPT
 
-#define TCACHE_BB_SIZE (CONFIG_TCACHE_SIZE / 4 + 2)
+// The trace cache is split into TCACHE_GEN_NUM generations, each of which
+// holds TCACHE_GEN_SIZE decoded instructions. Generations are filled in
+// FIFO order. When all of them are used, only the oldest generation is
+// evicted, instead of flushing every decoded basic block.
+#define TCACHE_GEN_SIZE CONFIG_TCACHE_SIZE
+#define TCACHE_GEN_NUM  CONFIG_TCACHE_GEN_NUM
+#define TCACHE_TOTAL_SIZE (TCACHE_GEN_SIZE * TCACHE_GEN_NUM)
+// each decoded control flow instruction owns at most two records
+#define TCACHE_BB_SIZE (TCACHE_TOTAL_SIZE * 2 + 2)
 
 typedef struct bb_t {
   Decode *s;
   struct bb_t *next;
   vaddr_t pc;
+  vaddr_t end_pc;    // the last byte of the basic block
+  paddr_t paddr;     // physical address of pc
+  paddr_t end_paddr; // physical address of end_pc
+  uint32_t ctx;      // see isa_ifetch_ctx()
 } bb_t;
 
 enum { BB_RECORD_TYPE_NTAKEN = 1, BB_RECORD_TYPE_TAKEN };
 
-static Decode tcache_pool[CONFIG_TCACHE_SIZE] = {};
-static int tc_idx = 0;
-static Decode tcache_bb_pool[TCACHE_BB_SIZE] = {};
-static Decode *tcache_bb_freelist = NULL;
-static bb_t bb_pool[CONFIG_BB_POOL_SIZE] = {};
-static int bb_idx = 0;
-static bb_t bb_list [CONFIG_BB_LIST_SIZE] = {};
+static HART_LOCAL Decode *tcache_pool = NULL;
+static HART_LOCAL int tc_idx = 0;
+static HART_LOCAL int tc_gen = 0;
+static HART_LOCAL int gen_used[TCACHE_GEN_NUM] = {};
+static HART_LOCAL Decode *tcache_bb_pool = NULL;
+static HART_LOCAL int tcache_bb_idx = 0;
+static HART_LOCAL Decode *tcache_bb_freelist = NULL;
+static HART_LOCAL bb_t *bb_freelist = NULL;
+static HART_LOCAL bb_t *bb_list[CONFIG_BB_LIST_SIZE] = {};
+// the source of the edge to the target of an exception or a lookup
+static HART_LOCAL Decode ex = {};
 static const void *g_exec_nemu_decode;
+IFDEF(CONFIG_TCACHE_SUPERBLOCK, static const void *g_exec_nemu_redirect);
+
+static HART_LOCAL uint64_t tcache_flush_cnt = 0;
+static HART_LOCAL uint64_t tcache_evict_cnt = 0;
+static HART_LOCAL uint64_t tcache_evict_bb_cnt = 0;
+static HART_LOCAL uint64_t tcache_unlink_cnt = 0;
+static HART_LOCAL uint64_t tcache_inv_cnt = 0;
+static HART_LOCAL uint64_t tcache_inv_bb_cnt = 0;
+IFDEF(CONFIG_TCACHE_SUPERBLOCK, static HART_LOCAL uint64_t tcache_sb_cnt = 0);
+IFDEF(CONFIG_TCACHE_SUPERBLOCK, static HART_LOCAL uint64_t tcache_sb_link_cnt = 0);
+IFDEF(CONFIG_TCACHE_BB_COUNTER, void bb_counter_drain());
+
+// A filter of the virtual pages which basic blocks start or end on.
+// It is rebuilt on each invalidation scan, and lets a fence for
+// a single data page skip the scan.
+#define VPAGE_FILTER_SIZE 4096
+static HART_LOCAL uint64_t vpage_filter[VPAGE_FILTER_SIZE / 64] = {};
+// some basic blocks are not tracked by the code page map,
+// so fence.i has to flush the whole tcache
+static HART_LOCAL bool code_untracked = false;
+
+static void* tcache_arena_alloc(size_t size) {
+  // only reserve the address space, pages are populated on first touch
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    assert(0);
+  }
+  return p;
+}
 
 static inline Decode* tcache_entry_init(Decode *s, vaddr_t pc) {
   s->tnext = s->ntnext = NULL;
   s->type = 0;
+  IFDEF(CONFIG_TCACHE_SUPERBLOCK, s->sb = 0);
   s->pc = pc;
   s->EHelper = g_exec_nemu_decode;
   return s;
 }
 
 static inline Decode* tcache_new(vaddr_t pc) {
-  if (tc_idx == CONFIG_TCACHE_SIZE) return NULL;
-  assert(tc_idx < CONFIG_TCACHE_SIZE);
+  // a basic block never crosses the boundary of a generation
+  if (tc_idx == (tc_gen + 1) * TCACHE_GEN_SIZE) return NULL;
+  assert(tc_idx < TCACHE_TOTAL_SIZE);
   Decode *s = &tcache_pool[tc_idx];
   tc_idx ++;
+  gen_used[tc_gen] ++;
   return tcache_entry_init(s, pc);
 }
 
 #ifdef CONFIG_RT_CHECK
 #define tcache_bb_check(s) do { \
   int idx = s - tcache_bb_pool; \
-  Assert(idx >= 0 && idx < TCACHE_BB_SIZE, "idx = %d, s = %p", idx, s); \
+  Assert(idx >= 0 && idx < tcache_bb_idx, "idx = %d, s = %p", idx, s); \
 } while (0)
 #else
 #define tcache_bb_check(s)
@@ -64,72 +123,126 @@ static inline Decode* tcache_new(vaddr_t pc) {
 
 static inline Decode* tcache_bb_new(vaddr_t pc) {
   Decode *s = tcache_bb_freelist;
-  assert(s != NULL);
-  tcache_bb_check(s);
-  tcache_bb_check(tcache_bb_freelist->tnext);
-  tcache_bb_freelist = tcache_bb_freelist->tnext;
-  tcache_bb_check(tcache_bb_freelist);
-  tcache_bb_check(tcache_bb_freelist->tnext);
+  if (s != NULL) {
+    tcache_bb_check(s);
+    tcache_bb_freelist = tcache_bb_freelist->list_next;
+  } else {
+    Assert(tcache_bb_idx < TCACHE_BB_SIZE, "tcache bb pool is exhausted");
+    s = &tcache_bb_pool[tcache_bb_idx ++];
+  }
   return tcache_entry_init(s, pc);
 }
 
 static inline void tcache_bb_free(Decode *s) {
   tcache_bb_check(s);
-  tcache_bb_check(tcache_bb_freelist);
-  s->tnext = tcache_bb_freelist;
+  s->type = 0; // not a live record any more
+  s->list_next = tcache_bb_freelist;
   tcache_bb_freelist = s;
-  tcache_bb_check(tcache_bb_freelist->tnext);
 }
 
-
-static inline bb_t* bb_new(Decode *s, vaddr_t pc, bb_t *next) {
-  if (bb_idx == CONFIG_BB_POOL_SIZE) return NULL;
-  assert(bb_idx < CONFIG_BB_POOL_SIZE);
-  bb_t *bb = &bb_pool[bb_idx ++];
-  bb->s = s;
-  bb->pc = pc;
-  bb->next = next;
+static inline bb_t* bb_new() {
+  if (bb_freelist == NULL) {
+    // grow the metadata pool by another batch
+    bb_t *batch = malloc(sizeof(bb_t) * CONFIG_BB_POOL_SIZE);
+    assert(batch != NULL);
+    int i;
+    for (i = 0; i < CONFIG_BB_POOL_SIZE; i ++) {
+      batch[i].next = bb_freelist;
+      bb_freelist = &batch[i];
+    }
+  }
+  bb_t *bb = bb_freelist;
+  bb_freelist = bb->next;
   return bb;
 }
 
-static inline bb_t* bb_hash(vaddr_t pc) {
+static inline void bb_free(bb_t *bb) {
+  bb->next = bb_freelist;
+  bb_freelist = bb;
+}
+
+static inline bb_t** bb_hash(vaddr_t pc) {
   int idx = (pc / CONFIG_ILEN_MIN) % CONFIG_BB_LIST_SIZE;
   return &bb_list[idx];
 }
 
-static struct bb_t* bb_insert(vaddr_t pc, Decode *fill) {
-  bb_t *head = bb_hash(pc);
-  if (head->next == (void *)-1ul) {
-    if (head->pc == (vaddr_t)-1ul) {
-      // first time
-      head->s = fill;
-      head->pc = pc;
-      return head;
-    }
+static inline void vpage_filter_set(vaddr_t vaddr) {
+  int idx = (vaddr >> PAGE_SHIFT) % VPAGE_FILTER_SIZE;
+  vpage_filter[idx / 64] |= 1ull << (idx % 64);
+}
+
+static inline void vpage_filter_set_range(vaddr_t start, vaddr_t end) {
+  vaddr_t vaddr;
+  for (vaddr = start & ~PAGE_MASK; vaddr <= end; vaddr += PAGE_SIZE) {
+    vpage_filter_set(vaddr);
   }
-  // second time
-  bb_t *bb = bb_new(head->s, head->pc, head->next);
-  if (bb == NULL) return NULL;
-  head->s = fill;
-  head->pc = pc;
-  head->next = bb;
-  return head;
+}
+
+static inline bool vpage_filter_test(vaddr_t vaddr) {
+  int idx = (vaddr >> PAGE_SHIFT) % VPAGE_FILTER_SIZE;
+  return (vpage_filter[idx / 64] >> (idx % 64)) & 1;
+}
+
+static paddr_t code_page_track(vaddr_t vaddr) {
+// the code page map is shared by all harts, but each of them has its own
+// tcache, so fence.i on a hart can not clean the dirty pages for the others
+#if defined(CONFIG_MODE_SYSTEM) && !defined(CONFIG_SMP)
+  paddr_t paddr = (isa_mmu_check(vaddr, 1, MEM_TYPE_IFETCH) == MMU_DIRECT ?
+      vaddr : hosttlb_ifetch_paddr(vaddr));
+  if (!pmem_code_page_mark(paddr)) code_untracked = true;
+  return paddr;
+#else
+  code_untracked = true;
+  return vaddr;
+#endif
+}
+
+static void bb_insert(Decode *fill, Decode *end) {
+  vaddr_t pc = fill->pc;
+  bb_t **head = bb_hash(pc);
+  bb_t *bb = bb_new();
+  bb->s = fill;
+  bb->pc = pc;
+  bb->end_pc = end->snpc - 1 + MUXDEF(__ISA_mips32__, 4, 0);
+  bb->ctx = isa_ifetch_ctx();
+  bb->paddr = code_page_track(pc);
+  vaddr_t npage = (bb->end_pc >> PAGE_SHIFT) - (pc >> PAGE_SHIFT);
+  if (npage == 0) {
+    bb->end_paddr = bb->paddr + (bb->end_pc - pc);
+  } else {
+    bb->end_paddr = code_page_track(bb->end_pc);
+    // only the first and the last page are tracked
+    if (npage > 1) code_untracked = true;
+  }
+  vpage_filter_set_range(pc, bb->end_pc);
+  bb->next = *head;
+  *head = bb;
 }
 
 static bb_t* bb_find(vaddr_t pc) {
-  bb_t *bb = bb_hash(pc);
-  if (likely(bb->pc == pc)) return bb;
-  bb_t *head = bb;
-  do {
-    bb = bb->next;
-    if (bb == (void *)-1ul) return NULL;
-    if (bb->pc == pc) {
-      Decode *tmp_s = bb->s; vaddr_t tmp_pc = bb->pc;
-      bb->s = head->s; bb->pc = head->pc;
-      head->s = tmp_s; head->pc = tmp_pc;
-      return head;
+  bb_t **head = bb_hash(pc);
+  bb_t *bb = *head;
+  if (bb == NULL) return NULL;
+  uint32_t ctx = isa_ifetch_ctx();
+  if (likely(bb->pc == pc && bb->ctx == ctx)) return bb;
+  bb_t *prev = bb;
+  for (bb = bb->next; bb != NULL; prev = bb, bb = bb->next) {
+    if (bb->pc == pc && bb->ctx == ctx) {
+      // move to the front of the list
+      prev->next = bb->next;
+      bb->next = *head;
+      *head = bb;
+      return bb;
     }
-  } while (1);
+  }
+  return NULL;
+}
+
+static void tcache_bb_record(Decode *_this, int is_taken, vaddr_t jpc) {
+  Decode *ret = tcache_bb_new(jpc);
+  if (is_taken) { ret->type = BB_RECORD_TYPE_TAKEN; _this->tnext = ret; }
+  else { ret->type = BB_RECORD_TYPE_NTAKEN; _this->ntnext = ret; }
+  ret->bb_src = _this;
 }
 
 static void tcache_bb_fetch(Decode *_this, int is_taken, vaddr_t jpc) {
@@ -138,29 +251,203 @@ static void tcache_bb_fetch(Decode *_this, int is_taken, vaddr_t jpc) {
     if (is_taken) { _this->tnext = bb->s; }
     else { _this->ntnext = bb->s; }
   } else {
-    Decode *ret = tcache_bb_new(jpc);
-    if (is_taken) { ret->type = BB_RECORD_TYPE_TAKEN; _this->tnext = ret; }
-    else { ret->type = BB_RECORD_TYPE_NTAKEN; _this->ntnext = ret; }
-    ret->bb_src = _this;
+    tcache_bb_record(_this, is_taken, jpc);
+  }
+}
+
+static inline bool is_record(Decode *s) {
+  return s >= tcache_bb_pool && s < tcache_bb_pool + TCACHE_BB_SIZE;
+}
+
+static inline bool in_gen(Decode *s, int gen) {
+  Decode *base = &tcache_pool[gen * TCACHE_GEN_SIZE];
+  return s >= base && s < base + TCACHE_GEN_SIZE;
+}
+
+// Whether the edge target `s` is dropped. For gen >= 0, it is the generation
+// being evicted. Otherwise the heads of the invalidated basic blocks are
+// dropped, which are marked by resetting their EHelper.
+static inline bool is_dropped(Decode *s, int gen) {
+  if (gen >= 0) return in_gen(s, gen);
+  return !is_record(s) && s->EHelper == g_exec_nemu_decode;
+}
+
+// Redirect the edges from surviving basic blocks to the dropped ones. The
+// edges are pointed to new records instead of looking up the targets, since
+// the source basic block may belong to another context.
+static void tcache_unlink(int gen) {
+  int g, i;
+  for (g = 0; g < TCACHE_GEN_NUM; g ++) {
+    if (g == gen) continue;
+    Decode *base = &tcache_pool[g * TCACHE_GEN_SIZE];
+    for (i = 0; i < gen_used[g]; i ++) {
+      Decode *s = &base[i];
+      switch (s->type) {
+        case INSTR_TYPE_J:
+        case INSTR_TYPE_B:
+          if (is_dropped(s->tnext, gen)) {
+            tcache_bb_record(s, true, s->tnext->pc);
+            tcache_unlink_cnt ++;
+          }
+          if (s->type == INSTR_TYPE_B && is_dropped(s->ntnext, gen)) {
+            tcache_bb_record(s, false, s->ntnext->pc);
+            tcache_unlink_cnt ++;
+          }
+          break;
+        case INSTR_TYPE_I:
+          if (is_dropped(s->tnext, gen))  { s->tnext = s;  tcache_unlink_cnt ++; }
+          if (is_dropped(s->ntnext, gen)) { s->ntnext = s; tcache_unlink_cnt ++; }
+          break;
+      }
+    }
+  }
+}
+
+static void tcache_evict_gen(int gen) {
+  int i;
+  IFDEF(CONFIG_TCACHE_BB_COUNTER, bb_counter_drain());
+  // drop the metadata of basic blocks in this generation,
+  // so that they will be decoded again the next time they are reached
+  for (i = 0; i < CONFIG_BB_LIST_SIZE; i ++) {
+    bb_t **p = &bb_list[i];
+    while (*p != NULL) {
+      bb_t *bb = *p;
+      if (in_gen(bb->s, gen)) {
+        *p = bb->next;
+        bb_free(bb);
+        tcache_evict_bb_cnt ++;
+      } else {
+        p = &bb->next;
+      }
+    }
+  }
+
+  tcache_unlink(gen);
+
+  // release the records whose source basic block is evicted
+  for (i = 0; i < tcache_bb_idx; i ++) {
+    Decode *r = &tcache_bb_pool[i];
+    if ((r->type == BB_RECORD_TYPE_TAKEN || r->type == BB_RECORD_TYPE_NTAKEN) &&
+        in_gen(r->bb_src, gen)) {
+      tcache_bb_free(r);
+    }
+  }
+
+  gen_used[gen] = 0;
+  IFDEF(CONFIG_ENGINE_JIT, jit_flush(gen));
+  tcache_evict_cnt ++;
+}
+
+static void tcache_next_gen() {
+  tc_gen = (tc_gen + 1) % TCACHE_GEN_NUM;
+  if (gen_used[tc_gen] != 0) {
+    tcache_evict_gen(tc_gen);
   }
+  tc_idx = tc_gen * TCACHE_GEN_SIZE;
+}
+
+// Drop the basic blocks selected by `match`. Their instructions stay in the
+// generation until it is evicted, but they are not reachable any more.
+static void tcache_drop_bb(bool (*match)(bb_t *, const void *), const void *arg) {
+  int i, n = 0;
+  memset(vpage_filter, 0, sizeof(vpage_filter));
+  for (i = 0; i < CONFIG_BB_LIST_SIZE; i ++) {
+    bb_t **p = &bb_list[i];
+    while (*p != NULL) {
+      bb_t *bb = *p;
+      if (match(bb, arg)) {
+        *p = bb->next;
+        bb->s->EHelper = g_exec_nemu_decode;
+        bb_free(bb);
+        n ++;
+      } else {
+        vpage_filter_set_range(bb->pc, bb->end_pc);
+        p = &bb->next;
+      }
+    }
+  }
+  if (n > 0) tcache_unlink(-1);
+  tcache_inv_bb_cnt += n;
+  tcache_inv_cnt ++;
+}
+
+typedef struct {
+  vaddr_t vaddr;
+  uint32_t ctx, ctx_mask;
+} vaddr_match_t;
+
+static bool bb_match_vaddr(bb_t *bb, const void *arg) {
+  const vaddr_match_t *m = arg;
+  if ((bb->ctx & m->ctx_mask) != m->ctx) return false;
+  if (m->vaddr == 0) return true;
+  vaddr_t vpn = m->vaddr >> PAGE_SHIFT;
+  return vpn >= (bb->pc >> PAGE_SHIFT) && vpn <= (bb->end_pc >> PAGE_SHIFT);
+}
+
+void tcache_invalidate_vaddr(vaddr_t vaddr, uint32_t ctx, uint32_t ctx_mask) {
+  // fences for pages without decoded instructions are common, e.g. on page faults
+  if (vaddr != 0 && !vpage_filter_test(vaddr)) return;
+  vaddr_match_t m = { .vaddr = vaddr, .ctx = ctx & ctx_mask, .ctx_mask = ctx_mask };
+  tcache_drop_bb(bb_match_vaddr, &m);
+}
+
+#ifdef CONFIG_MODE_SYSTEM
+static bool bb_match_dirty(bb_t *bb, const void *arg) {
+  return pmem_code_page_is_dirty(bb->paddr) || pmem_code_page_is_dirty(bb->end_paddr);
+}
+#endif
+
+void tcache_invalidate_code() {
+  if (code_untracked) {
+    set_sys_state_flag(SYS_STATE_FLUSH_TCACHE);
+    return;
+  }
+#ifdef CONFIG_MODE_SYSTEM
+  if (pmem_code_page_nr_dirty() == 0) return;
+  tcache_drop_bb(bb_match_dirty, NULL);
+  pmem_code_page_clean();
+#endif
 }
 
 void tcache_flush() {
+  IFDEF(CONFIG_TCACHE_BB_COUNTER, bb_counter_drain());
   tc_idx = 0;
-  bb_idx = 0;
-  memset(bb_list, -1, sizeof(bb_list));
+  tc_gen = 0;
+  memset(gen_used, 0, sizeof(gen_used));
 
   int i;
-  for (i = 0; i < TCACHE_BB_SIZE - 1; i ++) {
-    tcache_bb_pool[i].list_next = &tcache_bb_pool[i + 1];
+  for (i = 0; i < CONFIG_BB_LIST_SIZE; i ++) {
+    while (bb_list[i] != NULL) {
+      bb_t *bb = bb_list[i];
+      bb_list[i] = bb->next;
+      bb_free(bb);
+    }
   }
-  tcache_bb_pool[TCACHE_BB_SIZE - 1].list_next = NULL;
-  tcache_bb_freelist = &tcache_bb_pool[0];
+
+  tcache_bb_idx = 0;
+  tcache_bb_freelist = NULL;
+  ex.tnext = NULL;
+
+  memset(vpage_filter, 0, sizeof(vpage_filter));
+  code_untracked = false;
+  IFDEF(CONFIG_MODE_SYSTEM, pmem_code_page_reset());
+  IFDEF(CONFIG_ENGINE_JIT, jit_flush(-1));
+}
+
+void tcache_statistic() {
+  Log("tcache: %d generations of %d entries, %'ld flushes, %'ld evictions "
+      "(%'ld basic blocks evicted, %'ld edges unlinked)",
+      TCACHE_GEN_NUM, TCACHE_GEN_SIZE, tcache_flush_cnt, tcache_evict_cnt,
+      tcache_evict_bb_cnt, tcache_unlink_cnt);
+  Log("tcache: %'ld selective invalidations (%'ld basic blocks invalidated)",
+      tcache_inv_cnt, tcache_inv_bb_cnt);
+  IFDEF(CONFIG_TCACHE_SUPERBLOCK, Log("tcache: %'ld superblocks formed, "
+      "%'ld hot edges linked in place", tcache_sb_cnt, tcache_sb_link_cnt));
 }
 
 enum { TCACHE_BB_BUILDING, TCACHE_RUNNING };
-static int tcache_state = TCACHE_RUNNING;
-static Decode *bb_now = NULL, *bb_now_record = NULL;
+static HART_LOCAL int tcache_state = TCACHE_RUNNING;
+static HART_LOCAL Decode *bb_now = NULL, *bb_now_record = NULL;
 
 __attribute__((noinline))
 Decode* tcache_jr_fetch(Decode *s, vaddr_t jpc) {
@@ -170,6 +457,8 @@ Decode* tcache_jr_fetch(Decode *s, vaddr_t jpc) {
 }
 
 static inline void tcache_patch_and_free(Decode *bb_record, Decode *bb) {
+  // an invalidated basic block is decoded again, but it is not a record
+  if (!is_record(bb_record)) return;
   Decode *src = bb_record->bb_src;
   if (bb_record->type == BB_RECORD_TYPE_TAKEN)  { src->tnext = bb; }
   if (bb_record->type == BB_RECORD_TYPE_NTAKEN) { src->ntnext = bb; }
@@ -178,7 +467,7 @@ static inline void tcache_patch_and_free(Decode *bb_record, Decode *bb) {
 
 __attribute__((noinline))
 Decode* tcache_decode(Decode *s) {
-  static int idx_in_bb = 0;
+  static HART_LOCAL int idx_in_bb = 0;
   vaddr_t thispc = s->pc;
 
   if (tcache_state == TCACHE_RUNNING) {  // start of a basic block
@@ -209,8 +498,8 @@ Decode* tcache_decode(Decode *s) {
     assert(next == s + 1);
   } else {
     // the end of the basic block
-    bb_t *ret = bb_insert(bb_now->pc, bb_now);
-    if (ret == NULL) { goto full; } // basic block list is full
+    bb_insert(bb_now, s);
+    IFDEF(CONFIG_ENGINE_JIT, jit_translate(bb_now, s, tc_gen));
     tcache_patch_and_free(bb_now_record, bb_now);
     bb_now = bb_now_record = NULL;
 
@@ -230,7 +519,8 @@ Decode* tcache_decode(Decode *s) {
   return s;
 
 full:
-  tcache_flush();
+  // the current generation is full, move on to the next one
+  tcache_next_gen();
   s = tcache_bb_new(thispc); // decode this instruction again
   s->idx_in_bb = idx_in_bb;
   save_globals(s);
@@ -239,23 +529,172 @@ full:
   longjmp_exec(NEMU_EXEC_AGAIN);
 }
 
-static Decode ex = {};
+#ifdef CONFIG_TCACHE_SUPERBLOCK
+// Superblocks
+//
+// A superblock is a run of basic blocks placed contiguously in the tcache,
+// where the end of each basic block but the last one is marked SB_INNER,
+// and its hot successor is the entry right behind it. The execution engine
+// stays in the superblock along the hot path, and only goes through the
+// per basic block actions at the side exits and the last exit.
+
+static inline bool sb_is_inner(Decode *e) {
+  return (e->type == INSTR_TYPE_J || e->type == INSTR_TYPE_B) && e->sb == SB_INNER &&
+    (e->tnext == e + 1 || (e->type == INSTR_TYPE_B && e->ntnext == e + 1));
+}
+
+// only look back within the generation of `end`
+static Decode* sb_run_head(Decode *end) {
+  Decode *base = &tcache_pool[(end - tcache_pool) / TCACHE_GEN_SIZE * TCACHE_GEN_SIZE];
+  Decode *h = end - (end->idx_in_bb - 1);
+  while (h > base && sb_is_inner(h - 1) && (h - 1) - ((h - 1)->idx_in_bb - 1) >= base) {
+    h = (h - 1) - ((h - 1)->idx_in_bb - 1);
+  }
+  return h;
+}
+
+// return NULL if the run is too long or can not be copied
+static Decode* sb_run_end(Decode *h, int max) {
+  Decode *e;
+  for (e = h; e < h + max; e ++) {
+    if (e->EHelper == g_exec_nemu_redirect || e->EHelper == g_exec_nemu_decode) return NULL;
+    if (e->type == INSTR_TYPE_N || sb_is_inner(e)) continue;
+    return e;
+  }
+  return NULL;
+}
+
+static inline void sb_reloc_operand(Operand *op, Decode *o, Decode *c) {
+  uint8_t *p = (uint8_t *)op->preg;
+  if (p >= (uint8_t *)o && p < (uint8_t *)(o + 1)) {
+    op->preg = (rtlreg_t *)((uint8_t *)c + (p - (uint8_t *)o));
+  }
+}
+
+static inline void sb_copy_edge(Decode *c, Decode *o, bool is_taken, Decode *end, Decode *next, Decode *next_copy) {
+  Decode *t = (is_taken ? o->tnext : o->ntnext);
+  Decode *ct;
+  if (o == end && t == next) { ct = next_copy; }
+  else if (sb_is_inner(o) && t == o + 1) { ct = c + 1; }
+  else if (is_record(t)) { tcache_bb_record(c, is_taken, t->pc); return; }
+  else { ct = t; }
+  if (is_taken) { c->tnext = ct; }
+  else { c->ntnext = ct; }
+}
+
+// copy the entries [h, e] to c
+static void sb_copy(Decode *c, Decode *h, Decode *e, Decode *end, Decode *next, Decode *next_copy) {
+  Decode *o;
+  for (o = h; o <= e; o ++, c ++) {
+    memcpy(c, o, sizeof(*c));
+    sb_reloc_operand(&c->dest, o, c);
+    sb_reloc_operand(&c->src1, o, c);
+    sb_reloc_operand(&c->src2, o, c);
+    switch (o->type) {
+      case INSTR_TYPE_J: sb_copy_edge(c, o, true, end, next, next_copy); break;
+      case INSTR_TYPE_B:
+        sb_copy_edge(c, o, true, end, next, next_copy);
+        sb_copy_edge(c, o, false, end, next, next_copy);
+        break;
+      case INSTR_TYPE_I: c->tnext = c->ntnext = c; break;
+    }
+  }
+}
+
+// Called when the jump or branch at the end of a basic block becomes hot.
+// `next` is its successor this time, which is also returned as the next
+// entry to execute.
+__attribute__((noinline))
+Decode* tcache_sb_form(Decode *end, Decode *next) {
+  end->sb = SB_OFF;
+  // profiling and checkpointing need every basic block boundary
+  if (profiling_state != NoProfiling || checkpoint_state != NoCheckpoint) return next;
+  if (is_record(next)) { end->sb = 0; return next; } // not decoded yet, try again later
+  if (next->EHelper == g_exec_nemu_redirect && !is_record(next->tnext)) {
+    // skip the old head of a superblock
+    if (end->tnext == next) end->tnext = next->tnext;
+    if (end->type == INSTR_TYPE_B && end->ntnext == next) end->ntnext = next->tnext;
+    next = next->tnext;
+  }
+  if (next->EHelper == g_exec_nemu_decode) return next;
+  if (next == end + 1) {
+    // already placed right behind, no need to copy
+    end->sb = SB_INNER;
+    tcache_sb_link_cnt ++;
+    return next;
+  }
+
+  Decode *h = sb_run_head(end);
+  Decode *e = sb_run_end(next, CONFIG_TCACHE_SB_MAX_SIZE);
+  if (e == NULL) return next;
+  int size1 = end - h + 1, size2 = e - next + 1;
+  if (size1 + size2 > CONFIG_TCACHE_SB_MAX_SIZE) return next;
+  bb_t *bb = bb_find(h->pc);
+  bb_t *bb2 = bb_find(next->pc);
+  if (bb == NULL || bb->s != h || bb2 == NULL || bb2->s != next) return next;
+  // only superblocks within a single page are formed, so that
+  // the basic block metadata still covers all of its instructions
+  vaddr_t vpn = bb->pc >> PAGE_SHIFT;
+  if ((bb->end_pc >> PAGE_SHIFT) != vpn || (bb2->pc >> PAGE_SHIFT) != vpn ||
+      (bb2->end_pc >> PAGE_SHIFT) != vpn) return next;
+  if (tc_idx + size1 + size2 > (tc_gen + 1) * TCACHE_GEN_SIZE) {
+    end->sb = 0; // try again in the next generation
+    return next;
+  }
+
+  assert(tcache_state == TCACHE_RUNNING);
+  Decode *sb = &tcache_pool[tc_idx];
+  tc_idx += size1 + size2;
+  gen_used[tc_gen] += size1 + size2;
+  sb_copy(sb, h, end, end, next, sb + size1);
+  sb_copy(sb + size1, next, e, NULL, NULL, NULL);
+  sb[size1 - 1].sb = SB_INNER;
+  sb[size1 + size2 - 1].sb = 0;
+  // the host code of the copied runs goes with the superblock
+  IFDEF(CONFIG_ENGINE_JIT, jit_translate(sb, sb + size1 + size2 - 1, tc_gen));
+
+  if (bb2->end_pc > bb->end_pc) {
+    bb->end_paddr += bb2->end_pc - bb->end_pc;
+    bb->end_pc = bb2->end_pc;
+  }
+  bb->s = sb;
+  // redirect the edges to the old head
+  h->EHelper = g_exec_nemu_redirect;
+  h->type = INSTR_TYPE_J;
+  h->tnext = sb;
+  h->sb = SB_OFF;
+  tcache_sb_cnt ++;
+  return next;
+}
+#endif // CONFIG_TCACHE_SUPERBLOCK
 
 void tcache_handle_exception(vaddr_t jpc) {
+  // the record of the previous target is left behind when decoding it
+  // faulted, and nothing else points to it
+  if (is_record(ex.tnext) && ex.tnext->bb_src == &ex) tcache_bb_free(ex.tnext);
   tcache_bb_fetch(&ex, true, jpc);
   save_globals(ex.tnext);
   tcache_state = TCACHE_RUNNING;
 }
 
+Decode* tcache_handle_lookup(vaddr_t pc) {
+  tcache_handle_exception(pc);
+  return ex.tnext;
+}
+
 Decode* tcache_handle_flush(vaddr_t snpc) {
   tcache_flush();
-  tcache_handle_exception(snpc);
-  return ex.tnext;
+  tcache_flush_cnt ++;
+  return tcache_handle_lookup(snpc);
 }
 
-Decode* tcache_init(const void *exec_nemu_decode, vaddr_t reset_vector) {
+Decode* tcache_init(const void *exec_nemu_decode, const void *exec_nemu_redirect,
+    vaddr_t reset_vector) {
+  tcache_pool = tcache_arena_alloc(sizeof(Decode) * TCACHE_TOTAL_SIZE);
+  tcache_bb_pool = tcache_arena_alloc(sizeof(Decode) * TCACHE_BB_SIZE);
   tcache_flush();
   g_exec_nemu_decode = exec_nemu_decode;
+  IFDEF(CONFIG_TCACHE_SUPERBLOCK, g_exec_nemu_redirect = exec_nemu_redirect);
   return tcache_bb_new(reset_vector);
 }
 #endif
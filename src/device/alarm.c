@@ -36,7 +36,109 @@ static void alarm_sig_handler(int signum) {
   }
 }
 
+#ifdef CONFIG_VIRTUAL_TIME
+#define MAX_EVENT 8
+#define ALARM_PERIOD (CONFIG_VIRTUAL_TIME_INSTRS_PER_US * 1000000ul / TIMER_HZ)
+
+typedef struct {
+  event_handler_t handler;
+  uint64_t deadline;
+} Event;
+
+static Event event[MAX_EVENT] = {};
+static int nr_event = 0;
+static uint64_t next_deadline = UINT64_MAX;
+static uint64_t vtime_offset = 0;
+static int alarm_event = -1;
+static uint64_t nr_idle = 0;
+static uint64_t nr_idle_instr = 0;
+
+int add_event(event_handler_t h) {
+  assert(nr_event < MAX_EVENT);
+  event[nr_event].handler = h;
+  event[nr_event].deadline = UINT64_MAX;
+  return nr_event ++;
+}
+
+static void update_next_deadline() {
+  int i;
+  next_deadline = UINT64_MAX;
+  for (i = 0; i < nr_event; i ++) {
+    if (event[i].deadline < next_deadline) next_deadline = event[i].deadline;
+  }
+}
+
+void schedule_event(int id, uint64_t deadline) {
+  assert(id >= 0 && id < nr_event);
+  event[id].deadline = deadline;
+  update_next_deadline();
+}
+
+uint64_t vtime_now() {
+#ifdef CONFIG_PERF_OPT
+  uint64_t get_abs_instr_count();
+  return get_abs_instr_count() + vtime_offset;
+#else
+  extern HART_LOCAL uint64_t g_nr_guest_instr;
+  return g_nr_guest_instr + vtime_offset;
+#endif
+}
+
+uint64_t vtime_us() {
+  return vtime_now() / CONFIG_VIRTUAL_TIME_INSTRS_PER_US;
+}
+
+void vtime_instr_cnt_reset(uint64_t old_cnt, uint64_t new_cnt) {
+  vtime_offset += old_cnt - new_cnt;
+}
+
+void vtime_run_events() {
+  uint64_t now = vtime_now();
+  if (next_deadline > now) return;
+  // events due at the same time are called in the order they are added,
+  // events scheduled by the handlers to now are called before the next batch
+  int i;
+  for (i = 0; i < nr_event; i ++) {
+    if (event[i].deadline <= now) {
+      schedule_event(i, UINT64_MAX);
+      event[i].handler();
+    }
+  }
+}
+
+uint64_t vtime_idle() {
+  uint64_t now = vtime_now();
+  if (next_deadline == UINT64_MAX || next_deadline <= now) return 0;
+  uint64_t skipped = next_deadline - now;
+  vtime_offset += skipped;
+  nr_idle ++;
+  nr_idle_instr += skipped;
+  return skipped;
+}
+
+void vtime_statistic() {
+  Log("virtual time skipped by idle harts = %'ld instructions (%'ld us) in %'ld idles",
+      nr_idle_instr, nr_idle_instr / CONFIG_VIRTUAL_TIME_INSTRS_PER_US, nr_idle);
+}
+
+int vtime_batch_size(int n) {
+  uint64_t now = vtime_now();
+  if (next_deadline <= now) return 1;
+  return next_deadline - now < (uint64_t)n ? next_deadline - now : n;
+}
+
+// the alarm handlers are called periodically in virtual time
+static void alarm_event_handler() {
+  alarm_sig_handler(SIGVTALRM);
+  schedule_event(alarm_event, vtime_now() + ALARM_PERIOD);
+}
+#endif
+
 void init_alarm() {
+#ifdef CONFIG_VIRTUAL_TIME
+  alarm_event = add_event(alarm_event_handler);
+  schedule_event(alarm_event, vtime_now() + ALARM_PERIOD);
+#else
   struct sigaction s;
   memset(&s, 0, sizeof(s));
   s.sa_handler = alarm_sig_handler;
@@ -49,4 +151,5 @@ void init_alarm() {
   it.it_interval = it.it_value;
   ret = setitimer(ITIMER_VIRTUAL, &it, NULL);
   Assert(ret == 0, "Can not set timer");
+#endif
 }
@@ -16,6 +16,7 @@
 
 #include <common.h>
 #include <utils.h>
+#include <cpu/smp.h>
 #ifndef CONFIG_SHARE
 #include <device/alarm.h>
 #include <SDL2/SDL.h>
@@ -51,6 +52,7 @@ void device_update() {
     return;
   }
   device_update_flag = false;
+  smp_io_lock();
   IFDEF(CONFIG_HAS_VGA, vga_update_screen());
 
 #ifndef CONFIG_SHARE
@@ -74,6 +76,7 @@ void device_update() {
     }
   }
 #endif
+  smp_io_unlock();
 }
 
 void sdl_clear_event_queue() {
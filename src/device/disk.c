@@ -17,6 +17,7 @@
 #include <device/map.h>
 #include <memory/paddr.h>
 #include <memory/sparseram.h>
+#include <memory/image_loader.h>
 #include <isa.h>
 
 enum {
@@ -42,8 +43,10 @@ static void disk_io_handler(uint32_t offset, int len, bool is_write) {
     assert(ret == 1);
     sparse_mem_write(get_sparsemm(), disk_base[BUF], disk_base[COUNT] * 512l, buff);
     #else
+    lazy_restore_fill(guest_to_host(disk_base[BUF]), disk_base[COUNT] * 512l);
     int ret = fread(guest_to_host(disk_base[BUF]), disk_base[COUNT] * 512l, 1, fp);
     assert(ret == 1);
+    IFDEF(CONFIG_PERF_OPT, pmem_code_page_write(disk_base[BUF], disk_base[COUNT] * 512l));
     #endif
   }
 #endif
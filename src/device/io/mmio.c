@@ -14,41 +14,81 @@
 ***************************************************************************************/
 
 #include <device/map.h>
+#include <cpu/smp.h>
 
-#define NR_MAP 16
+#define NR_MAP 64
 
+// sorted by the low address, and the maps never overlap
 static IOMap maps[NR_MAP] = {};
 static int nr_map = 0;
 
-static inline IOMap* fetch_mmio_map(paddr_t addr) {
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  return (mapid == -1 ? NULL : &maps[mapid]);
+// the map hit by the last access of each kind, since the accesses
+// to a device usually come in runs, e.g. polling the UART status
+enum { MMIO_PROBE, MMIO_READ, MMIO_WRITE, NR_MMIO_ACCESS };
+static HART_LOCAL IOMap *last_map[NR_MMIO_ACCESS] = {};
+
+static IOMap* search_mmio_map(paddr_t addr) {
+  int l = 0, r = nr_map - 1;
+  while (l <= r) {
+    int mid = (l + r) / 2;
+    if (addr < maps[mid].low) r = mid - 1;
+    else if (addr > maps[mid].high) l = mid + 1;
+    else return &maps[mid];
+  }
+  return NULL;
+}
+
+static inline IOMap* fetch_mmio_map(paddr_t addr, int kind) {
+  IOMap *map = last_map[kind];
+  if (map == NULL || !map_inside(map, addr)) {
+    map = search_mmio_map(addr);
+    if (map == NULL) return NULL;
+    last_map[kind] = map;
+  }
+  difftest_skip_ref();
+  return map;
 }
 
 bool is_in_mmio(paddr_t addr) {
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  return (mapid == -1 ? false : true);
+  return fetch_mmio_map(addr, MMIO_PROBE) != NULL;
 }
 
 /* device interface */
 void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_callback_t callback) {
   assert(nr_map < NR_MAP);
-  maps[nr_map] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
+  IOMap map = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
     .space = space, .callback = callback };
   // Log("Add mmio map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
-  //     maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
+  //     map.name, map.low, map.high);
   // fflush(stdout);
 
+  int i;
+  for (i = nr_map; i > 0 && maps[i - 1].low > map.low; i --) {
+    maps[i] = maps[i - 1];
+  }
+  // now maps[i - 1] and maps[i + 1] are the neighbours of the new map
+  Assert(i == 0 || maps[i - 1].high < map.low,
+      "mmio map '%s' overlaps with '%s'", name, maps[i - 1].name);
+  Assert(i == nr_map || map.high < maps[i + 1].low,
+      "mmio map '%s' overlaps with '%s'", name, maps[i + 1].name);
+  maps[i] = map;
   nr_map ++;
+  // the maps are moved
+  memset(last_map, 0, sizeof(last_map));
 }
 
 /* bus interface */
 __attribute__((noinline))
 word_t mmio_read(paddr_t addr, int len) {
-  return map_read(addr, len, fetch_mmio_map(addr));
+  smp_io_lock();
+  word_t ret = map_read(addr, len, fetch_mmio_map(addr, MMIO_READ));
+  smp_io_unlock();
+  return ret;
 }
 
 __attribute__((noinline))
 void mmio_write(paddr_t addr, int len, word_t data) {
-  map_write(addr, len, data, fetch_mmio_map(addr));
+  smp_io_lock();
+  map_write(addr, len, data, fetch_mmio_map(addr, MMIO_WRITE));
+  smp_io_unlock();
 }
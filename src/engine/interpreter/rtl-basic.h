@@ -188,7 +188,7 @@ extern void simpoint_profiling(uint64_t pc, bool is_control, uint64_t abs_instr_
 #endif // CONFIG_SHARE
 extern uint64_t get_abs_instr_count();
 
-extern uint64_t br_count;
+extern HART_LOCAL uint64_t br_count;
 
 #ifdef CONFIG_BR_LOG
 extern struct br_info br_log[];
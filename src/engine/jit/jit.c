@@ -0,0 +1,272 @@
+/***************************************************************************************
+* Copyright (c) 2014-2021 Zihao Yu, Nanjing University
+* Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#include <isa.h>
+#include <cpu/decode.h>
+#include <sys/mman.h>
+#include "jit.h"
+
+// A run of instructions in a basic block, which are all found in the table
+// given by the ISA, is translated into a host function
+//   Decode *run(Decode *s);
+// It updates the guest registers in memory one instruction after another,
+// exactly as the RTL helpers do, and returns the entry after the run.
+// The remaining instructions are still executed by the interpreter.
+//
+// The code cache is split into one segment per tcache generation. The host
+// code of a run is put into the segment of the generation holding its
+// entries, so that it is released together with them.
+
+#ifndef __x86_64__
+#error "the JIT engine only supports x86-64 hosts"
+#endif
+
+#define JIT_SEG_NUM  CONFIG_TCACHE_GEN_NUM
+#define JIT_SEG_SIZE ((size_t)CONFIG_JIT_CACHE_SIZE * 1024 * 1024 / JIT_SEG_NUM)
+// upper bound of the host code of a single instruction
+#define JIT_INSTR_MAX_SIZE 64
+// the call into host code costs more than interpreting a single instruction
+#define JIT_RUN_MIN 2
+
+#define JIT_HASH_SIZE 256
+
+static uint8_t *code_cache = NULL;
+static size_t seg_used[JIT_SEG_NUM] = {};
+static uint8_t *code_p = NULL; // where the next host instruction is emitted
+static const void *g_exec_nemu_jit;
+static JitInstr jit_hash[JIT_HASH_SIZE] = {};
+
+static uint64_t jit_run_cnt = 0;
+static uint64_t jit_instr_cnt = 0;
+static uint64_t jit_full_cnt = 0;
+
+static inline int jit_hash_idx(const void *EHelper) {
+  return ((uintptr_t)EHelper * 0x9e3779b97f4a7c15ull) >> (64 - 8);
+}
+
+typedef struct {
+  rtlreg_t *d;
+  const rtlreg_t *a, *b;
+  word_t imm;
+  bool use_imm;
+} JitOperand;
+
+static inline bool in_decode(Decode *s, const void *preg) {
+  return (uint8_t *)preg >= (uint8_t *)s && (uint8_t *)preg < (uint8_t *)(s + 1);
+}
+
+// return NULL if `s` can not be translated
+static const JitInstr* jit_lookup(Decode *s, JitOperand *o) {
+  if (s->type != INSTR_TYPE_N) return NULL;
+  const void *EHelper = (s->EHelper == g_exec_nemu_jit ? s->jhelper : s->EHelper);
+  int i = jit_hash_idx(EHelper);
+  while (jit_hash[i].EHelper != EHelper) {
+    if (jit_hash[i].EHelper == NULL) return NULL;
+    i = (i + 1) % JIT_HASH_SIZE;
+  }
+  const JitInstr *ji = &jit_hash[i];
+
+  o->d = id_dest->preg;
+  o->a = o->b = NULL;
+  o->use_imm = true;
+  switch (ji->form) {
+    case JIT_RR: o->a = id_src1->preg; o->b = id_src2->preg; o->use_imm = false; break;
+    case JIT_RI: o->a = id_src1->preg; o->imm = id_src2->imm; break;
+    case JIT_R0: o->a = id_src1->preg; o->imm = 0; break;
+    case JIT_DR: o->a = id_dest->preg; o->b = id_src2->preg; o->use_imm = false; break;
+    case JIT_DI: o->a = id_dest->preg; o->imm = id_src2->imm; break;
+    case JIT_D1: o->a = id_dest->preg; o->imm = 1; break;
+    case JIT_I1: o->imm = id_src1->imm; break;
+    case JIT_I2: o->imm = id_src2->imm; break;
+    case JIT_K0: o->imm = 0; break;
+    case JIT_K1: o->imm = 1; break;
+    default: return NULL;
+  }
+  // registers inside the entry are moved when it is copied
+  if (in_decode(s, o->d) || in_decode(s, o->a) || in_decode(s, o->b)) return NULL;
+  return ji;
+}
+
+// x86-64 encoding
+
+enum { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7 };
+#define REX_W 0x48
+
+static inline void emit8(uint8_t v) { *code_p ++ = v; }
+static inline void emit32(uint32_t v) { memcpy(code_p, &v, 4); code_p += 4; }
+static inline void emit64(uint64_t v) { memcpy(code_p, &v, 8); code_p += 8; }
+
+static inline bool is_simm32(word_t imm) { return (sword_t)imm == (int32_t)imm; }
+
+// Emit `op reg, [m]` or `op [m], reg`. Registers in `cpu` are addressed by
+// rsi, which holds &cpu, and the others by their host address in rdx.
+static void emit_mem(uint8_t rex, uint8_t op0, uint8_t op1, int reg, const rtlreg_t *m) {
+  intptr_t off = (uint8_t *)m - (uint8_t *)&cpu;
+  bool in_cpu = off >= 0 && off + sizeof(*m) <= sizeof(cpu);
+  if (!in_cpu) { emit8(REX_W); emit8(0xb8 + RDX); emit64((uintptr_t)m); }
+  if (rex) emit8(rex);
+  emit8(op0);
+  if (op1) emit8(op1);
+  if (in_cpu) { emit8(0x80 | (reg << 3) | RSI); emit32(off); }
+  else { emit8((reg << 3) | RDX); }
+}
+
+static void emit_li(int reg, word_t imm) {
+  emit8(REX_W);
+  if (is_simm32(imm)) { emit8(0xc7); emit8(0xc0 | reg); emit32(imm); }
+  else { emit8(0xb8 + reg); emit64(imm); }
+}
+
+// `op rax, src2`, where `op_rm` is the opcode with a register or memory
+// source, and `digit` is the opcode extension with an immediate source
+static void emit_alu(uint8_t rex, uint8_t op_rm, int digit, const JitOperand *o) {
+  if (!o->use_imm) { emit_mem(rex, op_rm, 0, RAX, o->b); return; }
+  // 32-bit operations only take the low 32 bits of the immediate
+  if (rex == 0 || is_simm32(o->imm)) {
+    if (rex) emit8(rex);
+    emit8(0x81); emit8(0xc0 | (digit << 3)); emit32(o->imm);
+  } else {
+    emit_li(RCX, o->imm);
+    emit8(rex); emit8(op_rm); emit8(0xc0 | (RAX << 3) | RCX);
+  }
+}
+
+static void jit_emit_instr(const JitInstr *ji, const JitOperand *o) {
+  static const struct { uint8_t op_rm, digit; } alu[] = {
+    [JIT_add] = { 0x03, 0 }, [JIT_sub] = { 0x2b, 5 }, [JIT_and] = { 0x23, 4 },
+    [JIT_or]  = { 0x0b, 1 }, [JIT_xor] = { 0x33, 6 },
+    [JIT_addw] = { 0x03, 0 }, [JIT_subw] = { 0x2b, 5 },
+  };
+  int op = ji->op;
+  bool w = (op == JIT_addw || op == JIT_subw || op == JIT_shlw ||
+      op == JIT_shrw || op == JIT_sarw || op == JIT_mulw);
+  uint8_t rex = (w ? 0 : REX_W);
+  bool nop_imm = o->use_imm && o->imm == 0; // x op 0 == x
+
+  switch (op) {
+    case JIT_li: emit_li(RAX, o->imm); break;
+    case JIT_shl: case JIT_shr: case JIT_sar:
+    case JIT_shlw: case JIT_shrw: case JIT_sarw: {
+      // the shift amount is masked by the host in the same way as c_op.h
+      int digit = (op == JIT_shl || op == JIT_shlw ? 4 : (op == JIT_shr || op == JIT_shrw ? 5 : 7));
+      if (!o->use_imm) emit_mem(REX_W, 0x8b, 0, RCX, o->b);
+      emit_mem(rex, 0x8b, 0, RAX, o->a);
+      if (nop_imm) break;
+      if (rex) emit8(rex);
+      if (o->use_imm) { emit8(0xc1); emit8(0xc0 | (digit << 3)); emit8(o->imm & (w ? 0x1f : 0x3f)); }
+      else { emit8(0xd3); emit8(0xc0 | (digit << 3)); }
+      break;
+    }
+    case JIT_setlt: case JIT_setltu:
+      emit_mem(REX_W, 0x8b, 0, RAX, o->a);
+      emit_alu(REX_W, 0x3b, 7, o); // cmp
+      emit8(0x0f); emit8(op == JIT_setlt ? 0x9c : 0x92); emit8(0xc0); // setl/setb al
+      emit8(0x0f); emit8(0xb6); emit8(0xc0); // movzx eax, al
+      break;
+    case JIT_mulu_lo: case JIT_mulw:
+      emit_mem(rex, 0x8b, 0, RAX, o->a);
+      emit_mem(rex, 0x0f, 0xaf, RAX, o->b); // imul
+      break;
+    default:
+      emit_mem(rex, 0x8b, 0, RAX, o->a);
+      if (nop_imm && op != JIT_and) break;
+      emit_alu(rex, alu[op].op_rm, alu[op].digit, o);
+      break;
+  }
+  if (w) { emit8(REX_W); emit8(0x63); emit8(0xc0); } // movsxd rax, eax
+  emit_mem(REX_W, 0x89, 0, RAX, o->d);
+}
+
+static void jit_untranslate(Decode *s) {
+  s->EHelper = s->jhelper;
+  s->tnext = s->ntnext = NULL;
+}
+
+static void jit_translate_run(Decode *h, int n, int gen) {
+  size_t size = n * JIT_INSTR_MAX_SIZE + 32;
+  if (seg_used[gen] + size > JIT_SEG_SIZE) {
+    jit_full_cnt ++;
+    return;
+  }
+  uint8_t *code = code_cache + gen * JIT_SEG_SIZE + seg_used[gen];
+  code_p = code;
+  emit8(REX_W); emit8(0xb8 + RSI); emit64((uintptr_t)&cpu);
+  int i;
+  for (i = 0; i < n; i ++) {
+    JitOperand o;
+    const JitInstr *ji = jit_lookup(&h[i], &o);
+    assert(ji != NULL);
+    jit_emit_instr(ji, &o);
+  }
+  // lea rax, [rdi + n * sizeof(Decode)]; ret
+  emit8(REX_W); emit8(0x8d); emit8(0x80 | (RAX << 3) | RDI); emit32(n * sizeof(Decode));
+  emit8(0xc3);
+  assert(code_p - code <= size);
+  seg_used[gen] += code_p - code;
+
+  h->jhelper = h->EHelper;
+  h->jcode = code;
+  h->EHelper = g_exec_nemu_jit;
+  jit_run_cnt ++;
+  jit_instr_cnt += n;
+}
+
+void jit_translate(Decode *h, Decode *e, int gen) {
+  if (code_cache == NULL) return;
+  Decode *s, *run = NULL;
+  for (s = h; s <= e; s ++) {
+    if (s->EHelper == g_exec_nemu_jit) jit_untranslate(s);
+    JitOperand o;
+    if (jit_lookup(s, &o) != NULL) {
+      if (run == NULL) run = s;
+      continue;
+    }
+    if (run != NULL && s - run >= JIT_RUN_MIN) jit_translate_run(run, s - run, gen);
+    run = NULL;
+  }
+  if (run != NULL && s - run >= JIT_RUN_MIN) jit_translate_run(run, s - run, gen);
+}
+
+void jit_flush(int gen) {
+  if (gen < 0) memset(seg_used, 0, sizeof(seg_used));
+  else seg_used[gen] = 0;
+}
+
+void jit_init(const void *exec_nemu_jit, const JitInstr *table, int nr_instr) {
+  assert(nr_instr <= JIT_HASH_SIZE / 2);
+  int i;
+  for (i = 0; i < nr_instr; i ++) {
+    int idx = jit_hash_idx(table[i].EHelper);
+    while (jit_hash[idx].EHelper != NULL) idx = (idx + 1) % JIT_HASH_SIZE;
+    jit_hash[idx] = table[i];
+  }
+  g_exec_nemu_jit = exec_nemu_jit;
+
+  code_cache = mmap(NULL, JIT_SEG_SIZE * JIT_SEG_NUM, PROT_READ | PROT_WRITE | PROT_EXEC,
+      MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+  if (code_cache == MAP_FAILED) {
+    perror("mmap");
+    assert(0);
+  }
+  jit_flush(-1);
+}
+
+void jit_statistic() {
+  Log("jit: %'ld runs of %'ld instructions translated, "
+      "%'ld runs not translated due to a full code cache segment",
+      jit_run_cnt, jit_instr_cnt, jit_full_cnt);
+}
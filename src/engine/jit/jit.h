@@ -0,0 +1,54 @@
+/***************************************************************************************
+* Copyright (c) 2014-2021 Zihao Yu, Nanjing University
+* Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <cpu/decode.h>
+
+// RTL operations translated into host code, named after the c_op.h macros
+enum {
+  JIT_add, JIT_sub, JIT_and, JIT_or, JIT_xor, JIT_shl, JIT_shr, JIT_sar,
+  JIT_addw, JIT_subw, JIT_shlw, JIT_shrw, JIT_sarw,
+  JIT_setlt, JIT_setltu, JIT_mulu_lo, JIT_mulw, JIT_li,
+};
+
+// operand forms, i.e. where the EHelper takes its operands from
+enum {
+  JIT_RR, // ddest = dsrc1 op dsrc2
+  JIT_RI, // ddest = dsrc1 op id_src2->imm
+  JIT_R0, // ddest = dsrc1 op 0
+  JIT_DR, // ddest = ddest op dsrc2
+  JIT_DI, // ddest = ddest op id_src2->imm
+  JIT_D1, // ddest = ddest op 1
+  JIT_I1, // ddest = id_src1->imm
+  JIT_I2, // ddest = id_src2->imm
+  JIT_K0, // ddest = 0
+  JIT_K1, // ddest = 1
+};
+
+typedef struct {
+  const void *EHelper;
+  uint8_t op, form;
+} JitInstr;
+
+void jit_init(const void *exec_nemu_jit, const JitInstr *table, int nr_instr);
+void jit_translate(Decode *h, Decode *e, int gen);
+void jit_flush(int gen);
+void jit_statistic();
+
+#endif
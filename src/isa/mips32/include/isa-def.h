@@ -98,5 +98,7 @@ typedef struct {
 #else
 #define isa_mmu_check(vaddr, len, type) ((vaddr & 0x80000000u) == 0 ? MMU_TRANSLATE : MMU_DIRECT)
 #endif
+#define isa_ifetch_ctx() 0
+#define isa_pmp_check_page(paddr, type) true
 
 #endif
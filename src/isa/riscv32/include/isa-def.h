@@ -126,5 +126,7 @@ typedef struct {
 #define isa_mmu_state() (cpu.satp.mode ? MMU_TRANSLATE : MMU_DIRECT)
 #endif
 #define isa_mmu_check(vaddr, len, type) isa_mmu_state()
+#define isa_ifetch_ctx() 0
+#define isa_pmp_check_page(paddr, type) true
 
 #endif
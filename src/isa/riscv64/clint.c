@@ -16,8 +16,10 @@
 #include <utils.h>
 #include <device/alarm.h>
 #include <device/map.h>
+#include <cpu/smp.h>
 #include "local-include/csr.h"
 
+#define CLINT_MSIP     (0x0000 / sizeof(uint32_t))
 #define CLINT_MTIMECMP (0x4000 / sizeof(clint_base[0]))
 #define CLINT_MTIME    (0xBFF8 / sizeof(clint_base[0]))
 #define TIMEBASE 1000000ul
@@ -25,9 +27,14 @@
 
 static uint64_t *clint_base = NULL;
 static uint64_t boot_time = 0;
+#ifdef CONFIG_VIRTUAL_TIME
+// mtime follows the virtual time, from the value last written by software
+static uint64_t mtime_offset = 0;
+static int clint_event = -1;
+#endif
 uint64_t clint_snapshot, spec_clint_snapshot;
 
-extern uint64_t g_nr_guest_instr;
+extern HART_LOCAL uint64_t g_nr_guest_instr;
 extern uint64_t stable_log_begin, spec_log_begin;
 
 void clint_take_snapshot() {
@@ -45,14 +52,31 @@ void clint_restore_snapshot(uint64_t restore_inst_cnt) {
   clint_base[CLINT_MTIME] = clint_snapshot;
 }
 
-void update_clint() {
-#ifdef CONFIG_DETERMINISTIC
+static void clint_tick() {
+#ifdef CONFIG_VIRTUAL_TIME
+  clint_base[CLINT_MTIME] = vtime_us() / US_PERCYCLE + mtime_offset;
+#elif defined(CONFIG_DETERMINISTIC)
   clint_base[CLINT_MTIME] += TIMEBASE / 10000;
 #else
   uint64_t uptime = get_time();
   clint_base[CLINT_MTIME] = uptime / US_PERCYCLE;
 #endif
+}
+
+// update the interrupts pending on the current hart
+void clint_sync_hart() {
+#ifdef CONFIG_SMP
+  int hart = smp_hart_id();
+  mip->mtip = (clint_base[CLINT_MTIME] >= clint_base[CLINT_MTIMECMP + hart]);
+  mip->msip = ((uint32_t *)clint_base)[CLINT_MSIP + hart] & 1;
+#else
   mip->mtip = (clint_base[CLINT_MTIME] >= clint_base[CLINT_MTIMECMP]);
+#endif
+}
+
+void update_clint() {
+  clint_tick();
+  clint_sync_hart();
 }
 
 uint64_t clint_uptime() {
@@ -60,17 +84,49 @@ uint64_t clint_uptime() {
   return clint_base[CLINT_MTIME];
 }
 
+#ifdef CONFIG_VIRTUAL_TIME
+static void clint_timer_event() {
+  update_clint();
+}
+
+// schedule the timer interrupt at the time mtime reaches mtimecmp
+static void clint_schedule() {
+  uint64_t mtime = clint_base[CLINT_MTIME];
+  uint64_t mtimecmp = clint_base[CLINT_MTIMECMP];
+  uint64_t ticks = mtimecmp > mtime ? mtimecmp - mtime : 0;
+  const uint64_t instrs_per_tick = CONFIG_VIRTUAL_TIME_INSTRS_PER_US * US_PERCYCLE;
+  uint64_t now = vtime_now();
+  if (ticks > (UINT64_MAX - now) / instrs_per_tick) {
+    schedule_event(clint_event, UINT64_MAX);
+  } else {
+    schedule_event(clint_event, now + ticks * instrs_per_tick);
+  }
+}
+#endif
+
 static void clint_io_handler(uint32_t offset, int len, bool is_write) {
 #ifdef CONFIG_LIGHTQS_DEBUG
   printf("clint op write %d addr %x\n", is_write, offset);
 #endif // CONFIG_LIGHTQS_DEBUG
+#ifdef CONFIG_VIRTUAL_TIME
+  if (is_write && offset / sizeof(clint_base[0]) == CLINT_MTIME) {
+    mtime_offset = clint_base[CLINT_MTIME] - vtime_us() / US_PERCYCLE;
+  }
+#endif
   update_clint();
+  IFDEF(CONFIG_VIRTUAL_TIME, if (is_write) clint_schedule());
 }
 
 void init_clint() {
   clint_base = (uint64_t *)new_space(0x10000);
   add_mmio_map("clint", CONFIG_CLINT_MMIO, (uint8_t *)clint_base, 0x10000, clint_io_handler);
-  IFNDEF(CONFIG_DETERMINISTIC, add_alarm_handle(update_clint));
+#ifdef CONFIG_VIRTUAL_TIME
+  clint_event = add_event(clint_timer_event);
+#elif !defined(CONFIG_DETERMINISTIC)
+  // the alarm may be handled on the thread of any hart,
+  // which picks up the new time in clint_sync_hart()
+  add_alarm_handle(MUXDEF(CONFIG_SMP, clint_tick, update_clint));
+#endif
   boot_time = get_time();
 }
 
@@ -17,6 +17,7 @@
 #include <isa.h>
 #include <cpu/cpu.h>
 #include <cpu/exec.h>
+#include <memory/paddr.h>
 #include <difftest.h>
 #include "../local-include/intr.h"
 #include "../local-include/csr.h"
@@ -141,8 +142,7 @@ void csr_writeback() {
 #ifdef CONFIG_LIGHTQS
 extern uint64_t stable_log_begin, spec_log_begin;
 
-extern struct lightqs_reg_ss reg_ss;
-extern uint64_t g_nr_guest_instr;
+extern HART_LOCAL uint64_t g_nr_guest_instr;
 void isa_difftest_regcpy(void *dut, bool direction, bool restore, uint64_t restore_count) {
   if (restore) {
     uint64_t left_exec = lightqs_restore_reg_snapshot(restore_count);
@@ -150,7 +150,6 @@ void isa_difftest_regcpy(void *dut, bool direction, bool restore, uint64_t resto
     printf("restore count %lu\n", restore_count);
     printf("left exec = %lx\n", left_exec);
     #endif // CONFIG_LIGHTQS_DEBUG
-    pmem_record_restore(reg_ss.inst_cnt);
     // clint_restore_snapshot(restore_count);
 
     if (spec_log_begin <= restore_count) {
@@ -193,6 +192,7 @@ void isa_difftest_regcpy(void *dut, bool direction) {
 void isa_difftest_csrcpy(void *dut, bool direction) {
   if (direction == DIFFTEST_TO_REF) {
     memcpy(csr_array, dut, 4096 * sizeof(rtlreg_t));
+    pmp_update_regions();
   } else {
     memcpy(dut, csr_array, 4096 * sizeof(rtlreg_t));
   }
@@ -200,7 +200,6 @@ void isa_difftest_csrcpy(void *dut, bool direction) {
 #ifdef CONFIG_LIGHTQS
 void isa_difftest_uarchstatus_cpy(void *dut, bool direction, uint64_t restore_count) {
   uint64_t left_exec = lightqs_restore_reg_snapshot(restore_count);
-  pmem_record_restore(reg_ss.inst_cnt);
   // clint_restore_snapshot(restore_count);
 
   if (spec_log_begin <= restore_count) {
@@ -246,7 +245,6 @@ void isa_difftest_uarchstatus_cpy(void *dut, bool direction) {
 void isa_difftest_raise_intr(word_t NO, uint64_t restore_count) {
 
   uint64_t left_exec = lightqs_restore_reg_snapshot(restore_count);
-  pmem_record_restore(reg_ss.inst_cnt);
   // clint_restore_snapshot(restore_count);
 
   if (spec_log_begin <= restore_count) {
@@ -281,7 +279,6 @@ void isa_difftest_raise_intr(word_t NO) {
 void isa_difftest_guided_exec(void * guide, uint64_t restore_count) {
 
   uint64_t left_exec = lightqs_restore_reg_snapshot(restore_count);
-  pmem_record_restore(reg_ss.inst_cnt);
   // clint_restore_snapshot(restore_count);
 
   if (spec_log_begin <= restore_count) {
@@ -316,6 +313,122 @@ void isa_difftest_guided_exec(void * guide) {
 }
 #endif
 
+#ifdef CONFIG_DIFFTEST_COMMIT_LOG
+static void commit_store(struct DifftestCommit *c) {
+#ifdef CONFIG_DIFFTEST_STORE_COMMIT
+  store_commit_t *store = store_commit_queue_pop();
+  if (store != NULL) {
+    c->store_addr = store->addr;
+    c->store_data = store->data;
+    c->store_mask = store->mask;
+  }
+#endif
+}
+
+// The destination register written by instr, from its encoding. Only the
+// scalar results of vector instructions are reported.
+static int commit_rd(uint32_t instr, uint8_t *rd) {
+  if ((instr & 0x3) != 0x3) {
+    uint32_t funct3 = (instr >> 13) & 0x7;
+    uint8_t rd_full = (instr >> 7) & 0x1f, rd_prime = 8 + ((instr >> 2) & 0x7);
+    switch (instr & 0x3) {
+      case 0:
+        *rd = rd_prime;
+        if (funct3 == 1) return DIFFTEST_RD_FPR;                  // c.fld
+        return (funct3 <= 3 ? DIFFTEST_RD_GPR : DIFFTEST_RD_NONE); // c.addi4spn, c.lw, c.ld
+      case 1:
+        if (funct3 <= 3) { *rd = rd_full; return DIFFTEST_RD_GPR; }
+        if (funct3 == 4) { *rd = 8 + ((instr >> 7) & 0x7); return DIFFTEST_RD_GPR; }
+        return DIFFTEST_RD_NONE; // c.j, c.beqz, c.bnez
+      default:
+        *rd = rd_full;
+        if (funct3 == 1) return DIFFTEST_RD_FPR;                  // c.fldsp
+        if (funct3 <= 3) return DIFFTEST_RD_GPR;                  // c.slli, c.lwsp, c.ldsp
+        if (funct3 != 4) return DIFFTEST_RD_NONE;                 // stores
+        uint8_t rs2 = (instr >> 2) & 0x1f;
+        if (rs2 != 0) return DIFFTEST_RD_GPR;                     // c.mv, c.add
+        if (((instr >> 12) & 0x1) && rd_full != 0) { *rd = 1; return DIFFTEST_RD_GPR; } // c.jalr
+        return DIFFTEST_RD_NONE; // c.jr, c.ebreak
+    }
+  }
+
+  uint32_t opcode = instr & 0x7f, funct3 = (instr >> 12) & 0x7;
+  *rd = (instr >> 7) & 0x1f;
+  switch (opcode) {
+    case 0x37: case 0x17: case 0x6f: case 0x67: // lui, auipc, jal, jalr
+    case 0x03: case 0x13: case 0x1b: case 0x33: case 0x3b: case 0x2f:
+      return DIFFTEST_RD_GPR;
+    case 0x73: // csr* and hlv*, but not ecall, ebreak, xret, wfi and fences
+      return (funct3 != 0 ? DIFFTEST_RD_GPR : DIFFTEST_RD_NONE);
+    case 0x07: // flh, flw, fld, others are vector loads
+      return (funct3 >= 1 && funct3 <= 3 ? DIFFTEST_RD_FPR : DIFFTEST_RD_NONE);
+    case 0x43: case 0x47: case 0x4b: case 0x4f: // fmadd and friends
+      return DIFFTEST_RD_FPR;
+    case 0x53:
+      switch (instr >> 27) {
+        case 0x14: case 0x18: case 0x1c: // fcmp, fcvt to integers, fmv.x, fclass
+          return DIFFTEST_RD_GPR;
+        default: return DIFFTEST_RD_FPR;
+      }
+    case 0x57:
+      if (funct3 == 7) return DIFFTEST_RD_GPR; // vsetvl*
+      if ((instr >> 26) == 0x10) {
+        if (funct3 == 2) return DIFFTEST_RD_GPR; // vmv.x.s, vcpop.m, vfirst.m
+        if (funct3 == 1) return DIFFTEST_RD_FPR; // vfmv.f.s
+      }
+      return DIFFTEST_RD_NONE;
+    default:
+      return DIFFTEST_RD_NONE;
+  }
+}
+
+// The batch ends early when NEMU stops, or after an instruction with more
+// than one store, whose other stores are left for difftest_store_commit().
+// Those must be drained before the next batch, so that the store queue is
+// empty before each step, and the store popped for a step is its own.
+uint64_t isa_difftest_exec_commits(uint64_t n, void *log) {
+#ifdef CONFIG_DIFFTEST_STORE_COMMIT
+  Assert(store_read_step() == 0, "%lu stores of the previous batch are not checked yet",
+      store_read_step());
+#endif
+  uint64_t i = 0;
+  while (i < n) {
+    struct DifftestCommit *c = (struct DifftestCommit *)log + i ++;
+    memset(c, 0, sizeof(*c));
+    c->pc = cpu.pc;
+    cpu.debug.current_instr = 0;
+    cpu.debug.trap = false;
+
+    cpu_exec(1);
+
+    c->instr = cpu.debug.current_instr;
+    if (cpu.debug.trap) {
+      // the instruction raising the exception writes no register
+      c->trap = 1;
+      c->cause = cpu.debug.trap_cause;
+    } else {
+      c->rd_type = commit_rd(c->instr, &c->rd);
+      switch (c->rd_type) {
+        case DIFFTEST_RD_GPR:
+          if (c->rd == 0) c->rd_type = DIFFTEST_RD_NONE;
+          else c->rd_data = cpu.gpr[c->rd]._64;
+          break;
+        case DIFFTEST_RD_FPR:
+          MUXDEF(CONFIG_FPU_NONE, c->rd_type = DIFFTEST_RD_NONE, c->rd_data = cpu.fpr[c->rd]._64);
+          break;
+      }
+    }
+    commit_store(c);
+
+    if (nemu_state.state == NEMU_END || nemu_state.state == NEMU_ABORT) break;
+#ifdef CONFIG_DIFFTEST_STORE_COMMIT
+    if (store_read_step() > 0) break;
+#endif
+  }
+  return i;
+}
+#endif
+
 #ifdef CONFIG_BR_LOG
 extern struct br_info br_log[];
 void * isa_difftest_query_br_log() {
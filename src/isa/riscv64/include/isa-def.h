@@ -43,6 +43,11 @@ struct ExecutionGuide {
 
 struct DebugInfo {
   uint64_t current_pc;
+#ifdef CONFIG_DIFFTEST_COMMIT_LOG
+  uint32_t current_instr;
+  bool trap;
+  uint64_t trap_cause;
+#endif
 };
 
 #ifdef CONFIG_QUERY_REF
@@ -121,6 +126,11 @@ typedef struct {
   // for LR/SC
   uint64_t lr_addr;
   uint64_t lr_valid;
+#ifdef CONFIG_SMP
+  uint64_t lr_data;
+  struct SmpResv *lr_resv;
+  uint32_t lr_version;
+#endif
 
   bool INTR;
 
@@ -0,0 +1,40 @@
+/***************************************************************************************
+* Copyright (c) 2014-2021 Zihao Yu, Nanjing University
+* Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#ifndef __RISCV64_ISA_JIT_H__
+#define __RISCV64_ISA_JIT_H__
+
+// Instructions translated by the JIT engine, listed as (instruction, RTL
+// operation, operand form). See src/engine/jit/jit.h for the operations
+// and the forms, which must match the RTL helpers used by each EHelper.
+#define JIT_INSTR_LIST(f) \
+  f(add, add, RR) f(sub, sub, RR) f(sll, shl, RR) f(srl, shr, RR) f(sra, sar, RR) \
+  f(slt, setlt, RR) f(sltu, setltu, RR) f(xor, xor, RR) f(or, or, RR) f(and, and, RR) \
+  f(addi, add, RI) f(slli, shl, RI) f(srli, shr, RI) f(srai, sar, RI) \
+  f(slti, setlt, RI) f(sltui, setltu, RI) f(xori, xor, RI) f(ori, or, RI) f(andi, and, RI) \
+  f(lui, li, I1) f(auipc, li, I1) \
+  f(addw, addw, RR) f(subw, subw, RR) f(sllw, shlw, RR) f(srlw, shrw, RR) f(sraw, sarw, RR) \
+  f(addiw, addw, RI) f(slliw, shlw, RI) f(srliw, shrw, RI) f(sraiw, sarw, RI) \
+  f(mul, mulu_lo, RR) f(mulw, mulw, RR) \
+  f(c_li, li, I2) f(c_mv, add, R0) f(p_sext_w, addw, R0) f(p_li_0, li, K0) f(p_li_1, li, K1) \
+  f(c_addi, add, DI) f(c_addiw, addw, DI) f(c_slli, shl, DI) f(c_srli, shr, DI) \
+  f(c_srai, sar, DI) f(c_andi, and, DI) \
+  f(c_add, add, DR) f(c_and, and, DR) f(c_or, or, DR) f(c_xor, xor, DR) f(c_sub, sub, DR) \
+  f(c_addw, addw, DR) f(c_subw, subw, DR) \
+  f(p_inc, add, D1) f(p_dec, sub, D1)
+
+#endif
@@ -40,14 +40,8 @@ void init_device();
 
 #define CSR_ZERO_INIT(name, addr) name->val = 0;
 
-void init_isa() {
-  // NEMU has some cached states and some static variables in the source code.
-  // They are assumed to have initialized states every time when the dynamic lib is loaded.
-  // However, if we link NEMU as a static library, we have to manually initialize them.
-  static bool is_second_call = false;
-  if (is_second_call) {
-    memset(csr_array, 0, sizeof(csr_array));
-  }
+// the architectural state of the current hart
+static void init_hart() {
   init_csr();
 
 #ifndef CONFIG_RESET_FROM_MMIO
@@ -80,6 +74,7 @@ void init_isa() {
   pmpcfg12->val = 0;
   pmpcfg14->val = 0;
 #endif // CONFIG_RV_PMP_ENTRY_64
+  pmp_update_regions();
 
 #ifdef CONFIG_RV_SVINVAL
   srnctl->val = 3; // enable extension 'svinval' [1]
@@ -136,6 +131,26 @@ void init_isa() {
 #ifdef CONFIG_RVSDTRIG
   init_trigger();
 #endif // CONFIG_RVSDTRIG
+}
+
+#ifdef CONFIG_SMP
+// Called on the thread of another hart before it runs.
+void isa_init_hart(int hartid) {
+  init_hart();
+  mhartid->val = hartid;
+  csr_prepare();
+}
+#endif
+
+void init_isa() {
+  // NEMU has some cached states and some static variables in the source code.
+  // They are assumed to have initialized states every time when the dynamic lib is loaded.
+  // However, if we link NEMU as a static library, we have to manually initialize them.
+  static bool is_second_call = false;
+  if (is_second_call) {
+    memset(csr_array, 0, sizeof(csr_array));
+  }
+  init_hart();
 
 #ifndef CONFIG_SHARE
   extern char *cpt_file;
@@ -90,6 +90,40 @@ def_THelper(main) {
   return table_inv(s);
 };
 
+#ifdef CONFIG_DECODE_CACHE
+// Decoded instructions indexed by pc. An entry is used only when the same
+// instruction is fetched again at its pc, and the CPU state read by the
+// decoder is the same: loads and stores pick their helpers by the data MMU
+// state, vector instructions read vtype and are not cached at all.
+typedef struct {
+  Decode s;
+  int idx;
+  int mmu_state;
+  IFDEF(CONFIG_RVH, uint64_t v);
+  bool valid;
+} DecodeCacheEntry;
+
+static HART_LOCAL DecodeCacheEntry decode_cache[CONFIG_DECODE_CACHE_SIZE];
+
+static inline DecodeCacheEntry *decode_cache_entry(vaddr_t pc) {
+  return &decode_cache[(pc >> 1) % CONFIG_DECODE_CACHE_SIZE];
+}
+
+static inline bool decode_cache_hit(DecodeCacheEntry *e, Decode *s) {
+  return e->valid && e->s.pc == s->pc && e->s.isa.instr.val == s->isa.instr.val &&
+    e->mmu_state == isa_mmu_state() && MUXDEF(CONFIG_RVH, e->v == cpu.v, true);
+}
+
+static inline void decode_cache_fill(DecodeCacheEntry *e, Decode *s, int idx) {
+  if (s->isa.instr.r.opcode1_0 == 0x3 && s->isa.instr.r.opcode6_2 == 0x15) return;
+  e->s = *s;
+  e->idx = idx;
+  e->mmu_state = isa_mmu_state();
+  IFDEF(CONFIG_RVH, e->v = cpu.v);
+  e->valid = true;
+}
+#endif
+
 int isa_fetch_decode(Decode *s) {
   int idx = EXEC_ID_inv;
 
@@ -102,16 +136,27 @@ int isa_fetch_decode(Decode *s) {
 #endif
 
   s->isa.instr.val = instr_fetch(&s->snpc, 2);
-  if (s->isa.instr.r.opcode1_0 != 0x3) {
-    // this is an RVC instruction
-    idx = table_rvc(s);
-  } else {
+  if (s->isa.instr.r.opcode1_0 == 0x3) {
     // this is a 4-byte instruction, should fetch the MSB part
     // NOTE: The fetch here may cause IPF.
     // If it is the case, we should have mepc = xxxffe and mtval = yyy000.
     // Refer to `mtval` in the privileged manual for more details.
     uint32_t hi = instr_fetch(&s->snpc, 2);
     s->isa.instr.val |= (hi << 16);
+  }
+
+#ifdef CONFIG_DECODE_CACHE
+  DecodeCacheEntry *e = decode_cache_entry(s->pc);
+  bool hit = decode_cache_hit(e, s);
+  if (hit) {
+    *s = e->s;
+    idx = e->idx;
+  } else
+#endif
+  if (s->isa.instr.r.opcode1_0 != 0x3) {
+    // this is an RVC instruction
+    idx = table_rvc(s);
+  } else {
     idx = table_main(s);
   }
 
@@ -122,6 +167,10 @@ int isa_fetch_decode(Decode *s) {
   trigger_handler(action);
 #endif
 
+#ifdef CONFIG_DECODE_CACHE
+  if (hit) return idx;
+#endif
+
   s->type = INSTR_TYPE_N;
   switch (idx) {
     case EXEC_ID_c_j: case EXEC_ID_p_jal: case EXEC_ID_jal:
@@ -159,5 +208,6 @@ int isa_fetch_decode(Decode *s) {
 #endif // CONFIG_DEBUG
   }
 
+  IFDEF(CONFIG_DECODE_CACHE, decode_cache_fill(e, s, idx));
   return idx;
 }
@@ -15,10 +15,108 @@
 ***************************************************************************************/
 
 #include <cpu/cpu.h>
+#include <cpu/smp.h>
 #include <memory/paddr.h>
 #include <rtl/rtl.h>
 #include "../local-include/intr.h"
 #include "cpu/difftest.h"
+
+#ifdef CONFIG_SMP
+// Other harts may access the same memory at the same time. Return the host
+// address of the atomic access if it is to be performed on the host memory,
+// or NULL to fall back to the normal path.
+static void* amo_host_addr(vaddr_t vaddr, int width) {
+  paddr_t paddr = vaddr;
+  if (isa_mmu_check(vaddr, width, MEM_TYPE_WRITE) == MMU_TRANSLATE) {
+    paddr = isa_mmu_translate(vaddr, width, MEM_TYPE_WRITE);
+  }
+  if (cpu.mem_exception != MEM_OK || (vaddr & (width - 1)) != 0) return NULL;
+  if (!in_pmem(paddr) || !isa_pmp_check_permission(paddr, width, MEM_TYPE_WRITE, cpu.mode)) {
+    return NULL;
+  }
+  return guest_to_host(paddr);
+}
+
+static bool amo_host(uint32_t funct5, int width, void *host, rtlreg_t src, rtlreg_t *old) {
+#define AMO_CAS_LOOP(type, cond) do { \
+    type o = __atomic_load_n((type *)host, __ATOMIC_SEQ_CST); \
+    while ((cond) && !__atomic_compare_exchange_n((type *)host, &o, (type)src, \
+          false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)); \
+    *old = (rtlreg_t)(int64_t)o; \
+  } while (0)
+#define AMO_CASE(type, stype) \
+  switch (funct5) { \
+    case 0b00001: *old = (int64_t)(stype)__atomic_exchange_n ((type *)host, src, __ATOMIC_SEQ_CST); break; \
+    case 0b00000: *old = (int64_t)(stype)__atomic_fetch_add  ((type *)host, src, __ATOMIC_SEQ_CST); break; \
+    case 0b01000: *old = (int64_t)(stype)__atomic_fetch_or   ((type *)host, src, __ATOMIC_SEQ_CST); break; \
+    case 0b01100: *old = (int64_t)(stype)__atomic_fetch_and  ((type *)host, src, __ATOMIC_SEQ_CST); break; \
+    case 0b00100: *old = (int64_t)(stype)__atomic_fetch_xor  ((type *)host, src, __ATOMIC_SEQ_CST); break; \
+    case 0b10000: AMO_CAS_LOOP(stype, (stype)src < (stype)o); break; \
+    case 0b10100: AMO_CAS_LOOP(stype, (stype)src > (stype)o); break; \
+    case 0b11000: AMO_CAS_LOOP(type,  (type)src  < (type)o);  *old = (int64_t)(stype)*old; break; \
+    case 0b11100: AMO_CAS_LOOP(type,  (type)src  > (type)o);  *old = (int64_t)(stype)*old; break; \
+    default: return false; \
+  }
+
+  if (width == 8) { AMO_CASE(uint64_t, int64_t); }
+  else { AMO_CASE(uint32_t, int32_t); }
+  return true;
+#undef AMO_CASE
+#undef AMO_CAS_LOOP
+}
+
+// called after a host atomic stores to the guest memory
+static void amo_host_store(void *host, int width) {
+  smp_resv_store(host, width);
+  IFDEF(CONFIG_PERF_OPT, pmem_code_page_write(host_to_guest(host), width));
+}
+
+static void resv_release() {
+  if (cpu.lr_resv != NULL) {
+    __atomic_fetch_sub(&cpu.lr_resv->holders, 1, __ATOMIC_SEQ_CST);
+    cpu.lr_resv = NULL;
+  }
+}
+
+// Reserve the set of LR before loading the value again, so that any store
+// to the set after the value is loaded makes SC fail.
+static void lr_host(vaddr_t vaddr, int width, rtlreg_t *dest) {
+  resv_release();
+  void *host = amo_host_addr(vaddr, width);
+  if (host != NULL) {
+    SmpResv *r = smp_resv(host);
+    __atomic_fetch_add(&r->holders, 1, __ATOMIC_SEQ_CST);
+    cpu.lr_resv = r;
+    cpu.lr_version = __atomic_load_n(&r->version, __ATOMIC_SEQ_CST);
+    *dest = (width == 8 ? __atomic_load_n((uint64_t *)host, __ATOMIC_SEQ_CST) :
+        (int64_t)(int32_t)__atomic_load_n((uint32_t *)host, __ATOMIC_SEQ_CST));
+  }
+  cpu.lr_data = *dest;
+}
+
+// SC succeeds if no store has been made to the reservation set since LR.
+// The memory is still compared with the value loaded by LR, to catch the
+// stores landing between the version check and the swap.
+static bool sc_host(int width, void *host, rtlreg_t src) {
+  SmpResv *r = cpu.lr_resv;
+  if (r != smp_resv(host) || __atomic_load_n(&r->version, __ATOMIC_SEQ_CST) != cpu.lr_version) {
+    return false;
+  }
+  bool success;
+  if (width == 8) {
+    uint64_t expected = cpu.lr_data;
+    success = __atomic_compare_exchange_n((uint64_t *)host, &expected, (uint64_t)src,
+        false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  } else {
+    uint32_t expected = cpu.lr_data;
+    success = __atomic_compare_exchange_n((uint32_t *)host, &expected, (uint32_t)src,
+        false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  }
+  if (success) amo_host_store(host, width);
+  return success;
+}
+#endif
+
 __attribute__((cold))
 def_rtl(amo_slow_path, rtlreg_t *dest, const rtlreg_t *src1, const rtlreg_t *src2) {
   uint32_t funct5 = s->isa.instr.r.funct7 >> 2;
@@ -29,6 +127,7 @@ def_rtl(amo_slow_path, rtlreg_t *dest, const rtlreg_t *src1, const rtlreg_t *src
     cpu.lr_addr = *src1;
     cpu.lr_valid = 1;
     rtl_lms(s, dest, src1, 0, width, MMU_DYNAMIC);
+    IFDEF(CONFIG_SMP, lr_host(*src1, width, dest));
     Logti("set lr vaild");
     return;
   } else if (funct5 == 0b00011) { // sc
@@ -43,6 +142,13 @@ def_rtl(amo_slow_path, rtlreg_t *dest, const rtlreg_t *src1, const rtlreg_t *src
     Logti("cpu sc addr=%lx scr1=%lx vaild=%ld success=%d", cpu.lr_addr,*src1, cpu.lr_valid,success);
     cpu.lr_valid = 0;
     if (success) {
+#ifdef CONFIG_SMP
+      void *host = amo_host_addr(*src1, width);
+      if (host != NULL) {
+        success = sc_host(width, host, *src2);
+        if (!success) IFDEF(CONFIG_DIFFTEST_REF_SPIKE, difftest_skip_ref());
+      } else
+#endif
       rtl_sm(s, src2, src1, 0, width, MMU_DYNAMIC);
     } else {
     // Because spike skipped some exception or interrupt
@@ -63,6 +169,7 @@ def_rtl(amo_slow_path, rtlreg_t *dest, const rtlreg_t *src1, const rtlreg_t *src
         longjmp_exception(EX_SAF);
       }
     }
+    IFDEF(CONFIG_SMP, resv_release());
     rtl_li(s, dest, !success);
 #ifdef CONFIG_DIFFTEST_STORE_COMMIT
     cpu.amo = false;
@@ -72,6 +179,15 @@ def_rtl(amo_slow_path, rtlreg_t *dest, const rtlreg_t *src1, const rtlreg_t *src
 
   cpu.amo = true;
   rtl_lms(s, s0, src1, 0, width, MMU_DYNAMIC);
+#ifdef CONFIG_SMP
+  // the load above raises the exceptions, if any
+  void *host = amo_host_addr(*src1, width);
+  if (host != NULL && amo_host(funct5, width, host, *src2, dest)) {
+    amo_host_store(host, width);
+    cpu.amo = false;
+    return;
+  }
+#endif
   switch (funct5) {
     case 0b00001: rtl_mv (s, s1, src2); break;
     case 0b00000: rtl_add(s, s1, s0, src2); break;
@@ -15,7 +15,7 @@
 ***************************************************************************************/
 #include <generated/autoconf.h>
 #ifdef CONFIG_BR_LOG
-extern uint64_t br_count;
+extern HART_LOCAL uint64_t br_count;
 #endif // CONFIG_BR_LOG
 def_EHelper(jal) {
   rtl_li(s, ddest, id_src2->imm);
@@ -24,7 +24,7 @@ static inline def_DopHelper(i) {
 
 static inline def_DopHelper(r) {
   bool load_val = flag;
-  static word_t zero_null = 0;
+  static HART_LOCAL word_t zero_null = 0;
   op->preg = (!load_val && val == 0) ? &zero_null : &reg_l(val);
   print_Dop(op->str, OP_STR_SIZE, "%s", reg_name(val, 4));
 #ifdef CONFIG_RVV
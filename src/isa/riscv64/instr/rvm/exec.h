@@ -47,7 +47,7 @@ def_EHelper(mulhsu) {
 }
 
 def_EHelper(div) {
-#ifdef CONFIG_ENGINE_INTERPRETER
+#if defined(CONFIG_ENGINE_INTERPRETER) || defined(CONFIG_ENGINE_JIT)
   if (*dsrc2 == 0) {
     rtl_li(s, ddest, ~0lu);
   } else if (*dsrc1 == 0x8000000000000000LL && *dsrc2 == ~(word_t)0) {
@@ -58,7 +58,7 @@ def_EHelper(div) {
 }
 
 def_EHelper(divu) {
-#ifdef CONFIG_ENGINE_INTERPRETER
+#if defined(CONFIG_ENGINE_INTERPRETER) || defined(CONFIG_ENGINE_JIT)
   if (*dsrc2 == 0) {
     rtl_li(s, ddest, ~0lu);
   } else
@@ -67,7 +67,7 @@ def_EHelper(divu) {
 }
 
 def_EHelper(rem) {
-#ifdef CONFIG_ENGINE_INTERPRETER
+#if defined(CONFIG_ENGINE_INTERPRETER) || defined(CONFIG_ENGINE_JIT)
   if (*dsrc2 == 0) {
     rtl_mv(s, ddest, dsrc1);
   } else if (*dsrc1 == 0x8000000000000000LL && *dsrc2 == ~(word_t)0) {
@@ -78,7 +78,7 @@ def_EHelper(rem) {
 }
 
 def_EHelper(remu) {
-#ifdef CONFIG_ENGINE_INTERPRETER
+#if defined(CONFIG_ENGINE_INTERPRETER) || defined(CONFIG_ENGINE_JIT)
   if (*dsrc2 == 0) {
     rtl_mv(s, ddest, dsrc1);
   } else
@@ -91,7 +91,7 @@ def_EHelper(mulw) {
 }
 
 def_EHelper(divw) {
-#ifdef CONFIG_ENGINE_INTERPRETER
+#if defined(CONFIG_ENGINE_INTERPRETER) || defined(CONFIG_ENGINE_JIT)
   rtl_sext(s, s0, dsrc1, 4);
   rtl_sext(s, s1, dsrc2, 4);
   if (*s1 == 0) {
@@ -108,7 +108,7 @@ def_EHelper(divw) {
 }
 
 def_EHelper(remw) {
-#ifdef CONFIG_ENGINE_INTERPRETER
+#if defined(CONFIG_ENGINE_INTERPRETER) || defined(CONFIG_ENGINE_JIT)
   rtl_sext(s, s0, dsrc1, 4);
   rtl_sext(s, s1, dsrc2, 4);
   if (*s1 == 0) {
@@ -125,7 +125,7 @@ def_EHelper(remw) {
 }
 
 def_EHelper(divuw) {
-#ifdef CONFIG_ENGINE_INTERPRETER
+#if defined(CONFIG_ENGINE_INTERPRETER) || defined(CONFIG_ENGINE_JIT)
   rtl_zext(s, s0, dsrc1, 4);
   rtl_zext(s, s1, dsrc2, 4);
   if (*s1 == 0) {
@@ -140,7 +140,7 @@ def_EHelper(divuw) {
 }
 
 def_EHelper(remuw) {
-#ifdef CONFIG_ENGINE_INTERPRETER
+#if defined(CONFIG_ENGINE_INTERPRETER) || defined(CONFIG_ENGINE_JIT)
   rtl_zext(s, s0, dsrc1, 4);
   rtl_zext(s, s1, dsrc2, 4);
   if (*s1 == 0) {
@@ -47,7 +47,7 @@ typedef union {
   uint8_t  _8[VENUM8];
 } rtlvreg_t;
 
-extern rtlvreg_t tmp_vreg[8];
+extern HART_LOCAL rtlvreg_t tmp_vreg[8];
 
 static inline int check_reg_index1(int index) {
   assert(index >= 0 && index < 32);
@@ -987,7 +987,11 @@ CSR_STRUCT_DUMMY_LIST(CSRS_UNPRIV_HPMCOUNTER)
  * Declare pointers to CSRs
 */
 
+#ifdef CONFIG_SMP
+#define CSRS_DECL(name, addr) extern HART_LOCAL concat(name, _t)* name;
+#else
 #define CSRS_DECL(name, addr) extern concat(name, _t)* const name;
+#endif
 MAP(CSRS, CSRS_DECL)
 
 
@@ -1061,6 +1065,14 @@ MAP(CSRS, CSRS_DECL)
 #define MASKED_HGATP(x) (HGATP_MASK & x)
 #endif // CONFIG_RVH
 
+/** ifetch context, see isa_ifetch_ctx() **/
+#define IFETCH_CTX_ASID(asid) ((uint32_t)(asid) & 0xffff)
+#define IFETCH_CTX_VMID(vmid) (((uint32_t)(vmid) & 0x3fff) << 16)
+#define IFETCH_CTX_V (1u << 30) // fetched in virtualization mode
+#define IFETCH_CTX_T (1u << 31) // fetched through the translation of satp
+#define IFETCH_CTX_ASID_MASK IFETCH_CTX_ASID(-1)
+#define IFETCH_CTX_VMID_MASK IFETCH_CTX_VMID(-1)
+
 /** RVH **/
 #ifdef CONFIG_RVH
   extern bool v; // virtualization mode
@@ -1089,5 +1101,9 @@ word_t csrid_read(uint32_t csrid);
 uint8_t pmpcfg_from_index(int idx);
 word_t pmpaddr_from_index(int idx);
 word_t pmp_tor_mask();
+void pmp_update_regions();
+
+/** guest TLB **/
+void gtlb_flush(vaddr_t vaddr, int asid);
 
 #endif // __CSR_H__
@@ -62,6 +62,10 @@ static word_t get_trap_pc(word_t xtvec, word_t xcause) {
 }
 
 word_t raise_intr(word_t NO, vaddr_t epc) {
+#ifdef CONFIG_DIFFTEST_COMMIT_LOG
+  cpu.debug.trap = true;
+  cpu.debug.trap_cause = NO;
+#endif
 #ifdef CONFIG_DIFFTEST_REF_SPIKE
   switch (NO) {
 #ifdef CONFIG_RVH
@@ -91,7 +95,7 @@ word_t raise_intr(word_t NO, vaddr_t epc) {
 #endif
   bool delegS = intr_deleg_S(NO);
 #ifdef CONFIG_RVH
-  extern bool hld_st;
+  extern HART_LOCAL bool hld_st;
   int hld_st_temp = hld_st;
   hld_st = 0;
   bool delegVS = intr_deleg_VS(NO);
@@ -132,7 +136,7 @@ word_t raise_intr(word_t NO, vaddr_t epc) {
       hstatus->spvp = cpu.mode; 
     }
     cpu.v = 0;
-    set_sys_state_flag(SYS_STATE_FLUSH_TCACHE);
+    set_sys_state_flag(SYS_STATE_LOOKUP_TCACHE);
 #else
   if (delegS) {
 #endif
@@ -174,7 +178,7 @@ word_t raise_intr(word_t NO, vaddr_t epc) {
     mstatus->gva = (NO == EX_IGPF || NO == EX_LGPF || NO == EX_SGPF ||
                     ((v || hld_st_temp) && ((0 <= NO && NO <= 7 && NO != 2) || NO == EX_IPF || NO == EX_LPF || NO == EX_SPF)));
     mstatus->mpv = cpu.v;
-    cpu.v = 0;set_sys_state_flag(SYS_STATE_FLUSH_TCACHE);
+    cpu.v = 0;set_sys_state_flag(SYS_STATE_LOOKUP_TCACHE);
 #endif
     mcause->val = NO;
     mepc->val = epc;
@@ -18,9 +18,11 @@
 #include <memory/vaddr.h>
 #include <memory/paddr.h>
 #include <memory/host.h>
+#include <memory/host-tlb.h>
 #include <cpu/cpu.h>
 #include "../local-include/csr.h"
 #include "../local-include/intr.h"
+#include <stdlib.h>
 
 typedef union PageTableEntry {
   struct {
@@ -58,8 +60,8 @@ static inline uintptr_t VPNi(vaddr_t va, int i) {
 static inline uintptr_t GVPNi(vaddr_t va, int i) {
   return (i == 2)?  (va >> VPNiSHFT(i)) & GPVPNMASK : (va >> VPNiSHFT(i)) & VPNMASK;
 }
-  bool hlvx = 0;
-  bool hld_st = 0;
+  HART_LOCAL bool hlvx = 0;
+  HART_LOCAL bool hld_st = 0;
 #endif
 #ifdef CONFIG_RVH
 static inline bool check_permission(PTE *pte, bool ok, vaddr_t vaddr, int type, int virt, int mode) {
@@ -145,8 +147,10 @@ static inline bool check_permission(PTE *pte, bool ok, vaddr_t vaddr, int type)
   return true;
 }
 #ifdef CONFIG_RVH
-bool has_two_stage_translation(){
-  return hld_st || (mstatus->mprv && mstatus->mpv) || cpu.v;
+// Hypervisor loads and stores are translated as in virtualization mode
+// without being in it, which is not selected by the host TLB context.
+bool is_hyper_ldst(){
+  return hld_st;
 }
 
 void raise_guest_excep(paddr_t gpaddr, vaddr_t vaddr, int type){
@@ -262,6 +266,85 @@ static word_t pte_read(paddr_t addr, int type, int mode, vaddr_t vaddr) {
 }
 #endif // CONFIG_MULTICORE_DIFF
 
+#ifdef CONFIG_RV_GUEST_TLB
+// The leaf PTEs found by page table walks without virtualization are kept
+// in a TLB for each page size, and used until they are flushed by
+// sfence.vma. Only leaf PTEs with the A bit set are kept, and a store
+// through a leaf PTE without the D bit set walks the page table again.
+#define GTLB_SIZE 1024
+
+typedef struct {
+  vaddr_t vpn; // virtual page number of the page size
+  uint64_t pte;
+  uint16_t asid;
+  bool valid;
+} GuestTLBEntry;
+
+static HART_LOCAL GuestTLBEntry gtlb[PTW_LEVEL][GTLB_SIZE];
+static HART_LOCAL uint64_t gtlb_hit_cnt = 0;
+static HART_LOCAL uint64_t gtlb_walk_cnt = 0;
+static HART_LOCAL uint64_t gtlb_saved_pte_read_cnt = 0;
+
+static inline GuestTLBEntry* gtlb_entry(vaddr_t vaddr, int level) {
+  vaddr_t vpn = vaddr >> VPNiSHFT(level);
+  return &gtlb[level][vpn % GTLB_SIZE];
+}
+
+static inline bool gtlb_match(GuestTLBEntry *e, vaddr_t vaddr, int level, uint16_t asid) {
+  PTE pte = { .val = e->pte };
+  return e->valid && e->vpn == (vaddr >> VPNiSHFT(level)) && (pte.g || e->asid == asid);
+}
+
+static GuestTLBEntry* gtlb_lookup(vaddr_t vaddr, int type, int *level) {
+  uint16_t asid = satp->asid;
+  int i;
+  for (i = 0; i < PTW_LEVEL; i ++) {
+    GuestTLBEntry *e = gtlb_entry(vaddr, i);
+    if (gtlb_match(e, vaddr, i, asid)) {
+      PTE pte = { .val = e->pte };
+      if (type == MEM_TYPE_WRITE && !pte.d) return NULL;
+      *level = i;
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void gtlb_fill(vaddr_t vaddr, int level, PTE *pte) {
+  GuestTLBEntry *e = gtlb_entry(vaddr, level);
+  e->vpn = vaddr >> VPNiSHFT(level);
+  e->pte = pte->val;
+  e->asid = satp->asid;
+  e->valid = true;
+}
+
+// Flush the entries as sfence.vma does. `vaddr == 0` selects all pages, and
+// `asid < 0` selects all address spaces, including the global mappings.
+void gtlb_flush(vaddr_t vaddr, int asid) {
+  int i, j;
+  for (i = 0; i < PTW_LEVEL; i ++) {
+    if (vaddr == 0) {
+      for (j = 0; j < GTLB_SIZE; j ++) {
+        GuestTLBEntry *e = &gtlb[i][j];
+        PTE pte = { .val = e->pte };
+        if (asid < 0 || (!pte.g && e->asid == asid)) e->valid = false;
+      }
+    } else {
+      GuestTLBEntry *e = gtlb_entry(vaddr, i);
+      PTE pte = { .val = e->pte };
+      if (e->vpn == (vaddr >> VPNiSHFT(i)) && (asid < 0 || (!pte.g && e->asid == asid))) {
+        e->valid = false;
+      }
+    }
+  }
+}
+
+void gtlb_statistic() {
+  Log("guest TLB hit = %'ld, page table walks = %'ld, PTE reads saved = %'ld",
+      gtlb_hit_cnt, gtlb_walk_cnt, gtlb_saved_pte_read_cnt);
+}
+#endif // CONFIG_RV_GUEST_TLB
+
 static paddr_t ptw(vaddr_t vaddr, int type) {
   Logtr("Page walking for 0x%lx\n", vaddr);
   word_t pg_base = PGBASE(satp->ppn);
@@ -289,6 +372,19 @@ static paddr_t ptw(vaddr_t vaddr, int type) {
   int64_t vaddr39 = vaddr << (64 - 39);
   vaddr39 >>= (64 - 39);
   if ((uint64_t)vaddr39 != vaddr) goto bad;
+#ifdef CONFIG_RV_GUEST_TLB
+  if (!MUXDEF(CONFIG_RVH, virt, false)) {
+    GuestTLBEntry *e = gtlb_lookup(vaddr, type, &level);
+    if (e != NULL) {
+      gtlb_hit_cnt ++;
+      gtlb_saved_pte_read_cnt += PTW_LEVEL - level;
+      pte.val = e->pte;
+      pg_base = PGBASE((uint64_t)pte.ppn);
+      goto leaf;
+    }
+    gtlb_walk_cnt ++;
+  }
+#endif
   for (level = PTW_LEVEL - 1; level >= 0;) {
     p_pte = pg_base + VPNi(vaddr, level) * PTE_SIZE;
 #ifdef CONFIG_MULTICORE_DIFF
@@ -315,6 +411,9 @@ static paddr_t ptw(vaddr_t vaddr, int type) {
       if (level < 0) { goto bad; }
     }
   }
+#ifdef CONFIG_RV_GUEST_TLB
+leaf:
+#endif
 #ifdef CONFIG_RVH
   if (!check_permission(&pte, true, vaddr, type, virt, mode)) return MEM_RET_FAIL;
 #else
@@ -408,6 +507,9 @@ static paddr_t ptw(vaddr_t vaddr, int type) {
   }
 #endif // CONFIG_SHARE
 
+#ifdef CONFIG_RV_GUEST_TLB
+  if (!MUXDEF(CONFIG_RVH, virt, false)) gtlb_fill(vaddr, level, &pte);
+#endif
   return pg_base | MEM_RET_OK;
 
 bad:
@@ -420,10 +522,10 @@ bad:
   return MEM_RET_FAIL;
 }
 
-int ifetch_mmu_state = MMU_DIRECT;
-int data_mmu_state = MMU_DIRECT;
+HART_LOCAL int ifetch_mmu_state = MMU_DIRECT;
+HART_LOCAL int data_mmu_state = MMU_DIRECT;
 #ifdef CONFIG_RVH
-static int h_mmu_state = MMU_DIRECT;
+static HART_LOCAL int h_mmu_state = MMU_DIRECT;
 static inline int update_h_mmu_state_internal(bool ifetch) {
   uint32_t mode = (mstatus->mprv && (!ifetch) ? mstatus->mpp : cpu.mode);
   if (mode < MODE_M) {
@@ -458,9 +560,30 @@ int update_mmu_state() {
 #ifdef CONFIG_RVH
   h_mmu_state = update_h_mmu_state_internal(false);
 #endif
+  uint32_t ctx = IFETCH_CTX_T | IFETCH_CTX_ASID(satp->asid);
+  uint32_t data_ctx = (data_mmu_state == MMU_TRANSLATE ? ctx : 0);
+  uint32_t ifetch_ctx = (ifetch_mmu_state == MMU_TRANSLATE ? ctx : 0);
+#ifdef CONFIG_RVH
+  // the same as the selection of two-stage translation in ptw()
+  uint32_t vctx = IFETCH_CTX_V | IFETCH_CTX_VMID(hgatp->vmid) | IFETCH_CTX_ASID(vsatp_asid);
+  bool data_virt = (mstatus->mprv ? mstatus->mpv && mstatus->mpp != MODE_M : cpu.v);
+  if (data_virt) data_ctx = vctx;
+  if (cpu.v) ifetch_ctx = vctx;
+#endif
+  hosttlb_set_ctx(data_ctx, ifetch_ctx);
   return (data_mmu_state ^ data_mmu_state_old) ? true : false;
 }
 
+// Decoded instructions are tagged with this context, so that a change of
+// address space only requires to look them up again instead of dropping them.
+uint32_t isa_ifetch_ctx() {
+#ifdef CONFIG_RVH
+  if (cpu.v) return IFETCH_CTX_V | IFETCH_CTX_VMID(hgatp->vmid) | IFETCH_CTX_ASID(vsatp_asid);
+#endif
+  if (cpu.mode == MODE_M || satp->mode == 0) return 0;
+  return IFETCH_CTX_T | IFETCH_CTX_ASID(satp->asid);
+}
+
 void isa_misalign_data_addr_check(vaddr_t vaddr, int len, int type);
 
 int isa_mmu_check(vaddr_t vaddr, int len, int type) {
@@ -619,8 +742,8 @@ paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type) {
 }
 
 int force_raise_pf_record(vaddr_t vaddr, int type) {
-  static vaddr_t last_addr[3] = {0x0};
-  static int force_count[3] = {0};
+  static HART_LOCAL vaddr_t last_addr[3] = {0x0};
+  static HART_LOCAL int force_count[3] = {0};
   if (vaddr != last_addr[type]) {
     last_addr[type] = vaddr;
     force_count[type] = 0;
@@ -706,8 +829,8 @@ int force_raise_pf(vaddr_t vaddr, int type){
 
 #ifdef CONFIG_RVH
 int force_raise_gpf_record(vaddr_t vaddr, int type) {
-  static vaddr_t g_last_addr[3] = {0x0};
-  static int g_force_count[3] = {0};
+  static HART_LOCAL vaddr_t g_last_addr[3] = {0x0};
+  static HART_LOCAL int g_force_count[3] = {0};
   if (vaddr != g_last_addr[type]) {
     g_last_addr[type] = vaddr;
     g_force_count[type] = 0;
@@ -912,25 +1035,22 @@ bool pmptable_check_permission(word_t offset, word_t root_table_base, int type,
 }
 #endif
 
-bool isa_pmp_check_permission(paddr_t addr, int len, int type, int out_mode) {
-  bool ifetch = (type == MEM_TYPE_IFETCH);
-  __attribute__((unused)) uint32_t mode;
-  mode = (out_mode == MODE_M) ? (mstatus->mprv && !ifetch ? mstatus->mpp : cpu.mode) : out_mode;
-  // paddr_read/write method may not be able pass down the 'effective' mode for isa difference. do it here
-#ifdef CONFIG_SHARE
-  // if(dynamic_config.debug_difftest) {
-  //   if (mode != out_mode) {
-  //     fprintf(stderr, "[NEMU]   PMP out_mode:%d cpu.mode:%ld ifetch:%d mprv:%d mpp:%d actual mode:%d\n", out_mode, cpu.mode, ifetch, mstatus->mprv, mstatus->mpp, mode);
-  //       // Log("addr:%lx len:%d type:%d out_mode:%d mode:%d", addr, len, type, out_mode, mode);
-  //   }
-  // }
-#endif
-
 #ifdef CONFIG_RV_PMP_CHECK
-  if (CONFIG_RV_PMP_ACTIVE_NUM == 0) {
-    return true;
+static inline bool pmp_allow(uint8_t cfg, int type, int mode) {
+  if ((cfg & PMP_A) == 0) {
+    // no PMP entry matches
+    return mode == MODE_M;
   }
+  return
+    (mode == MODE_M && !(cfg & PMP_L)) ||
+    ((type == MEM_TYPE_READ || type == MEM_TYPE_IFETCH_READ ||
+      type == MEM_TYPE_WRITE_READ) && (cfg & PMP_R)) ||
+    (type == MEM_TYPE_WRITE && (cfg & PMP_W)) ||
+    (type == MEM_TYPE_IFETCH && (cfg & PMP_X));
+}
 
+// Go through the PMP entries in the order of their priorities.
+static bool pmp_check_entries(paddr_t addr, int len, int type, int mode) {
   word_t base = 0;
   for (int i = 0; i < CONFIG_RV_PMP_ACTIVE_NUM; i++) {
     word_t pmpaddr = pmpaddr_from_index(i);
@@ -990,12 +1110,7 @@ bool isa_pmp_check_permission(paddr_t addr, int len, int type, int out_mode) {
         // }
 #endif
 
-        return
-          (mode == MODE_M && !(cfg & PMP_L)) ||
-          ((type == MEM_TYPE_READ || type == MEM_TYPE_IFETCH_READ ||
-            type == MEM_TYPE_WRITE_READ) && (cfg & PMP_R)) ||
-          (type == MEM_TYPE_WRITE && (cfg & PMP_W)) ||
-          (type == MEM_TYPE_IFETCH && (cfg & PMP_X));
+        return pmp_allow(cfg, type, mode);
       }
     }
 
@@ -1010,6 +1125,134 @@ bool isa_pmp_check_permission(paddr_t addr, int len, int type, int out_mode) {
 #endif
 
   return mode == MODE_M;
+}
+
+// The active PMP entries are resolved into regions sorted by their start
+// addresses. Each region is either covered entirely by the PMP entry with
+// the highest priority matching it, or not matched by any entry. They are
+// rebuilt when pmpcfg or pmpaddr is written.
+typedef struct {
+  word_t start;
+  uint8_t cfg; // of the matching PMP entry, A is OFF if no entry matches
+} PMPRegion;
+
+#define PMP_NR_REGION (2 * CONFIG_RV_PMP_ACTIVE_NUM + 1)
+static HART_LOCAL PMPRegion pmp_region[PMP_NR_REGION];
+static HART_LOCAL int pmp_nr_region = 1; // no entry is active after reset
+
+static int pmp_bound_cmp(const void *a, const void *b) {
+  word_t x = *(const word_t *)a, y = *(const word_t *)b;
+  return (x > y) - (x < y);
+}
+
+void pmp_update_regions() {
+  struct { word_t start, last; uint8_t cfg; } entry[CONFIG_RV_PMP_ACTIVE_NUM];
+  word_t bound[PMP_NR_REGION];
+  int nr_entry = 0, nr_bound = 0;
+  bound[nr_bound ++] = 0;
+
+  word_t base = 0;
+  for (int i = 0; i < CONFIG_RV_PMP_ACTIVE_NUM; i++) {
+    word_t pmpaddr = pmpaddr_from_index(i);
+    word_t tor = (pmpaddr & pmp_tor_mask()) << PMP_SHIFT;
+    uint8_t cfg = pmpcfg_from_index(i);
+
+    if (cfg & PMP_A) {
+      bool is_tor = (cfg & PMP_A) == PMP_TOR;
+      bool is_na4 = (cfg & PMP_A) == PMP_NA4;
+      word_t start, last;
+      if (is_tor) {
+        start = base;
+        last = tor - 1;
+      } else {
+        word_t mask = (pmpaddr << 1) | (!is_na4) | ~pmp_tor_mask();
+        mask = ~(mask & ~(mask + 1)) << PMP_SHIFT;
+        start = tor & mask;
+        last = start | ~mask;
+      }
+      if (!is_tor || base < tor) {
+        entry[nr_entry].start = start;
+        entry[nr_entry].last = last;
+        entry[nr_entry].cfg = cfg;
+        nr_entry ++;
+        bound[nr_bound ++] = start;
+        if (last != (word_t)-1) bound[nr_bound ++] = last + 1;
+      }
+    }
+
+    base = tor;
+  }
+
+  qsort(bound, nr_bound, sizeof(bound[0]), pmp_bound_cmp);
+  pmp_nr_region = 0;
+  for (int i = 0; i < nr_bound; i++) {
+    if (i > 0 && bound[i] == bound[i - 1]) continue;
+    PMPRegion *r = &pmp_region[pmp_nr_region ++];
+    r->start = bound[i];
+    r->cfg = 0;
+    for (int j = 0; j < nr_entry; j++) {
+      if (entry[j].start <= r->start && r->start <= entry[j].last) {
+        r->cfg = entry[j].cfg;
+        break;
+      }
+    }
+  }
+}
+
+// Return the region holding [addr, addr + len), or NULL if the access
+// crosses the boundary of regions.
+static const PMPRegion* pmp_region_lookup(word_t addr, int len) {
+  int l = 0, r = pmp_nr_region - 1;
+  while (l < r) {
+    int m = (l + r + 1) / 2;
+    if (pmp_region[m].start <= addr) l = m;
+    else r = m - 1;
+  }
+  if (l + 1 < pmp_nr_region && addr + len - 1 >= pmp_region[l + 1].start) return NULL;
+  return &pmp_region[l];
+}
+
+// Whether all accesses of `type` to the page are allowed in any mode.
+// Accesses allowed below M-mode are also allowed in M-mode.
+bool isa_pmp_check_page(paddr_t paddr, int type) {
+  if (CONFIG_RV_PMP_ACTIVE_NUM == 0) {
+    return true;
+  }
+  const PMPRegion *r = pmp_region_lookup(paddr & ~(word_t)PAGE_MASK, PAGE_SIZE);
+  return r != NULL && pmp_allow(r->cfg, type, MODE_S);
+}
+#else
+void pmp_update_regions() { }
+
+bool isa_pmp_check_page(paddr_t paddr, int type) {
+  return true;
+}
+#endif
+
+bool isa_pmp_check_permission(paddr_t addr, int len, int type, int out_mode) {
+  bool ifetch = (type == MEM_TYPE_IFETCH);
+  __attribute__((unused)) uint32_t mode;
+  mode = (out_mode == MODE_M) ? (mstatus->mprv && !ifetch ? mstatus->mpp : cpu.mode) : out_mode;
+  // paddr_read/write method may not be able pass down the 'effective' mode for isa difference. do it here
+#ifdef CONFIG_SHARE
+  // if(dynamic_config.debug_difftest) {
+  //   if (mode != out_mode) {
+  //     fprintf(stderr, "[NEMU]   PMP out_mode:%d cpu.mode:%ld ifetch:%d mprv:%d mpp:%d actual mode:%d\n", out_mode, cpu.mode, ifetch, mstatus->mprv, mstatus->mpp, mode);
+  //       // Log("addr:%lx len:%d type:%d out_mode:%d mode:%d", addr, len, type, out_mode, mode);
+  //   }
+  // }
+#endif
+
+#ifdef CONFIG_RV_PMP_CHECK
+  if (CONFIG_RV_PMP_ACTIVE_NUM == 0) {
+    return true;
+  }
+
+  const PMPRegion *r = pmp_region_lookup(addr, len);
+  if (likely(r != NULL)) {
+    return pmp_allow(r->cfg, type, mode);
+  }
+  return pmp_check_entries(addr, len, type, mode);
 
 #endif
 
@@ -21,6 +21,7 @@
 #include <cpu/cpu.h>
 #include <cpu/difftest.h>
 #include <memory/paddr.h>
+#include <device/alarm.h>
 #include <stdlib.h>
 
 int update_mmu_state();
@@ -31,16 +32,25 @@ void vp_set_dirty();
 
 uint64_t get_abs_instr_count();
 
-rtlreg_t csr_array[4096] = {};
+HART_LOCAL rtlreg_t csr_array[4096] = {};
 
+#ifdef CONFIG_SMP
+// each hart binds the CSRs to its own csr_array in init_csr()
+#define CSRS_DEF(name, addr) \
+  HART_LOCAL concat(name, _t)* name = NULL;
+#define CSRS_BIND(name, addr) \
+  name = (concat(name, _t) *)&csr_array[addr];
+#else
 #define CSRS_DEF(name, addr) \
   concat(name, _t)* const name = (concat(name, _t) *)&csr_array[addr];
+#endif
 
 MAP(CSRS, CSRS_DEF)
 
 #define CSRS_EXIST(name, addr) csr_exist[addr] = 1;
 static bool csr_exist[4096] = {};
 void init_csr() {
+  IFDEF(CONFIG_SMP, MAP(CSRS, CSRS_BIND));
   MAP(CSRS, CSRS_EXIST)
   #ifdef CONFIG_RVH
   cpu.v = 0;
@@ -540,8 +550,16 @@ static inline void csr_write(word_t *dest, word_t src) {
     if (cpu.mode == MODE_S && hstatus->vtvm == 1) {
       longjmp_exception(EX_VI);
     }
-    if ((src & SATP_SV39_MASK) >> 60 == 8 || (src & SATP_SV39_MASK) >> 60 == 0)
+    if ((src & SATP_SV39_MASK) >> 60 == 8 || (src & SATP_SV39_MASK) >> 60 == 0) {
+      word_t old = vsatp->val;
+      uint32_t old_asid = vsatp_asid;
       vsatp->val = MASKED_SATP(src);
+      // the same as satp, for the translations of the current VMID
+      if (vsatp->val != old && vsatp_asid == old_asid) {
+        mmu_tlb_flush_ctx(0, IFETCH_CTX_V | IFETCH_CTX_VMID(hgatp->vmid) | IFETCH_CTX_ASID(old_asid),
+            IFETCH_CTX_V | IFETCH_CTX_T | IFETCH_CTX_VMID_MASK | IFETCH_CTX_ASID_MASK);
+      }
+    }
   }else if (is_write(mstatus)) { mstatus->val = mask_bitset(mstatus->val, MSTATUS_WMASK, src); }
 #else
   if (is_write(mstatus)) {
@@ -668,6 +686,8 @@ static inline void csr_write(word_t *dest, word_t src) {
     }
 #endif // CONFIG_SHARE
 
+    pmp_update_regions();
+    IFDEF(CONFIG_RV_GUEST_TLB, gtlb_flush(0, -1));
     mmu_tlb_flush(0);
   }
   else if (is_pmpcfg(dest)) {
@@ -707,6 +727,8 @@ static inline void csr_write(word_t *dest, word_t src) {
 
     *dest = cfg_data;
 
+    pmp_update_regions();
+    IFDEF(CONFIG_RV_GUEST_TLB, gtlb_flush(0, -1));
     mmu_tlb_flush(0);
   }
 #endif // CONFIG_RV_PMP_CSR
@@ -715,8 +737,17 @@ static inline void csr_write(word_t *dest, word_t src) {
       longjmp_exception(EX_II);
     }
     // Only support Sv39, ignore write that sets other mode
-    if ((src & SATP_SV39_MASK) >> 60 == 8 || (src & SATP_SV39_MASK) >> 60 == 0)
+    if ((src & SATP_SV39_MASK) >> 60 == 8 || (src & SATP_SV39_MASK) >> 60 == 0) {
+      word_t old = *dest;
       *dest = MASKED_SATP(src);
+      // Translations are only tagged with the ASID, so drop the ones
+      // of the ASID if it is reused for another page table.
+      if (*dest != old && satp->asid == (old & SATP_ASID_MASK) >> SATP_PADDR_MAX_LEN) {
+        IFDEF(CONFIG_RV_GUEST_TLB, gtlb_flush(0, satp->asid));
+        mmu_tlb_flush_ctx(0, IFETCH_CTX_T | IFETCH_CTX_ASID(satp->asid),
+            IFETCH_CTX_V | IFETCH_CTX_T | IFETCH_CTX_ASID_MASK);
+      }
+    }
 #ifdef CONFIG_RVSDTRIG
   } else if (is_write(tselect)) {
     *dest = src < CONFIG_TRIGGER_NUM ? src : CONFIG_TRIGGER_NUM;
@@ -749,8 +780,15 @@ static inline void csr_write(word_t *dest, word_t src) {
 #ifdef CONFIG_RVH
   else if (is_write(hgatp)) {
     // Only support Sv39, ignore write that sets other mode
-    if ((src & SATP_SV39_MASK) >> 60 == 8 || (src & SATP_SV39_MASK) >> 60 == 0)
+    if ((src & SATP_SV39_MASK) >> 60 == 8 || (src & SATP_SV39_MASK) >> 60 == 0) {
+      word_t old = hgatp->val;
       hgatp->val = MASKED_HGATP(src);
+      // drop the translations of the VMID if it is reused for another guest
+      if (hgatp->val != old && hgatp->vmid == ((hgatp_t *)&old)->vmid) {
+        mmu_tlb_flush_ctx(0, IFETCH_CTX_V | IFETCH_CTX_VMID(hgatp->vmid),
+            IFETCH_CTX_V | IFETCH_CTX_T | IFETCH_CTX_VMID_MASK);
+      }
+    }
   }
 #endif// CONFIG_RVH
   else if (is_mhpmcounter(dest) || is_mhpmevent(dest)) {
@@ -779,7 +817,7 @@ static inline void csr_write(word_t *dest, word_t src) {
 #ifdef CONFIG_RVH
   if (is_write(mstatus) || is_write(satp) || is_write(vsatp) || is_write(hgatp)) { update_mmu_state(); }
   if (is_write(hstatus)) {
-    set_sys_state_flag(SYS_STATE_FLUSH_TCACHE); // maybe change virtualization mode
+    set_sys_state_flag(SYS_STATE_LOOKUP_TCACHE); // maybe change virtualization mode
   }
   if (is_write(vsstatus)){
     update_vsstatus_sd();
@@ -787,7 +825,10 @@ static inline void csr_write(word_t *dest, word_t src) {
 #else
   if (is_write(mstatus) || is_write(satp)) { update_mmu_state(); }
 #endif
-  if (is_write(satp)) { mmu_tlb_flush(0); } // when satp is changed(asid | ppn), flush tlb.
+  if (is_write(satp)) { mmu_ctx_switch(); } // when satp is changed(asid | ppn), flush tlb.
+#ifdef CONFIG_RVH
+  if (is_write(vsatp) || is_write(hgatp)) { set_sys_state_flag(SYS_STATE_LOOKUP_TCACHE); }
+#endif
   if (is_write(mstatus) || is_write(sstatus) || is_write(satp) ||
       is_write(mie) || is_write(sie) || is_write(mip) || is_write(sip)) {
     set_sys_state_flag(SYS_STATE_UPDATE);
@@ -811,6 +852,43 @@ static void csrrw(rtlreg_t *dest, const rtlreg_t *src, uint32_t csrid) {
   if (src != NULL) { csr_write(csr, tmp); }
 }
 
+// Only drop the decoded instructions fetched through the translations selected
+// by the fence, where rs2 (in the lowest 5 bits of `op`) holds the ASID.
+static void fence_vma(vaddr_t vaddr, uint32_t op, bool virt) {
+  uint32_t rs2 = op & 0x1f;
+  uint32_t ctx_mask = IFETCH_CTX_V | IFETCH_CTX_T;
+  uint32_t ctx = (virt ? IFETCH_CTX_V : IFETCH_CTX_T);
+#ifdef CONFIG_RVH
+  if (virt) {
+    ctx |= IFETCH_CTX_VMID(hgatp->vmid);
+    ctx_mask |= IFETCH_CTX_VMID_MASK;
+  }
+#endif
+  if (rs2 != 0) {
+    ctx |= IFETCH_CTX_ASID(reg_l(rs2));
+    ctx_mask |= IFETCH_CTX_ASID_MASK;
+  }
+#ifdef CONFIG_RV_GUEST_TLB
+  if (!virt) gtlb_flush(vaddr, rs2 != 0 ? (uint16_t)reg_l(rs2) : -1);
+#endif
+  mmu_tlb_flush_ctx(vaddr, ctx, ctx_mask);
+}
+
+#ifdef CONFIG_RVH
+// the guest physical address can not select pages of basic blocks,
+// so all basic blocks of the VMID held by rs2 are dropped
+static void fence_gvma(uint32_t op) {
+  uint32_t rs2 = op & 0x1f;
+  uint32_t ctx_mask = IFETCH_CTX_V | IFETCH_CTX_T;
+  uint32_t ctx = IFETCH_CTX_V;
+  if (rs2 != 0) {
+    ctx |= IFETCH_CTX_VMID(reg_l(rs2));
+    ctx_mask |= IFETCH_CTX_VMID_MASK;
+  }
+  mmu_tlb_flush_ctx(0, ctx, ctx_mask);
+}
+#endif // CONFIG_RVH
+
 static word_t priv_instr(uint32_t op, const rtlreg_t *src) {
   switch (op) {
 #ifndef CONFIG_MODE_USER
@@ -819,7 +897,7 @@ static word_t priv_instr(uint32_t op, const rtlreg_t *src) {
       if (cpu.v == 0){
         cpu.v = hstatus->spv;
         hstatus->spv = 0;
-        set_sys_state_flag(SYS_STATE_FLUSH_TCACHE);
+        set_sys_state_flag(SYS_STATE_LOOKUP_TCACHE);
       }else if (cpu.v == 1){
         if((cpu.mode == MODE_S && hstatus->vtsr) || cpu.mode < MODE_S){
           longjmp_exception(EX_VI);
@@ -864,7 +942,7 @@ static word_t priv_instr(uint32_t op, const rtlreg_t *src) {
 #ifdef CONFIG_RVH
       cpu.v = mstatus->mpv;
       mstatus->mpv = 0;
-      set_sys_state_flag(SYS_STATE_FLUSH_TCACHE);
+      set_sys_state_flag(SYS_STATE_LOOKUP_TCACHE);
 #endif // CONFIG_RVH
       if (mstatus->mpp != MODE_M) { mstatus->mprv = 0; }
       mstatus->mpp = MODE_U;
@@ -894,10 +972,17 @@ static word_t priv_instr(uint32_t op, const rtlreg_t *src) {
       if ((cpu.mode < MODE_M && mstatus->tw == 1) || (cpu.mode == MODE_U)){
         longjmp_exception(EX_II);
       } // When S-mode is implemented, then executing WFI in U-mode causes an illegal instruction exception
+#ifdef CONFIG_VIRTUAL_TIME
+      // Only an event can raise an interrupt to wake the hart up, so skip
+      // the idle loop to the next event, and end the batch to handle it.
+      if ((mip->val & mie->val) == 0 && vtime_idle() > 0) {
+        set_sys_state_flag(SYS_STATE_UPDATE);
+      }
+#endif
     break;
 #endif // CONFIG_MODE_USER
     case -1: // fence.i
-      set_sys_state_flag(SYS_STATE_FLUSH_TCACHE);
+      mmu_icache_flush();
       break;
     default:
       switch (op >> 5) { // instr[31:25]
@@ -917,7 +1002,7 @@ static word_t priv_instr(uint32_t op, const rtlreg_t *src) {
           if ((cpu.mode == MODE_S && mstatus->tvm == 1) || cpu.mode == MODE_U)
             longjmp_exception(EX_II);
 #endif // CONFIG_RVH
-          mmu_tlb_flush(*src);
+          fence_vma(*src, op, MUXDEF(CONFIG_RVH, cpu.v, false));
           break;
 #ifdef CONFIG_RV_SVINVAL
         case 0x0b: // sinval.vma
@@ -942,7 +1027,7 @@ static word_t priv_instr(uint32_t op, const rtlreg_t *src) {
             longjmp_exception(EX_II);
           }
 #endif // CONFIG_RVH
-          mmu_tlb_flush(*src);
+          fence_vma(*src, op, MUXDEF(CONFIG_RVH, cpu.v, false));
           break;
 #endif // CONFIG_RV_SVINVAL
 #ifdef CONFIG_RVH
@@ -950,24 +1035,24 @@ static word_t priv_instr(uint32_t op, const rtlreg_t *src) {
           if(cpu.v) longjmp_exception(EX_VI);
           if(cpu.mode == MODE_U) longjmp_exception(EX_II);
           if(!(cpu.mode == MODE_M || (cpu.mode == MODE_S && !cpu.v))) longjmp_exception(EX_II);
-          mmu_tlb_flush(*src);
+          fence_vma(*src, op, true);
           break;
         case 0x31: // hfence.gvma
           if(cpu.v) longjmp_exception(EX_VI);
           if(cpu.mode == MODE_U) longjmp_exception(EX_II);
           if(!(cpu.mode == MODE_M || (cpu.mode == MODE_S && !cpu.v && mstatus->tvm == 0))) longjmp_exception(EX_II);
-          mmu_tlb_flush(*src);
+          fence_gvma(op);
           break;
 #ifdef CONFIG_RV_SVINVAL
         case 0x13: // hinval.vvma
           if(cpu.v) longjmp_exception(EX_VI);
           if(cpu.mode == MODE_U) longjmp_exception(EX_II);
-          mmu_tlb_flush(*src);
+          fence_vma(*src, op, true);
           break;
         case 0x33: // hinval.gvma
           if(cpu.v) longjmp_exception(EX_VI);
           if(cpu.mode == MODE_U || (cpu.mode == MODE_S && !cpu.v && mstatus->tvm)) longjmp_exception(EX_II);
-          mmu_tlb_flush(*src);
+          fence_gvma(op);
           break;
 #endif // CONFIG_SVINVAL
 #endif // CONFIG_RVH
@@ -1007,12 +1092,12 @@ void isa_hostcall(uint32_t id, rtlreg_t *dest, const rtlreg_t *src1,
 
 #ifdef CONFIG_RVH
 int rvh_hlvx_check(struct Decode *s, int type){
-  extern bool hlvx;
+  extern HART_LOCAL bool hlvx;
   hlvx = (s->isa.instr.i.opcode6_2 == 0x1c && s->isa.instr.i.funct3 == 0x4
                   && (s->isa.instr.i.simm11_0 == 0x643 || s->isa.instr.i.simm11_0 == 0x683));
   return hlvx;
 }
-extern bool hld_st;
+extern HART_LOCAL bool hld_st;
 int hload(Decode *s, rtlreg_t *dest, const rtlreg_t * src1, uint32_t id){
   hld_st = true;
   if(!(cpu.mode == MODE_M || cpu.mode == MODE_S || (cpu.mode == MODE_U && hstatus->hu))){
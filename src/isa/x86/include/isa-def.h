@@ -182,5 +182,7 @@ enum { OP_TYPE_IMM, OP_TYPE_REG, OP_TYPE_MEM };
 #define isa_mmu_state() (cpu.cr0.paging ? MMU_TRANSLATE : MMU_DIRECT)
 #endif
 #define isa_mmu_check(vaddr, len, type) isa_mmu_state()
+#define isa_ifetch_ctx() 0
+#define isa_pmp_check_page(paddr, type) true
 
 #endif
@@ -20,45 +20,155 @@
 #include <memory/paddr.h>
 #include <memory/sparseram.h>
 #include <cpu/cpu.h>
+#include <cpu/smp.h>
 #include <cpu/decode.h>
 
 #define HOSTTLB_SIZE_SHIFT 12
 #define HOSTTLB_SIZE (1 << HOSTTLB_SIZE_SHIFT)
+#define HOSTTLB_WAYS 4
+#define HOSTTLB_SETS (HOSTTLB_SIZE / HOSTTLB_WAYS)
 
 typedef struct {
   uint8_t *offset; // offset from the guest virtual address of the data page to the host virtual address
   vaddr_t gvpn; // guest virtual page number
+  uint32_t ctx; // context of the translation, see hosttlb_set_ctx()
+#ifdef CONFIG_USE_SPARSEMM
+  paddr_t poffset; // offset from the guest virtual address to the guest physical address
+#endif
 } HostTLBEntry;
 
-static HostTLBEntry hosttlb[HOSTTLB_SIZE * 3];
-static HostTLBEntry* const hostrtlb = &hosttlb[0];
-static HostTLBEntry* const hostwtlb = &hosttlb[HOSTTLB_SIZE];
-static HostTLBEntry* const hostxtlb = &hosttlb[HOSTTLB_SIZE * 2];
+// Each set keeps its entries from the most recently used one to the least
+// recently used one, so that the fast path only checks the first way.
+static HART_LOCAL HostTLBEntry hosttlb[HOSTTLB_SIZE * 3];
+#define hostrtlb (&hosttlb[0])
+#define hostwtlb (&hosttlb[HOSTTLB_SIZE])
+#define hostxtlb (&hosttlb[HOSTTLB_SIZE * 2])
+
+static HART_LOCAL uint32_t data_ctx = 0;
+static HART_LOCAL uint32_t ifetch_ctx = 0;
+
+static HART_LOCAL uint64_t hosttlb_way_hit_cnt = 0;
+static HART_LOCAL uint64_t hosttlb_miss_cnt = 0;
+static HART_LOCAL uint64_t hosttlb_flush_cnt = 0;
+static HART_LOCAL uint64_t hosttlb_flush_ctx_cnt = 0;
+IFDEF(CONFIG_HOSTTLB_STAT, static HART_LOCAL uint64_t hosttlb_hit_cnt = 0);
 
 static inline vaddr_t hosttlb_vpn(vaddr_t vaddr) {
   return (vaddr >> PAGE_SHIFT);
 }
 
-static inline int hosttlb_idx(vaddr_t vaddr) {
-  return (hosttlb_vpn(vaddr) % HOSTTLB_SIZE);
+static inline HostTLBEntry* hosttlb_set(HostTLBEntry *tlb, vaddr_t vaddr) {
+  return &tlb[(hosttlb_vpn(vaddr) % HOSTTLB_SETS) * HOSTTLB_WAYS];
+}
+
+static inline bool hosttlb_match(HostTLBEntry *e, vaddr_t gvpn, uint32_t ctx) {
+  return (e->gvpn == gvpn) && (e->ctx == ctx);
+}
+
+// Look up the other ways of the set, and move the matched entry to the first way.
+static HostTLBEntry* hosttlb_lookup_ways(HostTLBEntry *set, vaddr_t gvpn, uint32_t ctx) {
+  int i;
+  for (i = 1; i < HOSTTLB_WAYS; i ++) {
+    if (hosttlb_match(&set[i], gvpn, ctx)) {
+      HostTLBEntry e = set[i];
+      memmove(&set[1], &set[0], sizeof(set[0]) * i);
+      set[0] = e;
+      hosttlb_way_hit_cnt ++;
+      return &set[0];
+    }
+  }
+  return NULL;
+}
+
+// Evict the least recently used entry of the set.
+static void hosttlb_fill(HostTLBEntry *set, vaddr_t vaddr, paddr_t paddr, uint32_t ctx) {
+#ifdef CONFIG_USE_SPARSEMM
+  // the sparse memory keeps the page at the same host address from now on
+  uint8_t *page = sparse_mem_host_page(get_sparsemm(), paddr, PAGE_SIZE);
+  if (page == NULL) return;
+#endif
+  memmove(&set[1], &set[0], sizeof(set[0]) * (HOSTTLB_WAYS - 1));
+  HostTLBEntry *e = &set[0];
+  #ifdef CONFIG_USE_SPARSEMM
+  e->offset = page - (vaddr & ~(vaddr_t)PAGE_MASK);
+  e->poffset = (paddr & ~(paddr_t)PAGE_MASK) - (vaddr & ~(vaddr_t)PAGE_MASK);
+  #else
+  e->offset = guest_to_host(paddr) - vaddr;
+  #endif
+  e->gvpn = hosttlb_vpn(vaddr);
+  e->ctx = ctx;
+}
+
+static inline void hosttlb_invalidate(HostTLBEntry *e) {
+  e->gvpn = (sword_t)-1;
 }
 
 void hosttlb_flush(vaddr_t vaddr) {
+  hosttlb_flush_cnt ++;
   if (vaddr == 0) {
     memset(hosttlb, -1, sizeof(hosttlb));
   } else {
     vaddr_t gvpn = hosttlb_vpn(vaddr);
-    int idx = hosttlb_idx(vaddr);
-    if (hostrtlb[idx].gvpn == gvpn) hostrtlb[idx].gvpn = (sword_t)-1;
-    if (hostwtlb[idx].gvpn == gvpn) hostwtlb[idx].gvpn = (sword_t)-1;
-    if (hostxtlb[idx].gvpn == gvpn) hostxtlb[idx].gvpn = (sword_t)-1;
+    HostTLBEntry *tlbs[] = { hostrtlb, hostwtlb, hostxtlb };
+    int i, w;
+    for (i = 0; i < ARRLEN(tlbs); i ++) {
+      HostTLBEntry *set = hosttlb_set(tlbs[i], vaddr);
+      for (w = 0; w < HOSTTLB_WAYS; w ++) {
+        if (set[w].gvpn == gvpn) hosttlb_invalidate(&set[w]);
+      }
+    }
+  }
+}
+
+// Only drop the entries whose context is selected by `ctx_mask`.
+// `vaddr == 0` selects all pages.
+void hosttlb_flush_ctx(vaddr_t vaddr, uint32_t ctx, uint32_t ctx_mask) {
+  hosttlb_flush_ctx_cnt ++;
+  if (vaddr == 0) {
+    int i;
+    for (i = 0; i < ARRLEN(hosttlb); i ++) {
+      if ((hosttlb[i].ctx & ctx_mask) == ctx) hosttlb_invalidate(&hosttlb[i]);
+    }
+  } else {
+    vaddr_t gvpn = hosttlb_vpn(vaddr);
+    HostTLBEntry *tlbs[] = { hostrtlb, hostwtlb, hostxtlb };
+    int i, w;
+    for (i = 0; i < ARRLEN(tlbs); i ++) {
+      HostTLBEntry *set = hosttlb_set(tlbs[i], vaddr);
+      for (w = 0; w < HOSTTLB_WAYS; w ++) {
+        if (set[w].gvpn == gvpn && (set[w].ctx & ctx_mask) == ctx) hosttlb_invalidate(&set[w]);
+      }
+    }
   }
 }
 
+// Entries are tagged with the context they are filled in, so they
+// survive a switch between address spaces with different ASIDs.
+void hosttlb_set_ctx(uint32_t data, uint32_t ifetch) {
+  data_ctx = data;
+  ifetch_ctx = ifetch;
+}
+
+void hosttlb_flush_write() {
+  memset(hostwtlb, -1, sizeof(hosttlb[0]) * HOSTTLB_SIZE);
+}
+
 void hosttlb_init() {
   hosttlb_flush(0);
 }
 
+void hosttlb_statistic() {
+#ifdef CONFIG_HOSTTLB_STAT
+  Log("host TLB hit = %'ld, hit in other ways = %'ld, miss = %'ld",
+      hosttlb_hit_cnt, hosttlb_way_hit_cnt, hosttlb_miss_cnt);
+#else
+  Log("host TLB hit in other ways = %'ld, miss = %'ld",
+      hosttlb_way_hit_cnt, hosttlb_miss_cnt);
+#endif
+  Log("host TLB flush = %'ld, flush by context = %'ld",
+      hosttlb_flush_cnt, hosttlb_flush_ctx_cnt);
+}
+
 static paddr_t va2pa(struct Decode *s, vaddr_t vaddr, int len, int type) {
   if (type != MEM_TYPE_IFETCH) save_globals(s);
   // int ret = isa_mmu_check(vaddr, len, type);
@@ -71,17 +181,19 @@ static paddr_t va2pa(struct Decode *s, vaddr_t vaddr, int len, int type) {
 
 __attribute__((noinline))
 static word_t hosttlb_read_slowpath(struct Decode *s, vaddr_t vaddr, int len, int type) {
+  bool ifetch = (type == MEM_TYPE_IFETCH);
+  HostTLBEntry *set = hosttlb_set(ifetch ? hostxtlb : hostrtlb, vaddr);
+  uint32_t ctx = (ifetch ? ifetch_ctx : data_ctx);
+  HostTLBEntry *e = hosttlb_lookup_ways(set, hosttlb_vpn(vaddr), ctx);
+  if (e != NULL) {
+    return host_read(e->offset + vaddr, len);
+  }
+
+  hosttlb_miss_cnt ++;
   paddr_t paddr = va2pa(s, vaddr, len, type);
   word_t data = paddr_read(paddr, len, type, cpu.mode, vaddr);
-  if (likely(in_pmem(paddr))) {
-    HostTLBEntry *e = type == MEM_TYPE_IFETCH ?
-      &hostxtlb[hosttlb_idx(vaddr)] : &hostrtlb[hosttlb_idx(vaddr)];
-    #ifdef CONFIG_USE_SPARSEMM
-    e->offset = (uint8_t *)(paddr - vaddr);
-    #else
-    e->offset = guest_to_host(paddr) - vaddr;
-    #endif
-    e->gvpn = hosttlb_vpn(vaddr);
+  if (likely(in_pmem(paddr)) && isa_pmp_check_page(paddr, type)) {
+    hosttlb_fill(set, vaddr, paddr, ctx);
   }
   Logtr("Slowpath, vaddr " FMT_WORD " --> paddr: " FMT_PADDR, vaddr, paddr);
   return data;
@@ -89,61 +201,80 @@ static word_t hosttlb_read_slowpath(struct Decode *s, vaddr_t vaddr, int len, in
 
 __attribute__((noinline))
 static void hosttlb_write_slowpath(struct Decode *s, vaddr_t vaddr, int len, word_t data) {
+  HostTLBEntry *set = hosttlb_set(hostwtlb, vaddr);
+  HostTLBEntry *e = hosttlb_lookup_ways(set, hosttlb_vpn(vaddr), data_ctx);
+  if (e != NULL) {
+    host_write(e->offset + vaddr, len, data);
+    smp_resv_store(e->offset + vaddr, len);
+    return;
+  }
+
+  hosttlb_miss_cnt ++;
   paddr_t paddr = va2pa(s, vaddr, len, MEM_TYPE_WRITE);
   paddr_write(paddr, len, data, cpu.mode, vaddr);
-  if (likely(in_pmem(paddr))) {
-    HostTLBEntry *e = &hostwtlb[hosttlb_idx(vaddr)];
+  if (likely(in_pmem(paddr)) && isa_pmp_check_page(paddr, MEM_TYPE_WRITE)) {
+#ifdef CONFIG_PERF_OPT
+    // stores to pages holding decoded instructions are tracked by paddr_write()
+    if (pmem_code_page_is_code(paddr)) return;
+#endif
+    hosttlb_fill(set, vaddr, paddr, data_ctx);
+  }
+}
+
+// translate the address of an instruction which has just been fetched
+paddr_t hosttlb_ifetch_paddr(vaddr_t vaddr) {
+  HostTLBEntry *set = hosttlb_set(hostxtlb, vaddr);
+  HostTLBEntry *e = set;
+  if (!hosttlb_match(e, hosttlb_vpn(vaddr), ifetch_ctx)) {
+    e = hosttlb_lookup_ways(set, hosttlb_vpn(vaddr), ifetch_ctx);
+  }
+  if (e != NULL) {
     #ifdef CONFIG_USE_SPARSEMM
-    e->offset = (uint8_t *)(paddr - vaddr);
+    return e->poffset + vaddr;
     #else
-    e->offset = guest_to_host(paddr) - vaddr;
+    return host_to_guest(e->offset + vaddr);
     #endif
-    e->gvpn = hosttlb_vpn(vaddr);
   }
+  return va2pa(NULL, vaddr, 1, MEM_TYPE_IFETCH);
 }
 
 word_t hosttlb_read(struct Decode *s, vaddr_t vaddr, int len, int type) {
   Logm("hosttlb_reading " FMT_WORD, vaddr);
 #ifdef CONFIG_RVH
-  extern bool has_two_stage_translation();
-  if(has_two_stage_translation()){
+  extern bool is_hyper_ldst();
+  if(is_hyper_ldst()){
     paddr_t paddr = va2pa(s, vaddr, len, type);
     return paddr_read(paddr, len, type, cpu.mode, vaddr);
   }
 #endif
   vaddr_t gvpn = hosttlb_vpn(vaddr);
-  HostTLBEntry *e = type == MEM_TYPE_IFETCH ?
-    &hostxtlb[hosttlb_idx(vaddr)] : &hostrtlb[hosttlb_idx(vaddr)];
-  if (unlikely(e->gvpn != gvpn)) {
+  bool ifetch = (type == MEM_TYPE_IFETCH);
+  HostTLBEntry *e = hosttlb_set(ifetch ? hostxtlb : hostrtlb, vaddr);
+  if (unlikely(!hosttlb_match(e, gvpn, ifetch ? ifetch_ctx : data_ctx))) {
     Logm("Host TLB slow path");
     return hosttlb_read_slowpath(s, vaddr, len, type);
   } else {
     Logm("Host TLB fast path");
-    #ifdef CONFIG_USE_SPARSEMM
-    return sparse_mem_wread(get_sparsemm(), (vaddr_t)e->offset + vaddr, len);
-    #else
+    IFDEF(CONFIG_HOSTTLB_STAT, hosttlb_hit_cnt ++);
     return host_read(e->offset + vaddr, len);
-    #endif
   }
 }
 
 void hosttlb_write(struct Decode *s, vaddr_t vaddr, int len, word_t data) {
   #ifdef CONFIG_RVH
-  extern bool has_two_stage_translation();
-  if(has_two_stage_translation()){
+  extern bool is_hyper_ldst();
+  if(is_hyper_ldst()){
     paddr_t paddr = va2pa(s, vaddr, len, MEM_TYPE_WRITE);
     return paddr_write(paddr, len, data, cpu.mode, vaddr);
   }
 #endif
   vaddr_t gvpn = hosttlb_vpn(vaddr);
-  HostTLBEntry *e = &hostwtlb[hosttlb_idx(vaddr)];
-  if (unlikely(e->gvpn != gvpn)) {
+  HostTLBEntry *e = hosttlb_set(hostwtlb, vaddr);
+  if (unlikely(!hosttlb_match(e, gvpn, data_ctx))) {
     hosttlb_write_slowpath(s, vaddr, len, data);
     return;
   }
-  #ifdef CONFIG_USE_SPARSEMM
-  sparse_mem_wwrite(get_sparsemm(), (vaddr_t)e->offset + vaddr, len, data);
-  #else
+  IFDEF(CONFIG_HOSTTLB_STAT, hosttlb_hit_cnt ++);
   host_write(e->offset + vaddr, len, data);
-  #endif
+  smp_resv_store(e->offset + vaddr, len);
 }
@@ -17,8 +17,12 @@
 #include <isa.h>
 #include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <memory/host-tlb.h>
 #include <memory/sparseram.h>
+#include <memory/image_loader.h>
 #include <device/mmio.h>
+#include <cpu/smp.h>
 #include <stdlib.h>
 #include <time.h>
 #include <cpu/cpu.h>
@@ -52,21 +56,14 @@ static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
 void* sparse_mm = NULL;
 #endif
 
-#ifdef CONFIG_STORE_LOG
+#if defined(CONFIG_STORE_LOG) && !defined(CONFIG_LIGHTQS)
 struct store_log {
-#ifdef CONFIG_LIGHTQS
-  uint64_t inst_cnt;
-#endif // CONFIG_LIGHTQS
   paddr_t addr;
   word_t orig_data;
   // new value and write length makes no sense for restore
 } store_log_buf[CONFIG_STORE_LOG_SIZE];
 
 uint64_t store_log_ptr = 0;
-#ifdef CONFIG_LIGHTQS
-struct store_log spec_store_log_buf[CONFIG_STORE_LOG_SIZE];
-uint64_t spec_store_log_ptr = CONFIG_SPEC_GAP;
-#endif // CONFIG_LIGHTQS
 #endif // CONFIG_STORE_LOG
 
 #define HOST_PMEM_OFFSET (uint8_t *)(pmem - CONFIG_MBASE)
@@ -99,7 +96,99 @@ static inline word_t pmem_read(paddr_t addr, int len) {
   #endif
 }
 
+#ifdef CONFIG_PERF_OPT
+// Physical pages holding instructions decoded by the tcache. Stores to
+// them are recorded, so that fence.i only drops the modified basic blocks.
+enum { CODE_PAGE_NONE, CODE_PAGE_CLEAN, CODE_PAGE_DIRTY };
+#define NR_DIRTY_CODE_PAGE 64
+
+static uint8_t *code_page = NULL;
+static paddr_t dirty_code_page[NR_DIRTY_CODE_PAGE];
+static int nr_dirty_code_page = 0;
+
+static inline uint8_t* code_page_entry(paddr_t addr) {
+  paddr_t idx = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  return (idx < (MEMORY_SIZE >> PAGE_SHIFT)) ? &code_page[idx] : NULL;
+}
+
+static inline void code_page_write(paddr_t addr) {
+  uint8_t *p = code_page_entry(addr);
+  if (p != NULL && unlikely(*p == CODE_PAGE_CLEAN)) {
+    *p = CODE_PAGE_DIRTY;
+    if (nr_dirty_code_page < NR_DIRTY_CODE_PAGE) {
+      dirty_code_page[nr_dirty_code_page] = addr;
+    }
+    nr_dirty_code_page ++;
+  }
+}
+
+// for the writers bypassing pmem_write(), such as DMA and difftest
+void pmem_code_page_write(paddr_t addr, size_t len) {
+  if (code_page == NULL || len == 0) return;
+  paddr_t page;
+  for (page = addr & ~PAGE_MASK; page <= addr + len - 1; page += PAGE_SIZE) {
+    code_page_write(page);
+  }
+}
+
+bool pmem_code_page_mark(paddr_t addr) {
+  if (code_page == NULL) {
+    code_page = calloc(MEMORY_SIZE >> PAGE_SHIFT, 1);
+    assert(code_page != NULL);
+  }
+  uint8_t *p = code_page_entry(addr);
+  if (p == NULL) return false;
+  if (*p == CODE_PAGE_NONE) {
+    *p = CODE_PAGE_CLEAN;
+    // stores to this page must go through paddr_write() from now on
+    hosttlb_flush_write();
+  }
+  return true;
+}
+
+bool pmem_code_page_is_code(paddr_t addr) {
+  uint8_t *p = (code_page == NULL ? NULL : code_page_entry(addr));
+  return p != NULL && *p != CODE_PAGE_NONE;
+}
+
+bool pmem_code_page_is_dirty(paddr_t addr) {
+  uint8_t *p = (code_page == NULL ? NULL : code_page_entry(addr));
+  return p != NULL && *p == CODE_PAGE_DIRTY;
+}
+
+int pmem_code_page_nr_dirty() {
+  return nr_dirty_code_page;
+}
+
+// called after all basic blocks on the dirty pages are dropped
+void pmem_code_page_clean() {
+  if (nr_dirty_code_page <= NR_DIRTY_CODE_PAGE) {
+    int i;
+    for (i = 0; i < nr_dirty_code_page; i ++) {
+      *code_page_entry(dirty_code_page[i]) = CODE_PAGE_NONE;
+    }
+  } else {
+    paddr_t i;
+    for (i = 0; i < (MEMORY_SIZE >> PAGE_SHIFT); i ++) {
+      if (code_page[i] == CODE_PAGE_DIRTY) code_page[i] = CODE_PAGE_NONE;
+    }
+  }
+  nr_dirty_code_page = 0;
+}
+
+void pmem_code_page_reset() {
+  if (code_page != NULL) memset(code_page, CODE_PAGE_NONE, MEMORY_SIZE >> PAGE_SHIFT);
+  nr_dirty_code_page = 0;
+}
+#endif // CONFIG_PERF_OPT
+
 static inline void pmem_write(paddr_t addr, int len, word_t data) {
+#ifdef CONFIG_PERF_OPT
+  if (code_page != NULL) {
+    code_page_write(addr);
+    code_page_write(addr + len - 1);
+  }
+#endif
 #ifdef CONFIG_DIFFTEST_STORE_COMMIT
   store_commit_queue_push(addr, data, len);
 #endif
@@ -110,6 +199,7 @@ static inline void pmem_write(paddr_t addr, int len, word_t data) {
   sparse_mem_wwrite(sparse_mm, addr, len, data);
   #else
   host_write(guest_to_host(addr), len, data);
+  smp_resv_store(guest_to_host(addr), len);
   #endif
 }
 
@@ -220,47 +310,90 @@ word_t paddr_read(paddr_t addr, int len, int type, int mode, vaddr_t vaddr) {
 #endif // CONFIG_SHARE
 }
 
-#ifdef CONFIG_STORE_LOG
 #ifdef CONFIG_LIGHTQS
+// The pages written since a snapshot, with their contents at the snapshot.
+// A page is saved before its first store, so taking and restoring a
+// snapshot cost O(pages written), and nothing is done for later stores.
+typedef struct {
+  uint64_t *saved;  // bitmap of the pages saved
+  uint64_t *pages;  // page numbers saved
+  uint8_t *data;    // contents of the pages saved
+  uint64_t nr, cap;
+  bool active;
+} PageSnapshot;
+
+#define SS_PAGE_SHIFT 12
+#define SS_PAGE_SIZE (1ul << SS_PAGE_SHIFT)
+
+static PageSnapshot stable_ss = {}, spec_ss = {};
+
+static void page_snapshot_reset(PageSnapshot *ss) {
+  if (ss->saved == NULL) {
+    uint64_t nr_pages = MEMORY_SIZE >> SS_PAGE_SHIFT;
+    ss->saved = calloc((nr_pages + 63) / 64, sizeof(uint64_t));
+    assert(ss->saved);
+  }
+  for (uint64_t i = 0; i < ss->nr; i ++) {
+    ss->saved[ss->pages[i] / 64] &= ~(1ul << (ss->pages[i] % 64));
+  }
+  ss->nr = 0;
+}
 
-extern uint64_t g_nr_guest_instr;
-
-extern uint64_t stable_log_begin, spec_log_begin;
+static void page_snapshot_save(PageSnapshot *ss, uint64_t page) {
+  if (ss->saved[page / 64] & (1ul << (page % 64))) return;
+  if (ss->nr == ss->cap) {
+    ss->cap = ss->cap ? ss->cap * 2 : 64;
+    ss->pages = realloc(ss->pages, ss->cap * sizeof(ss->pages[0]));
+    ss->data = realloc(ss->data, ss->cap * SS_PAGE_SIZE);
+    assert(ss->pages && ss->data);
+  }
+  ss->saved[page / 64] |= 1ul << (page % 64);
+  ss->pages[ss->nr] = page;
+  memcpy(ss->data + ss->nr * SS_PAGE_SIZE, pmem + (page << SS_PAGE_SHIFT), SS_PAGE_SIZE);
+  ss->nr ++;
+}
 
-void pmem_record_store(paddr_t addr) {
-  // align to 8 byte
-  addr = (addr >> 3) << 3;
-  uint64_t rdata = pmem_read(addr, 8);
-  //assert(g_nr_guest_instr >= stable_log_begin);
-  store_log_buf[store_log_ptr].inst_cnt = g_nr_guest_instr;
-  store_log_buf[store_log_ptr].addr = addr;
-  store_log_buf[store_log_ptr].orig_data = rdata;
-  ++store_log_ptr;
-  if (g_nr_guest_instr >= spec_log_begin) {
-    spec_store_log_buf[spec_store_log_ptr].inst_cnt = g_nr_guest_instr;
-    spec_store_log_buf[spec_store_log_ptr].addr = addr;
-    spec_store_log_buf[spec_store_log_ptr].orig_data = rdata;
-    ++spec_store_log_ptr;
+static void page_snapshot_restore(PageSnapshot *ss) {
+  for (uint64_t i = 0; i < ss->nr; i ++) {
+    memcpy(pmem + (ss->pages[i] << SS_PAGE_SHIFT), ss->data + i * SS_PAGE_SIZE, SS_PAGE_SIZE);
   }
 }
 
+void lightqs_take_pmem_snapshot() {
+  page_snapshot_reset(&stable_ss);
+  stable_ss.active = true;
+}
 
+void lightqs_take_spec_pmem_snapshot() {
+  page_snapshot_reset(&spec_ss);
+  spec_ss.active = true;
+}
 
-void pmem_record_restore(uint64_t restore_inst_cnt) {
-  if (spec_log_begin <= restore_inst_cnt) {
-    // use speculative rather than old stable
-    memcpy(store_log_buf, spec_store_log_buf, sizeof(store_log_buf));
-    store_log_ptr = spec_store_log_ptr;
-  }
-  for (int i = store_log_ptr - 1; i >= 0; i--) {
-    if (store_log_buf[i].inst_cnt > restore_inst_cnt) {
-      pmem_write(store_log_buf[i].addr, 8, store_log_buf[i].orig_data);
-    } else {
-      break;
-    }
+void pmem_record_store(paddr_t addr) {
+  // stores do not cross 8-byte boundaries, so they are in one page
+  uint64_t page = (addr - CONFIG_MBASE) >> SS_PAGE_SHIFT;
+  if (stable_ss.active) page_snapshot_save(&stable_ss, page);
+  if (spec_ss.active) page_snapshot_save(&spec_ss, page);
+}
+
+void pmem_record_restore(bool spec) {
+  if (spec) {
+    assert(spec_ss.active);
+    // use speculative rather than old stable, which keeps the pages
+    // written since the speculative snapshot in turn
+    page_snapshot_restore(&spec_ss);
+    PageSnapshot t = stable_ss;
+    stable_ss = spec_ss;
+    spec_ss = t;
+  } else {
+    page_snapshot_restore(&stable_ss);
   }
+  // the pages saved still hold their contents at the snapshot restored,
+  // but the speculative snapshot is ahead of it
+  page_snapshot_reset(&spec_ss);
+  spec_ss.active = false;
 }
-#else
+#elif defined(CONFIG_STORE_LOG)
 void pmem_record_store(paddr_t addr) {
   if(dynamic_config.enable_store_log) {
     // align to 8 byte
@@ -277,13 +410,10 @@ void pmem_record_restore() {
     pmem_write(store_log_buf[i].addr, 8, store_log_buf[i].orig_data);
   }
 }
-#endif // CONFIG_LIGHTQS
-
 
 void pmem_record_reset() {
   store_log_ptr = 0;
 }
-
 #endif // CONFIG_STORE_LOG
 
 void paddr_write(paddr_t addr, int len, word_t data, int mode, vaddr_t vaddr) {
@@ -299,7 +429,7 @@ void paddr_write(paddr_t addr, int len, word_t data, int mode, vaddr_t vaddr) {
   }
 #else
   if (likely(in_pmem(addr))) {
-#ifdef CONFIG_STORE_LOG
+#if defined(CONFIG_STORE_LOG) || defined(CONFIG_LIGHTQS)
     pmem_record_store(addr);
 #endif // CONFIG_STORE_LOG
     if(dynamic_config.debug_difftest) {
@@ -458,6 +588,7 @@ void dump_pmem() {
   if (fp == NULL) {
     printf("Cannot open file %s, memory dump skipped.\n", mem_dump_file);
   }
+  lazy_restore_fill(pmem, MEMORY_SIZE);
   fwrite(pmem, sizeof(char), MEMORY_SIZE, fp);
 }
 
@@ -1,4 +1,5 @@
 #include <memory/sparseram.h>
+#include <memory/host.h>
 
 #ifndef __cplusplus
 #endif
@@ -14,6 +15,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <vector>
+#include <algorithm>
 #include <map>
 #include <memory>
 #include <cerrno>
@@ -382,78 +384,130 @@ int file_is_elf(const char *fn){
 
 /*******************************************SparseRam Define****************************************************************/
 
+SparseRam::SparseRam(u_int block_count, u_int chunk_size)
+{
+  this->block_size = block_count * chunk_size;
+  vassert(this->block_size != 0 && (this->block_size & (this->block_size - 1)) == 0,
+          "block_size should be a power of 2");
+  this->block_shift = __builtin_ctz(this->block_size);
+  this->block_mask = this->block_size - 1;
+  int index_bits = sizeof(paddr_t) * 8 - this->block_shift;
+  this->nr_levels = (index_bits + level_bits - 1) / level_bits;
+  this->root = (void **)calloc(1 << level_bits, sizeof(void *));
+  DEBUG("init SparseRam with block_size= %.2f kB (chunk_size=%d)", float(this->block_size)/1024.0, chunk_size);
+}
+
 SparseRam::~SparseRam()
 {
-  for (auto iter = this->mem.begin(); iter != this->mem.end(); iter++)
-  {
-    free(iter->second);
-  }
+  this->_free_node(this->root, this->nr_levels - 1);
   for (auto iter = this->big_block.begin(); iter != this->big_block.end(); iter++){
     free(iter->second->blk);
     free(iter->second);
   }
-  this->mem.clear();
-  this->cache.clear();
   this->big_block.clear();
 }
 
-void SparseRam::__update_cache(paddr_t index, u_int8_t *m)
+void SparseRam::_free_node(void **node, int level)
 {
-
-  paddr_t big_index = 0;
-  u_long big_time = 0;
-
-  for (auto c = this->cache.begin(); c != this->cache.end(); c++)
+  for (int i = 0; i < (1 << level_bits); i++)
   {
-    auto tdata = c->second;
-    auto c_mem = std::get<0>(tdata);
-    auto c_tim = std::get<1>(tdata);
-    if (c_tim > big_time)
+    if (node[i] == NULL)
+    {
+      continue;
+    }
+    if (level == 0)
     {
-      big_time = c_tim;
-      big_index = c->first;
+      free(node[i]);
+    }
+    else
+    {
+      this->_free_node((void **)node[i], level - 1);
     }
-    std::tuple<u_int8_t *, u_long> ndata = std::make_tuple(c_mem, c_tim + 1);
-    c->second = ndata;
   }
+  free(node);
+}
 
-  std::tuple<u_int8_t *, u_long> a = std::make_tuple(m, 1);
-  this->cache[index] = a;
-
-  if (this->cache.size() < this->max_cache_size)
+// Return the leaf slot holding the block of index. The missing nodes on
+// the way are allocated if alloc is set, otherwise NULL is returned.
+u_int8_t **SparseRam::_blk_slot(paddr_t index, bool alloc)
+{
+  void **node = this->root;
+  for (int level = this->nr_levels - 1; level > 0; level--)
   {
-    return;
+    auto i = (index >> (level * level_bits)) & ((1 << level_bits) - 1);
+    if (unlikely(node[i] == NULL))
+    {
+      if (!alloc)
+      {
+        return NULL;
+      }
+      node[i] = calloc(1 << level_bits, sizeof(void *));
+    }
+    node = (void **)node[i];
   }
-  // need replace: remove biggest tim
-  vassert(big_index != 0, "find oldest item fail!");
-  cache.erase(big_index);
+  return (u_int8_t **)&node[index & ((1 << level_bits) - 1)];
 }
 
-bool SparseRam::_fast_count(paddr_t index)
+// Blocks are never freed before the SparseRam itself,
+// so the cache only needs to be filled, never invalidated.
+u_int8_t *SparseRam::_blk_lookup(paddr_t index)
 {
-  if (this->cache.count(index))
+  auto c = &this->cache[index % cache_size];
+  if (likely(c->blk != NULL && c->index == index))
   {
-    return true;
+    return c->blk;
+  }
+  auto slot = this->_blk_slot(index, false);
+  if (slot == NULL || *slot == NULL)
+  {
+    return NULL;
   }
-  // miss
-  auto ret = this->mem.count(index);
-  if (ret)
+  c->index = index;
+  c->blk = *slot;
+  return *slot;
+}
+
+u_int8_t *SparseRam::_blk_alloc(paddr_t index)
+{
+  auto blk = this->_blk_lookup(index);
+  if (likely(blk != NULL))
   {
-    this->__update_cache(index, this->mem[index]);
+    return blk;
   }
-  return ret;
+  auto slot = this->_blk_slot(index, true);
+  *slot = (u_int8_t *)calloc(this->block_size, sizeof(u_int8_t));
+  this->nr_blocks++;
+  auto c = &this->cache[index % cache_size];
+  c->index = index;
+  c->blk = *slot;
+  return *slot;
 }
 
-u_int8_t *SparseRam::_fast_mem(paddr_t index)
+void SparseRam::_foreach_node(void **node, int level, paddr_t index,
+                              std::function<void (paddr_t index, u_int8_t *blk)> &fn)
 {
-  if (this->cache.count(index))
+  for (int i = 0; i < (1 << level_bits); i++)
   {
-    return std::get<0>(this->cache[index]);
+    if (node[i] == NULL)
+    {
+      continue;
+    }
+    auto idx = (index << level_bits) | i;
+    if (level == 0)
+    {
+      fn(idx, (u_int8_t *)node[i]);
+    }
+    else
+    {
+      this->_foreach_node((void **)node[i], level - 1, idx, fn);
+    }
   }
-  // miss
-  auto ret = this->mem[index];
-  __update_cache(index, ret);
-  return ret;
+}
+
+// visit the allocated blocks in the order of their addresses
+void SparseRam::_foreach(std::function<void (paddr_t index, u_int8_t *blk)> fn)
+{
+  this->_foreach_node(this->root, this->nr_levels - 1, 0, fn);
 }
 
 bool SparseRam::load_bin(const char *file, paddr_t addr)
@@ -493,35 +547,23 @@ void SparseRam::read(paddr_t addr, size_t len, void *bytes)
     return;
   }
 
-  auto index_start = addr / this->block_size;
-  auto offst_start = addr % this->block_size;
-  auto offst_end = offst_start + len;
-  auto index_count = 1;
-  auto lenrm = len - (this->block_size - offst_start);
-
-  if (unlikely(lenrm > 0))
+  auto buff = (u_int8_t *)bytes;
+  while (len > 0)
   {
-    offst_end = lenrm % this->block_size;
-    index_count += lenrm / this->block_size;
-    if (likely(offst_end != 0))
+    auto offset = addr & this->block_mask;
+    auto size = std::min<size_t>(len, this->block_size - offset);
+    auto blk = this->_blk_lookup(addr >> this->block_shift);
+    if (blk == NULL)
     {
-      index_count += 1;
+      memset(buff, 0, size);
     }
-  }
-
-  auto i = 0;
-  auto buff = (u_int8_t *)bytes;
-  for (auto idx = 0; idx < index_count; idx++)
-  {
-    auto base = index_start + idx;
-    auto empt = !this->_fast_count(base);
-    auto of_start = idx == 0 ? offst_start : 0;
-    auto of_end = idx == index_count - 1 ? offst_end : this->block_size;
-    for (auto p = of_start; p < of_end; p++)
+    else
     {
-      buff[i] = empt ? 0 : this->_fast_mem(base)[p];
-      i += 1;
+      memcpy(buff, blk + offset, size);
     }
+    addr += size;
+    buff += size;
+    len -= size;
   }
 }
 
@@ -543,43 +585,20 @@ void SparseRam::write(paddr_t addr, size_t len, const void *bytes)
     return;
   }
 
-  auto index_start = addr / this->block_size;
-  auto offst_start = addr % this->block_size;
-  auto offst_end = offst_start + len;
-  auto lenrm = len - (this->block_size - offst_start);
-  auto index_count = 1;
-
-  if (unlikely(lenrm > 0))
-  {
-    offst_end = lenrm % this->block_size;
-    index_count += lenrm / this->block_size;
-    if (likely(offst_end != 0))
-    {
-      index_count += 1;
-    }
-  }
-
-  auto i = 0;
-  auto buff = (u_int8_t *)bytes;
-  for (auto idx = 0; idx < index_count; idx++)
+  auto buff = (const u_int8_t *)bytes;
+  while (len > 0)
   {
-    auto base = index_start + idx;
-    if (unlikely(!this->_fast_count(base)))
-    {
-      this->mem[base] = (u_int8_t *)calloc(this->block_size, sizeof(u_int8_t));
-    }
-    auto of_start = idx == 0 ? offst_start : 0;
-    auto of_end = idx == index_count - 1 ? offst_end : this->block_size;
-    for (auto p = of_start; p < of_end; p++)
-    {
-      this->_fast_mem(base)[p] = buff[i];
-      i += 1;
-    }
+    auto offset = addr & this->block_mask;
+    auto size = std::min<size_t>(len, this->block_size - offset);
+    memcpy(this->_blk_alloc(addr >> this->block_shift) + offset, buff, size);
+    addr += size;
+    buff += size;
+    len -= size;
   }
 }
 
 bool SparseRam::add_blk(char *name, paddr_t start, paddr_t end){
-  vassert(this->mem.empty(), "should first init big_blocks. not write mem");
+  vassert(this->nr_blocks == 0, "should first init big_blocks. not write mem");
   vassert(end > start, "big_block size need > 0");
   auto blk_name = std::string(name);
   vassert(!this->big_block.count(blk_name), "big_block is existed");
@@ -600,6 +619,20 @@ void *SparseRam::blk_host_addr(char *name){
   return NULL;
 }
 
+// Return the host address of the page of `size` bytes holding addr. The
+// block backing the page is allocated if needed, and stays at the same
+// host address until the SparseRam is deleted. Return NULL if the page
+// is not backed by a single block.
+u_int8_t *SparseRam::host_page(paddr_t addr, size_t size)
+{
+  if (!this->big_block.empty() || size > this->block_size)
+  {
+    return NULL;
+  }
+  auto start = addr & ~(paddr_t)(size - 1);
+  return this->_blk_alloc(start >> this->block_shift) + (start & this->block_mask);
+}
+
 SparseRam::sp_mm_blk *SparseRam::_blk_find(paddr_t addr){
   if (this->big_block.empty()){
     return NULL;
@@ -637,32 +670,29 @@ bool SparseRam::_blk_write(paddr_t addr, size_t len, const void* bytes){
 word_t SparseRam::read(paddr_t addr, int len)
 {
   vassert(len <= 8, "len error");
-  u_int8_t buff[8];
-  this->read(addr, 8, (void *)buff);
-
-  switch (len) {
-    case 1: return *(uint8_t  *)buff;
-    case 2: return *(uint16_t *)buff;
-    case 4: return *(uint32_t *)buff;
-    IFDEF(CONFIG_ISA64, case 8: return *(uint64_t *)buff);
-    default: MUXDEF(CONFIG_RT_CHECK, assert(0), return 0);
+  auto offset = addr & this->block_mask;
+  if (likely(this->big_block.empty() && offset + len <= this->block_size))
+  {
+    auto blk = this->_blk_lookup(addr >> this->block_shift);
+    return blk == NULL ? 0 : host_read(blk + offset, len);
   }
-  vassert(0, "size error");
-  return 0;
+  u_int8_t buff[8];
+  this->read(addr, (size_t)len, (void *)buff);
+  return host_read(buff, len);
 }
 
 void SparseRam::write(paddr_t addr, int len, word_t data)
 {
   vassert(len <= 8, "len error");
-  u_int8_t buff[8] = {0};
-  switch (len) {
-    case 1: *(uint8_t  *)buff = data; break;
-    case 2: *(uint16_t *)buff = data; break;
-    case 4: *(uint32_t *)buff = data; break;
-    IFDEF(CONFIG_ISA64, case 8: *(uint64_t *)buff = data; break);
-    IFDEF(CONFIG_RT_CHECK, default: assert(0));
+  auto offset = addr & this->block_mask;
+  if (likely(this->big_block.empty() && offset + len <= this->block_size))
+  {
+    host_write(this->_blk_alloc(addr >> this->block_shift) + offset, len, data);
+    return;
   }
-  return this->write(addr, len, (const void *)buff);
+  u_int8_t buff[8] = {0};
+  host_write(buff, len, data);
+  this->write(addr, (size_t)len, (const void *)buff);
 }
 
 endianness_t SparseRam::get_target_endianness()
@@ -672,10 +702,8 @@ endianness_t SparseRam::get_target_endianness()
 
 void SparseRam::copy_nzero_bytes(copy_mem_func copy_handler)
 {
-  for (auto iter = this->mem.begin(); iter != this->mem.end(); iter++)
-  {
-    auto addr = iter->first * this->block_size;
-    auto buff = iter->second;
+  this->_foreach([&](paddr_t index, u_int8_t *buff) {
+    auto addr = index << this->block_shift;
     u_int astart = 0;
     for (u_int i = 0; i < this->block_size; i++)
     {
@@ -693,7 +721,7 @@ void SparseRam::copy_nzero_bytes(copy_mem_func copy_handler)
     {
       copy_handler(addr + astart, this->block_size - astart, &buff[astart]);
     }
-  }
+  });
 }
 
 void SparseRam::copy(SparseRam *dst) {
@@ -726,18 +754,15 @@ void SparseRam::copy_bytes(copy_mem_func copy_handler)
     copy_handler(sbk->start, sbk->end - sbk->start, sbk->blk);
   }
   // copy norm mem
-  for (auto iter = this->mem.begin(); iter != this->mem.end(); iter++)
-  {
-    auto addr = iter->first * this->block_size;
-    auto buff = iter->second;
-    copy_handler(addr, this->block_size, buff);
-  }
+  this->_foreach([&](paddr_t index, u_int8_t *buff) {
+    copy_handler(index << this->block_shift, this->block_size, buff);
+  });
 }
 
 void SparseRam::print_info()
 {
   OUTPUT(stderr, "SpRam blocks: %ld, size: %.2f MB\n", 
-         this->mem.size(), float(this->mem.size() * this->block_size) / (1024.0 * 1024.0));
+         this->nr_blocks, float(this->nr_blocks * this->block_size) / (1024.0 * 1024.0));
 }
 
 /*******************************************Export CAPIs****************************************************************/
@@ -807,6 +832,11 @@ int sparse_mem_blk_add(void *self, char *name, paddr_t start, paddr_t end){
   return false;
 }
 
+void* sparse_mem_host_page(void *self, paddr_t addr, size_t size){
+  auto m = (SparseRam *)self;
+  return m->host_page(addr, size);
+}
+
 void sparse_mem_copy(void *dst, void *src){
   auto d = (SparseRam*)dst;
   auto s = (SparseRam*)src;
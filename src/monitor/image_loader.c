@@ -18,11 +18,16 @@
 #include <isa.h>
 #include <macro.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <memory/sparseram.h>
+#include <memory/image_loader.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #ifdef CONFIG_MEM_COMPRESS
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <zlib.h>
 #include <zstd.h>
@@ -31,91 +36,197 @@
 #ifndef CONFIG_MODE_USER
 
 #ifdef CONFIG_MEM_COMPRESS
-long load_gz_img(const char *filename) {
-  gzFile compressed_mem = gzopen(filename, "rb");
-  Assert(compressed_mem, "Can not open '%s'", filename);
+#define LOAD_BLOCK_SIZE 4096
+#define LOAD_CHUNK_SIZE (1 << 20)
+// larger frames are decompressed by streaming, to bound the buffer of each thread
+#define LOAD_MAX_FRAME_SIZE (64 << 20)
 
-  const uint32_t chunk_size = 16384;
-  uint8_t *temp_page = (uint8_t *)calloc(chunk_size, sizeof(long));
+static uint8_t* map_file(const char *filename, size_t *size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    printf("Cannot open compressed file %s\n", filename);
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    printf("File size is zero\n");
+    close(fd);
+    return NULL;
+  }
+  uint8_t *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    printf("Cannot map compressed file %s\n", filename);
+    return NULL;
+  }
+  madvise(p, st.st_size, MADV_SEQUENTIAL);
+  *size = st.st_size;
+  return p;
+}
+
+static bool is_zero_block(const uint8_t *p, size_t len) {
+  size_t i;
+  for (i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+    if (*(const uint64_t *)(p + i) != 0) return false;
+  }
+  for (; i < len; i ++) {
+    if (p[i] != 0) return false;
+  }
+  return true;
+}
+
+// Copy the decompressed data to pmem block by block. Zero blocks are only
+// written if pmem is not zero there, so that untouched pages stay unallocated.
+static void copy_nonzero(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t off;
+  for (off = 0; off < len; off += LOAD_BLOCK_SIZE) {
+    size_t n = len - off < LOAD_BLOCK_SIZE ? len - off : LOAD_BLOCK_SIZE;
+    if (!is_zero_block(src + off, n)) memcpy(dst + off, src + off, n);
+    else if (!is_zero_block(dst + off, n)) memset(dst + off, 0, n);
+  }
+}
+
+static uint64_t max_img_size() {
+  return MEMORY_SIZE - (RESET_VECTOR - CONFIG_MBASE);
+}
+
+long load_gz_img(const char *filename) {
+  size_t file_size = 0;
+  uint8_t *file = map_file(filename, &file_size);
+  Assert(file, "Can not open '%s'", filename);
+
+  // the boundaries of gzip members are only known after inflating them,
+  // so a gz file is decompressed on one thread
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  int ret = inflateInit2(&strm, 15 + 32);
+  Assert(ret == Z_OK, "Can not init zlib stream");
+  uint8_t *buf = malloc(LOAD_CHUNK_SIZE);
+  assert(buf);
   uint8_t *pmem_start = (uint8_t *)guest_to_host(RESET_VECTOR);
-  uint8_t *pmem_current;
 
-  // load file byte by byte to pmem
   uint64_t curr_size = 0;
-  while (curr_size < MEMORY_SIZE) {
-    uint32_t bytes_read = gzread(compressed_mem, temp_page, chunk_size);
-    if (bytes_read == 0) {
-      break;
+  strm.next_in = file;
+  strm.avail_in = file_size;
+  while (true) {
+    strm.next_out = buf;
+    strm.avail_out = LOAD_CHUNK_SIZE;
+    ret = inflate(&strm, Z_NO_FLUSH);
+    Assert(ret == Z_OK || ret == Z_STREAM_END, "Decompress failed at 0x%lx of '%s': %s",
+        strm.total_in, filename, strm.msg ? strm.msg : "truncated file");
+    size_t n = LOAD_CHUNK_SIZE - strm.avail_out;
+    Assert(curr_size + n <= max_img_size(), "File size is larger than buf_size!\n");
+    copy_nonzero(pmem_start + curr_size, buf, n);
+    curr_size += n;
+    if (ret == Z_STREAM_END) {
+      // gzip members may be concatenated
+      if (strm.avail_in == 0) break;
+      ret = inflateReset(&strm);
+      assert(ret == Z_OK);
     }
-    for (uint32_t x = 0; x < bytes_read; x++) {
-      pmem_current = pmem_start + curr_size + x;
-      uint8_t read_data = *(temp_page + x);
-      if (read_data != 0 || *pmem_current != 0) {
-        *pmem_current = read_data;
-      }
-    }
-    curr_size += bytes_read;
   }
 
-  // check again to ensure the bin has been fully loaded
-  uint32_t left_bytes = gzread(compressed_mem, temp_page, chunk_size);
-  Assert(left_bytes == 0, "File size is larger than buf_size!\n");
-
-  free(temp_page);
-  Assert(gzclose(compressed_mem) == Z_OK, "Error closing '%s'\n", filename);
+  inflateEnd(&strm);
+  free(buf);
+  munmap(file, file_size);
   return curr_size;
 }
 
-long load_zstd_img(const char *filename){
-  assert(filename);
-
-  int fd = -1;
-  int file_size = 0;
-  int compressed_file_buffer_size = 0;
-  uint8_t *compress_file_buffer = NULL;
-
-  fd = open(filename, O_RDONLY);
-  if (fd < 0) {
-    printf("Cannot open compressed file %s\n", filename);
-    return -1;
+typedef struct {
+  const uint8_t *src;
+  size_t csize;
+  size_t dsize;
+  uint64_t mem_offset;
+} ZstdImgFrame;
+
+typedef struct {
+  ZstdImgFrame *frames;
+  uint64_t nr_frames;
+  uint64_t next_frame;
+  size_t max_frame_size;
+  uint8_t *pmem_start;
+  // if given, the frames hold these pages in order, instead of pmem from the start
+  uint64_t *pages;
+} ZstdImgLoader;
+
+static void* zstd_img_worker(void *arg) {
+  ZstdImgLoader *loader = arg;
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  uint8_t *buf = malloc(loader->max_frame_size);
+  assert(dctx && buf);
+  uint64_t i;
+  while ((i = __atomic_fetch_add(&loader->next_frame, 1, __ATOMIC_RELAXED)) < loader->nr_frames) {
+    ZstdImgFrame *f = &loader->frames[i];
+    size_t ret = ZSTD_decompressDCtx(dctx, buf, f->dsize, f->src, f->csize);
+    Assert(!ZSTD_isError(ret) && ret == f->dsize, "Decompress failed at frame %ld: %s",
+        i, ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "size mismatch");
+    if (loader->pages == NULL) {
+      copy_nonzero(loader->pmem_start + f->mem_offset, buf, f->dsize);
+      continue;
+    }
+    size_t off;
+    for (off = 0; off < f->dsize; off += PAGE_SIZE) {
+      uint64_t page = loader->pages[(f->mem_offset + off) / PAGE_SIZE];
+      copy_nonzero(loader->pmem_start + page * PAGE_SIZE, buf + off, PAGE_SIZE);
+    }
   }
+  free(buf);
+  ZSTD_freeDCtx(dctx);
+  return NULL;
+}
 
-  file_size = lseek(fd, 0, SEEK_END);
-  if (file_size == 0) {
-    printf("File size is zero\n");
-    return -1;
+// Split the file into frames. Return false if the size of some frame is
+// unknown or too large to be decompressed at once.
+static bool scan_zstd_frames(const uint8_t *file, size_t file_size, ZstdImgLoader *loader) {
+  uint64_t capacity = 0, mem_offset = 0;
+  size_t off = 0;
+  while (off < file_size) {
+    size_t csize = ZSTD_findFrameCompressedSize(file + off, file_size - off);
+    if (ZSTD_isError(csize)) return false;
+    // skippable frames have a content size of 0
+    unsigned long long dsize = ZSTD_getFrameContentSize(file + off, csize);
+    if (dsize == ZSTD_CONTENTSIZE_UNKNOWN || dsize == ZSTD_CONTENTSIZE_ERROR ||
+        dsize > LOAD_MAX_FRAME_SIZE) return false;
+    if (dsize != 0) {
+      if (loader->nr_frames == capacity) {
+        capacity = capacity ? capacity * 2 : 1024;
+        loader->frames = realloc(loader->frames, capacity * sizeof(ZstdImgFrame));
+        assert(loader->frames);
+      }
+      loader->frames[loader->nr_frames ++] = (ZstdImgFrame) {
+        .src = file + off, .csize = csize, .dsize = dsize, .mem_offset = mem_offset };
+      if (dsize > loader->max_frame_size) loader->max_frame_size = dsize;
+      mem_offset += dsize;
+    }
+    off += csize;
   }
+  return true;
+}
 
-  lseek(fd, 0, SEEK_SET);
+static uint64_t zstd_frames_size(ZstdImgLoader *loader) {
+  if (loader->nr_frames == 0) return 0;
+  ZstdImgFrame *last = &loader->frames[loader->nr_frames - 1];
+  return last->mem_offset + last->dsize;
+}
 
-  compress_file_buffer = malloc(file_size);
-  if (!compress_file_buffer) {
-    printf("Compress file buffer create failed\n");
-    close(fd);
-    return -1;
+static void load_zstd_frames(ZstdImgLoader *loader) {
+  pthread_t threads[CONFIG_MEM_COMPRESS_THREADS];
+  int i;
+  for (i = 1; i < CONFIG_MEM_COMPRESS_THREADS; i ++) {
+    int ret = pthread_create(&threads[i], NULL, zstd_img_worker, loader);
+    Assert(ret == 0, "Can not create decompression thread %d", i);
   }
-
-  // read compressed file
-  compressed_file_buffer_size = read(fd, compress_file_buffer, file_size);
-  printf("read file size %d\n", compressed_file_buffer_size);
-  if (compressed_file_buffer_size != file_size) {
-    printf("Compress file read failed\n");
-    free(compress_file_buffer);
-    close(fd);
-    return -1;
+  zstd_img_worker(loader);
+  for (i = 1; i < CONFIG_MEM_COMPRESS_THREADS; i ++) {
+    pthread_join(threads[i], NULL);
   }
+}
 
-  close(fd);
-
-  // create decompress input buffer
-  ZSTD_inBuffer input = {compress_file_buffer, compressed_file_buffer_size, 0};
-
-  // alloc decompress buffer
-  const uint64_t decompress_file_buffer_size = 16384;
-  uint64_t *decompress_file_buffer = (uint64_t *)calloc(decompress_file_buffer_size, sizeof(uint64_t));
-  if (!decompress_file_buffer) {
+static long load_zstd_stream(const uint8_t *file, size_t file_size) {
+  ZSTD_inBuffer input = {file, file_size, 0};
+  uint8_t *buf = malloc(LOAD_CHUNK_SIZE);
+  if (!buf) {
     printf("Decompress file read failed\n");
-    free(compress_file_buffer);
     return -1;
   }
 
@@ -123,8 +234,7 @@ long load_zstd_img(const char *filename){
   ZSTD_DStream *dstream = ZSTD_createDStream();
   if (!dstream) {
     printf("Cannot create zstd dstream object\n");
-    free(compress_file_buffer);
-    free(decompress_file_buffer);
+    free(buf);
     return -1;
   }
 
@@ -132,64 +242,157 @@ long load_zstd_img(const char *filename){
   if (ZSTD_isError(init_result)) {
     printf("Cannot init dstream object: %s\n", ZSTD_getErrorName(init_result));
     ZSTD_freeDStream(dstream);
-    free(compress_file_buffer);
-    free(decompress_file_buffer);
+    free(buf);
     return -1;
   }
 
-  // def phymem
   uint8_t *pmem_start = (uint8_t *)guest_to_host(RESET_VECTOR);
-  uint64_t *pmem_current;
-
-  // decompress and write in memory
   uint64_t total_write_size = 0;
-  while (total_write_size < MEMORY_SIZE) {
-
-    ZSTD_outBuffer output = {decompress_file_buffer, decompress_file_buffer_size * sizeof(uint64_t), 0};
-
+  long ret = -1;
+  while (true) {
+    ZSTD_outBuffer output = {buf, LOAD_CHUNK_SIZE, 0};
     size_t result = ZSTD_decompressStream(dstream, &output, &input);
-
     if (ZSTD_isError(result)) {
       printf("Decompress failed: %s\n", ZSTD_getErrorName(result));
-      ZSTD_freeDStream(dstream);
-      free(compress_file_buffer);
-      free(decompress_file_buffer);
-
-      return -1;
+      break;
     }
-
-    if (output.pos == 0) {
+    if (total_write_size + output.pos > max_img_size()) {
+      printf("Binary size larger than memory\n");
       break;
     }
+    copy_nonzero(pmem_start + total_write_size, buf, output.pos);
+    total_write_size += output.pos;
+    if (output.pos < output.size && input.pos == input.size) {
+      if (result != 0) printf("Decompress failed: truncated file\n");
+      else ret = total_write_size;
+      break;
+    }
+  }
 
-    assert(decompress_file_buffer_size * sizeof(uint64_t) == output.pos);
+  ZSTD_freeDStream(dstream);
+  free(buf);
+  return ret;
+}
 
-    for (uint64_t x = 0; x < decompress_file_buffer_size; x++) {
-      pmem_current = (uint64_t *)(pmem_start + total_write_size) + x;
-      uint64_t read_data = *(decompress_file_buffer + x);
-      if (read_data != 0 || *pmem_current != 0) {
-        *pmem_current = read_data;
-      }
+static bool is_zstd_delta_img(const uint8_t *file, size_t file_size) {
+  uint32_t magic;
+  if (file_size < 4) return false;
+  memcpy(&magic, file, 4);
+  return magic == CPT_DELTA_MAGIC;
+}
+
+// Load the checkpoint a delta checkpoint is based on, and then the pages
+// changed since it.
+static long load_zstd_delta_img(const char *filename, const uint8_t *file, size_t file_size) {
+  uint32_t header_size = 0, page_size = 0, parent_len = 0;
+  uint64_t nr_pages = 0;
+  if (file_size >= 24) {
+    memcpy(&header_size, file + 4, 4);
+    memcpy(&page_size, file + 8, 4);
+    memcpy(&nr_pages, file + 12, 8);
+    memcpy(&parent_len, file + 20, 4);
+  }
+  if (page_size != PAGE_SIZE || 8ull + header_size > file_size ||
+      16ull + parent_len + (nr_pages + 7) / 8 > header_size) {
+    printf("Invalid delta checkpoint %s\n", filename);
+    return -1;
+  }
+  if (nr_pages * PAGE_SIZE > max_img_size()) {
+    printf("Binary size larger than memory\n");
+    return -1;
+  }
+
+  // the path of the base checkpoint is relative to the directory of the delta
+  const char *slash = strrchr(filename, '/');
+  int dir_len = slash ? slash - filename + 1 : 0;
+  char *parent = malloc(dir_len + parent_len + 1);
+  assert(parent);
+  memcpy(parent, filename, dir_len);
+  memcpy(parent + dir_len, file + 24, parent_len);
+  parent[dir_len + parent_len] = '\0';
+  Log("Loading delta checkpoint %s based on %s", filename, parent);
+  long ret = load_zstd_img(parent);
+  free(parent);
+  if (ret < 0) {
+    return ret;
+  }
+
+  const uint8_t *bitmap = file + 24 + parent_len;
+  ZstdImgLoader loader = { .pmem_start = (uint8_t *)guest_to_host(RESET_VECTOR) };
+  uint64_t nr_changed = 0, i;
+  for (i = 0; i < nr_pages; i ++) {
+    nr_changed += (bitmap[i / 8] >> (i % 8)) & 1;
+  }
+  loader.pages = malloc(nr_changed * sizeof(uint64_t) + 1);
+  assert(loader.pages);
+  for (i = 0, nr_changed = 0; i < nr_pages; i ++) {
+    if ((bitmap[i / 8] >> (i % 8)) & 1) loader.pages[nr_changed ++] = i;
+  }
+
+  const uint8_t *data = file + 8 + header_size;
+  bool valid = scan_zstd_frames(data, file_size - 8 - header_size, &loader) &&
+    zstd_frames_size(&loader) == nr_changed * PAGE_SIZE;
+  for (i = 0; valid && i < loader.nr_frames; i ++) {
+    valid = loader.frames[i].dsize % PAGE_SIZE == 0;
+  }
+  if (valid) {
+    load_zstd_frames(&loader);
+  } else {
+    printf("Invalid pages in delta checkpoint %s\n", filename);
+    ret = -1;
+  }
+
+  free(loader.pages);
+  free(loader.frames);
+  return ret;
+}
+
+static long load_zstd_full_img(const char *filename, const uint8_t *file, size_t file_size) {
+#ifdef CONFIG_MEM_COMPRESS_LAZY
+  long lazy_size = load_zstd_img_lazy(filename);
+  if (lazy_size != 0) {
+    return lazy_size;
+  }
+#endif
+
+  // independent frames with known sizes are decompressed in parallel
+  ZstdImgLoader loader = { .pmem_start = (uint8_t *)guest_to_host(RESET_VECTOR) };
+  long ret;
+  if (scan_zstd_frames(file, file_size, &loader) && loader.nr_frames > 0) {
+    uint64_t size = zstd_frames_size(&loader);
+    if (size > max_img_size()) {
+      printf("Binary size larger than memory\n");
+      ret = -1;
+    } else {
+      load_zstd_frames(&loader);
+      ret = size;
     }
-    total_write_size += output.pos;
+  } else {
+    ret = load_zstd_stream(file, file_size);
   }
 
-  ZSTD_outBuffer output = {decompress_file_buffer, decompress_file_buffer_size * sizeof(uint64_t), 0};
-  size_t result = ZSTD_decompressStream(dstream, &output, &input);
-  if (ZSTD_isError(result) || output.pos != 0) {
-    printf("Decompress failed: %s\n", ZSTD_getErrorName(result));
-    printf("Binary size larger than memory\n");
-    ZSTD_freeDStream(dstream);
-    free(compress_file_buffer);
-    free(decompress_file_buffer);
+  free(loader.frames);
+  return ret;
+}
+
+long load_zstd_img(const char *filename){
+  assert(filename);
+
+  size_t file_size = 0;
+  uint8_t *file = map_file(filename, &file_size);
+  if (!file) {
     return -1;
   }
 
-  ZSTD_freeDStream(dstream);
-  free(compress_file_buffer);
-  free(decompress_file_buffer);
+  long ret;
+  if (is_zstd_delta_img(file, file_size)) {
+    ret = load_zstd_delta_img(filename, file, file_size);
+  } else {
+    ret = load_zstd_full_img(filename, file, file_size);
+  }
 
-  return total_write_size;
+  munmap(file, file_size);
+  return ret;
 }
 
 #endif  //  CONFIG_MEM_COMPRESS
@@ -252,6 +455,7 @@ long load_img(char* img_name, char *which_img, uint64_t load_start, size_t img_s
     munmap(buf, size);
   }
 #else
+  lazy_restore_fill(guest_to_host(load_start), size);
   int ret = fread(guest_to_host(load_start), size, 1, fp);
   assert(ret == 1);
 #endif
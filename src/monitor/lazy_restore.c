@@ -0,0 +1,366 @@
+/***************************************************************************************
+* Copyright (c) 2020-2022 Institute of Computing Technology, Chinese Academy of Sciences
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <common.h>
+
+#ifdef CONFIG_MEM_COMPRESS_LAZY
+#include <isa.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <memory/image_loader.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
+
+// The memory of a lazily restored checkpoint is mapped without access.
+// A frame is decompressed on the first access to its memory by the
+// SIGSEGV handler, or earlier by a prefetch thread. The non-zero pages of
+// the frame are copied to new pages, which are then moved over the memory
+// of the frame with mremap(), so that no one sees a partially filled frame.
+
+enum { FRAME_PENDING, FRAME_LOADING, FRAME_LOADED };
+
+typedef struct {
+  uint64_t file_offset;
+  uint64_t mem_offset;
+  uint32_t csize;
+  uint32_t dsize;
+  int state;
+} CptFrame;
+
+typedef struct {
+  ZSTD_DCtx *dctx;
+  uint8_t *buf;
+} FrameLoader;
+
+static uint8_t *cpt_file = NULL;
+static size_t cpt_file_size = 0;
+static CptFrame *frames = NULL;
+static uint64_t nr_frames = 0;
+static uint32_t max_frame_size = 0;
+static uint8_t *mem_base = NULL;
+static uint64_t mem_size = 0;
+// one bit for each non-zero page, or NULL if the checkpoint has no page bitmap
+static uint8_t *page_bitmap = NULL;
+static uint64_t page_bitmap_pages = 0;
+
+static struct sigaction old_segv_action;
+// frames loaded by the SIGSEGV handler and lazy_restore_fill() share one loader
+static FrameLoader fault_loader;
+static bool fault_lock = false;
+
+// taken by the writer side on fork(), so that no frame is left loading
+// by a prefetch thread which does not exist in the child
+static pthread_rwlock_t prefetch_lock;
+static uint64_t prefetch_next = 0;
+
+static uint64_t nr_fault_loaded = 0;
+static uint64_t nr_prefetched = 0;
+
+static void init_loader(FrameLoader *l) {
+  l->dctx = ZSTD_createDCtx();
+  l->buf = malloc(ROUNDUP(max_frame_size, PAGE_SIZE));
+  Assert(l->dctx && l->buf, "Can not create the frame loader");
+}
+
+static void free_loader(FrameLoader *l) {
+  ZSTD_freeDCtx(l->dctx);
+  free(l->buf);
+}
+
+static bool is_nonzero_page(uint64_t page) {
+  if (page_bitmap == NULL || page >= page_bitmap_pages) return true;
+  return (page_bitmap[page / 8] >> (page % 8)) & 1;
+}
+
+static bool is_zero_page(uint8_t *p) {
+  uint64_t *w = (uint64_t *)p;
+  int i;
+  for (i = 0; i < PAGE_SIZE / sizeof(w[0]); i ++) {
+    if (w[i] != 0) return false;
+  }
+  return true;
+}
+
+// Return whether the frame is loaded by this call. If another thread is
+// loading it, wait until it is done.
+static bool load_frame(CptFrame *f, FrameLoader *l) {
+  int pending = FRAME_PENDING;
+  if (!__atomic_compare_exchange_n(&f->state, &pending, FRAME_LOADING, false,
+        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) != FRAME_LOADED);
+    return false;
+  }
+
+  size_t ret = ZSTD_decompressDCtx(l->dctx, l->buf, max_frame_size,
+      cpt_file + f->file_offset, f->csize);
+  Assert(!ZSTD_isError(ret) && ret == f->dsize, "Decompress failed at frame %ld: %s",
+      f - frames, ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "size mismatch");
+
+  size_t len = ROUNDUP(f->dsize, PAGE_SIZE);
+  memset(l->buf + f->dsize, 0, len - f->dsize);
+  uint8_t *pages = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  Assert(pages != MAP_FAILED, "Can not allocate pages for frame %ld", f - frames);
+  size_t off;
+  for (off = 0; off < len; off += PAGE_SIZE) {
+    if (is_nonzero_page((f->mem_offset + off) / PAGE_SIZE) &&
+        !is_zero_page(l->buf + off)) memcpy(pages + off, l->buf + off, PAGE_SIZE);
+  }
+  void *dst = mremap(pages, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, mem_base + f->mem_offset);
+  Assert(dst == mem_base + f->mem_offset, "Can not move pages to frame %ld", f - frames);
+
+  __atomic_store_n(&f->state, FRAME_LOADED, __ATOMIC_RELEASE);
+  return true;
+}
+
+static CptFrame* find_frame(uint64_t mem_offset) {
+  if (mem_offset >= mem_size) return NULL;
+  uint64_t l = 0, r = nr_frames;
+  // find the last frame starting at or before mem_offset
+  while (r - l > 1) {
+    uint64_t mid = (l + r) / 2;
+    if (frames[mid].mem_offset <= mem_offset) l = mid;
+    else r = mid;
+  }
+  return &frames[l];
+}
+
+static void fault_load_frame(CptFrame *f) {
+  while (__atomic_test_and_set(&fault_lock, __ATOMIC_ACQUIRE));
+  if (load_frame(f, &fault_loader)) nr_fault_loaded ++;
+  __atomic_clear(&fault_lock, __ATOMIC_RELEASE);
+}
+
+static void lazy_restore_sig_handler(int sig, siginfo_t *info, void *ucontext) {
+  uint8_t *addr = info->si_addr;
+  CptFrame *f = (addr >= mem_base ? find_frame(addr - mem_base) : NULL);
+  if (f == NULL) {
+    // not caused by lazy restoring, fault again with the previous handler
+    sigaction(SIGSEGV, &old_segv_action, NULL);
+    return;
+  }
+  fault_load_frame(f);
+}
+
+void lazy_restore_fill(void *haddr, size_t len) {
+  if (frames == NULL || len == 0) return;
+  uint8_t *p = haddr;
+  uint8_t *end = p + len;
+  if (p < mem_base) p = mem_base;
+  CptFrame *f;
+  while (p < end && (f = find_frame(p - mem_base)) != NULL) {
+    fault_load_frame(f);
+    p = mem_base + f->mem_offset + ROUNDUP(f->dsize, PAGE_SIZE);
+  }
+}
+
+static void* prefetch_main(void *arg) {
+  FrameLoader l;
+  init_loader(&l);
+  while (true) {
+    uint64_t i = __atomic_fetch_add(&prefetch_next, 1, __ATOMIC_RELAXED);
+    if (i >= nr_frames) break;
+    pthread_rwlock_rdlock(&prefetch_lock);
+    if (load_frame(&frames[i], &l)) __atomic_fetch_add(&nr_prefetched, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&prefetch_lock);
+  }
+  free_loader(&l);
+  return NULL;
+}
+
+static void prefetch_fork_prepare() {
+  pthread_rwlock_wrlock(&prefetch_lock);
+  while (__atomic_test_and_set(&fault_lock, __ATOMIC_ACQUIRE));
+}
+
+static void prefetch_fork_done() {
+  __atomic_clear(&fault_lock, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&prefetch_lock);
+}
+
+static void start_prefetch() {
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  // the prefetch threads take the lock again and again
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&prefetch_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  pthread_atfork(prefetch_fork_prepare, prefetch_fork_done, prefetch_fork_done);
+
+  int i;
+  for (i = 0; i < CONFIG_MEM_COMPRESS_PREFETCH_THREADS; i ++) {
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, prefetch_main, NULL);
+    Assert(ret == 0, "Can not create prefetch thread %d", i);
+    pthread_detach(thread);
+  }
+}
+
+// Build the frame list from the seek table at the end of the file.
+// Return false if there is no valid seek table.
+static bool parse_seek_table() {
+  if (cpt_file_size < CPT_SEEK_TABLE_FOOTER_SIZE + 8) return false;
+  uint8_t *footer = cpt_file + cpt_file_size - CPT_SEEK_TABLE_FOOTER_SIZE;
+  uint32_t nr, magic;
+  memcpy(&nr, footer, 4);
+  memcpy(&magic, footer + 5, 4);
+  if (magic != CPT_SEEKABLE_MAGIC) return false;
+  int entry_size = (footer[4] & 0x80) ? 12 : 8; // with checksums or not
+  uint64_t table_size = (uint64_t)nr * entry_size + CPT_SEEK_TABLE_FOOTER_SIZE;
+  if (table_size + 8 > cpt_file_size) return false;
+  uint8_t *header = footer - (uint64_t)nr * entry_size - 8;
+  uint32_t skippable_magic, skippable_size;
+  memcpy(&skippable_magic, header, 4);
+  memcpy(&skippable_size, header + 4, 4);
+  if (skippable_magic != CPT_SKIPPABLE_MAGIC || skippable_size != table_size) return false;
+
+  frames = calloc(nr, sizeof(CptFrame));
+  assert(frames);
+  uint64_t file_offset = 0, mem_offset = 0;
+  uint8_t *entry = header + 8;
+  uint32_t i;
+  for (i = 0; i < nr; i ++, entry += entry_size) {
+    CptFrame *f = &frames[nr_frames];
+    memcpy(&f->csize, entry, 4);
+    memcpy(&f->dsize, entry + 4, 4);
+    f->file_offset = file_offset;
+    f->mem_offset = mem_offset;
+    f->state = FRAME_PENDING;
+    file_offset += f->csize;
+    mem_offset += f->dsize;
+    if (f->dsize == 0) {
+      // a skippable frame, which may be the page bitmap
+      uint8_t *p = cpt_file + f->file_offset;
+      uint32_t magic = 0, page_size = 0;
+      if (f->csize >= 20) {
+        memcpy(&magic, p, 4);
+        memcpy(&page_size, p + 8, 4);
+      }
+      if (magic == CPT_PAGE_BITMAP_MAGIC && page_size == PAGE_SIZE) {
+        memcpy(&page_bitmap_pages, p + 12, 8);
+        if (f->csize >= 20 + (page_bitmap_pages + 7) / 8) page_bitmap = p + 20;
+      }
+      continue;
+    }
+    // frames are mapped by pages, only the last one may end in the middle of a page
+    if (f->mem_offset % PAGE_SIZE != 0) break;
+    if (f->dsize > max_frame_size) max_frame_size = f->dsize;
+    nr_frames ++;
+  }
+  if (i != nr || file_offset != header - cpt_file) {
+    free(frames);
+    frames = NULL;
+    nr_frames = 0;
+    page_bitmap = NULL;
+    return false;
+  }
+  mem_size = ROUNDUP(mem_offset, PAGE_SIZE);
+  return true;
+}
+
+// Map the frames without non-zero pages in the page bitmap as fresh anonymous
+// memory, so that they are neither decompressed nor faulted on.
+static void map_zero_frames() {
+  if (page_bitmap == NULL) return;
+  uint64_t i, nr_zero = 0;
+  for (i = 0; i < nr_frames; i ++) {
+    CptFrame *f = &frames[i];
+    uint64_t page = f->mem_offset / PAGE_SIZE;
+    uint64_t end = page + ROUNDUP(f->dsize, PAGE_SIZE) / PAGE_SIZE;
+    while (page < end && !is_nonzero_page(page)) page ++;
+    if (page < end) continue;
+    void *p = mmap(mem_base + f->mem_offset, ROUNDUP(f->dsize, PAGE_SIZE), PROT_READ | PROT_WRITE,
+        MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0);
+    Assert(p == mem_base + f->mem_offset, "Can not map zero frame %ld", i);
+    f->state = FRAME_LOADED;
+    nr_zero ++;
+  }
+  Log("lazy restore: %ld of %ld frames are zero", nr_zero, nr_frames);
+}
+
+// Return the size of the checkpoint, 0 if it has no seek table, or -1 on errors.
+long load_zstd_img_lazy(const char *filename) {
+  assert(frames == NULL);
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    printf("Cannot open compressed file %s\n", filename);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    printf("File size is zero\n");
+    close(fd);
+    return -1;
+  }
+  cpt_file_size = st.st_size;
+  cpt_file = mmap(NULL, cpt_file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (cpt_file == MAP_FAILED) {
+    printf("Cannot map compressed file %s\n", filename);
+    cpt_file = NULL;
+    return -1;
+  }
+
+  if (!parse_seek_table()) {
+    munmap(cpt_file, cpt_file_size);
+    cpt_file = NULL;
+    return 0;
+  }
+  if (mem_size > MEMORY_SIZE - (RESET_VECTOR - CONFIG_MBASE)) {
+    printf("Binary size larger than memory\n");
+    free(frames);
+    frames = NULL;
+    nr_frames = 0;
+    mem_size = 0;
+    page_bitmap = NULL;
+    munmap(cpt_file, cpt_file_size);
+    cpt_file = NULL;
+    return -1;
+  }
+
+  mem_base = guest_to_host(RESET_VECTOR);
+  int ret = mprotect(mem_base, mem_size, PROT_NONE);
+  Assert(ret == 0, "Can not protect the memory of the checkpoint");
+  init_loader(&fault_loader);
+  map_zero_frames();
+
+  struct sigaction s;
+  memset(&s, 0, sizeof(s));
+  s.sa_sigaction = lazy_restore_sig_handler;
+  s.sa_flags = SA_SIGINFO;
+  ret = sigaction(SIGSEGV, &s, &old_segv_action);
+  Assert(ret == 0, "Can not set signal handler");
+
+  if (CONFIG_MEM_COMPRESS_PREFETCH_THREADS > 0) start_prefetch();
+
+  Log("Restoring %ld frames of %s lazily, with %d prefetch threads",
+      nr_frames, filename, CONFIG_MEM_COMPRESS_PREFETCH_THREADS);
+  return mem_size;
+}
+
+void lazy_restore_statistic() {
+  if (frames == NULL) return;
+  Log("lazy restore: frames = %'ld, loaded on access = %'ld, prefetched = %'ld",
+      nr_frames, nr_fault_loaded, __atomic_load_n(&nr_prefetched, __ATOMIC_RELAXED));
+}
+#endif
@@ -19,6 +19,7 @@
 #include <profiling/profiling_control.h>
 #include <memory/image_loader.h>
 #include <memory/paddr.h>
+#include <utils.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -108,9 +109,13 @@ static inline int parse_args(int argc, char *argv[]) {
     {"cpt-mmode"          , no_argument      , NULL, 7},
     {"map-cpt"            , required_argument, NULL, 10},
     {"checkpoint-format"  , required_argument, NULL, 12},
+    {"cpt-jobs"           , required_argument, NULL, 16},
+    {"cpt-delta-chain"    , required_argument, NULL, 17},
 
     // profiling
     {"simpoint-profile"   , no_argument      , NULL, 3},
+    {"simpoint-profile-jobs", required_argument, NULL, 14},
+    {"simpoint-shard-intervals", required_argument, NULL, 15},
     {"dont-skip-boot"     , no_argument      , NULL, 6},
     {"mem_use_record_file", required_argument, NULL, 'A'},
     // restore cpt
@@ -186,12 +191,16 @@ static inline int parse_args(int argc, char *argv[]) {
           #endif
 
       case 5: sscanf(optarg, "%lu", &checkpoint_interval); break;
+      case 16: sscanf(optarg, "%d", &checkpoint_jobs); break;
+      case 17: sscanf(optarg, "%d", &checkpoint_delta_chain); break;
 
       case 3:
         assert(profiling_state == NoProfiling);
         profiling_state = SimpointProfiling;
         Log("Doing Simpoint Profiling");
         break;
+      case 14: sscanf(optarg, "%d", &simpoint_profiling_jobs); break;
+      case 15: sscanf(optarg, "%lu", &simpoint_shard_intervals); break;
       case 6:
         // start profiling/checkpointing right after boot,
         // instead of waiting for the pseudo inst to notify NEMU.
@@ -265,9 +274,13 @@ static inline int parse_args(int argc, char *argv[]) {
         printf("\t--manual-oneshot-cpt    Manually take one-shot cpt by send signal.\n");
         printf("\t--manual-uniform-cpt    Manually take uniform cpt by send signal.\n");
         printf("\t--checkpoint-format     Specify the checkpoint format('gz' or 'zstd'), default: 'gz'.\n");
+        printf("\t--cpt-jobs=N            write checkpoints with up to N forked worker processes\n");
+        printf("\t--cpt-delta-chain=N     write up to N uniform cpts in a row as the pages changed since the previous one (_.delta.zstd)\n");
 //        printf("\t--map-cpt               map to this file as pmem, which can be treated as a checkpoint.\n"); //comming back soon
 
         printf("\t--simpoint-profile      simpoint profiling\n");
+        printf("\t--simpoint-profile-jobs=N  profile shards of the instruction stream with N worker processes\n");
+        printf("\t--simpoint-shard-intervals=M  number of intervals in each shard of parallel profiling, default: 100\n");
         printf("\t--dont-skip-boot        profiling/checkpoint immediately after boot\n");
         printf("\t--mem_use_record_file   result output file for analyzing the memory use segment\n");
 //        printf("\t--cpt-id                checkpoint id\n");
@@ -326,8 +339,11 @@ void init_monitor(int argc, char *argv[]) {
   // when there is a gcpt[restorer], we put bbl after gcpt[restorer]
   uint64_t bbl_start = 0;
   long img_size = 0; // how large we should copy for difftest
+  uint64_t restore_start = get_time();
 
   if (checkpoint_restoring) {
+    // the gcpt restorer only restores one hart
+    IFDEF(CONFIG_SMP, panic("Restoring checkpoints is not supported with CONFIG_SMP yet"));
     // When restoring cpt, gcpt restorer from cmdline is optional,
     // because a gcpt already ships a restorer
     assert(img_file != NULL);
@@ -382,6 +398,10 @@ void init_monitor(int argc, char *argv[]) {
   /* Initialize devices. */
   init_device();
 
+  if (checkpoint_restoring) {
+    Log("Checkpoint restored in %ld us before running the first instruction",
+        get_time() - restore_start);
+  }
 #endif
 
   /* Compile the regular expressions. */
@@ -20,6 +20,7 @@
 #ifndef __ICS_EXPORT
 #include <memory/paddr.h>
 #include <memory/vaddr.h>
+#include <memory/image_loader.h>
 #include <cpu/difftest.h>
 #endif
 
@@ -185,6 +186,7 @@ static int cmd_save(char *args) {
     FILE *fp = fopen(arg, "w");
     assert(fp != NULL);
     fwrite(&cpu, sizeof(cpu), 1, fp);
+    lazy_restore_fill(guest_to_host(CONFIG_MBASE), MEMORY_SIZE);
     fwrite(guest_to_host(CONFIG_MBASE), MEMORY_SIZE, 1, fp);
     fclose(fp);
   }
@@ -204,7 +206,9 @@ static int cmd_load(char *args) {
     assert(fp != NULL);
     __attribute__((unused)) int ret;
     ret = fread(&cpu, sizeof(cpu), 1, fp);
+    lazy_restore_fill(guest_to_host(CONFIG_MBASE), MEMORY_SIZE);
     ret = fread(guest_to_host(CONFIG_MBASE), MEMORY_SIZE, 1, fp);
+    IFDEF(CONFIG_PERF_OPT, pmem_code_page_write(CONFIG_MBASE, MEMORY_SIZE));
     fclose(fp);
   }
   return 0;
@@ -1,10 +1,16 @@
 #include <profiling/profiling_control.h>
+#include <device/alarm.h>
 
 int profiling_state = NoProfiling;
 int checkpoint_state = NoCheckpoint;
 bool checkpoint_taking = false;
 bool checkpoint_restoring = false;
 uint64_t checkpoint_interval = 0;
+int checkpoint_jobs = 1;
+int checkpoint_delta_chain = 0;
+
+int simpoint_profiling_jobs = 1;
+uint64_t simpoint_shard_intervals = 100;
 
 bool recvd_manual_oneshot_cpt = false;
 bool recvd_manual_uniform_cpt = false;
@@ -15,9 +21,10 @@ bool donot_skip_boot=false;
 bool workload_loaded=false;
 
 void reset_inst_counters() {
-  extern uint64_t g_nr_guest_instr;
+  extern HART_LOCAL uint64_t g_nr_guest_instr;
   extern bool workload_loaded;
   Log("Start profiling, resetting inst count from %lu to 1, (n_remain_total will not be cleared)\n", g_nr_guest_instr);
+  IFDEF(CONFIG_VIRTUAL_TIME, vtime_instr_cnt_reset(g_nr_guest_instr, 1));
   g_nr_guest_instr = 1;
   workload_loaded=true;
 }
@@ -15,6 +15,7 @@
 
 #include "debug.h"
 #include <common.h>
+#include <memory/image_loader.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
@@ -57,5 +58,8 @@ bool is_zstd_file(const char *filename){
   close(fd);
 
   const uint8_t zstd_magic[4] = {0x28, 0xB5, 0x2F, 0xFD};
-  return memcmp(buf, zstd_magic, 4) == 0;
+  // delta checkpoints start with a skippable frame instead
+  uint32_t magic;
+  memcpy(&magic, buf, 4);
+  return memcmp(buf, zstd_magic, 4) == 0 || magic == CPT_DELTA_MAGIC;
 }
\ No newline at end of file